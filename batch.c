@@ -0,0 +1,341 @@
+/**
+ * Copyright (c) 2014-2016 Timothy Elliott
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "batch.h"
+#include "mapfile.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/**
+ * Longest job line we accept.
+ */
+#define LINE_MAX_LEN 8192
+
+/**
+ * State shared by the batch worker threads. The lock guards reading the jobs
+ * stream and writing status lines.
+ */
+struct batch {
+	FILE *jobs;
+	FILE *status;
+	struct batch_ops *ops;
+	unsigned long line; // line number of the last line read
+	char ahead[LINE_MAX_LEN]; // next job line, read early to prefetch it
+	unsigned long ahead_line; // line number of ahead, 0 if there is none
+	int ahead_long; // ahead was cut off at LINE_MAX_LEN
+	int failed; // number of failed jobs
+	pthread_mutex_t lock;
+};
+
+/**
+ * Parse a width or height, which is a positive decimal number without a sign.
+ * Returns 0 if it isn't one.
+ */
+static uint32_t batch_dim(const char *s)
+{
+	unsigned long dim;
+	char *end;
+
+	if (*s < '0' || *s > '9') {
+		return 0;
+	}
+	errno = 0;
+	dim = strtoul(s, &end, 10);
+	if (*end || errno || dim > UINT32_MAX) {
+		return 0;
+	}
+	return dim;
+}
+
+/**
+ * Split a job line into fields. Returns 0 on success and -1 if the line is
+ * malformed, in which case err is set.
+ */
+static int batch_parse(char *buf, struct batch_job *job, const char **err)
+{
+	char *width, *height, *save;
+	int i;
+
+	job->input = strtok_r(buf, " \t\r\n", &save);
+	job->output = strtok_r(NULL, " \t\r\n", &save);
+	width = strtok_r(NULL, " \t\r\n", &save);
+	height = strtok_r(NULL, " \t\r\n", &save);
+
+	if (!height) {
+		*err = "Expected INPUT OUTPUT WIDTH HEIGHT";
+		return -1;
+	}
+	for (i=0; i<=BATCH_OPTS_MAX; i++) {
+		job->opts[i] = strtok_r(NULL, " \t\r\n", &save);
+		if (!job->opts[i]) {
+			break;
+		}
+	}
+	if (i > BATCH_OPTS_MAX) {
+		*err = "Too many options";
+		return -1;
+	}
+
+	job->width = batch_dim(width);
+	if (!job->width) {
+		*err = "Invalid width";
+		return -1;
+	}
+	job->height = batch_dim(height);
+	if (!job->height) {
+		*err = "Invalid height";
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Read the next job line of the jobs stream into buf. Returns 0 at the end of
+ * the jobs stream, and 2 for a line that doesn't fit in LINE_MAX_LEN, whose
+ * rest is skipped.
+ */
+static int batch_read(struct batch *b, char *buf)
+{
+	size_t len;
+	int c, cut;
+
+	for (;;) {
+		if (!fgets(buf, LINE_MAX_LEN, b->jobs)) {
+			return 0;
+		}
+		b->line++;
+		cut = 0;
+		if (!strchr(buf, '\n')) {
+			while ((c = getc(b->jobs)) != EOF && c != '\n') {
+				cut = 1;
+			}
+		}
+		len = strspn(buf, " \t\r\n");
+		if (buf[len] && buf[len] != '#') {
+			return cut ? 2 : 1;
+		}
+	}
+}
+
+/**
+ * Take the next job line into buf and read the one after it ahead. The input
+ * path of that one is copied to next, or next is set to "" at the end of the
+ * jobs stream. Returns 0 when there are no jobs left, and 2 if the line taken
+ * was too long.
+ */
+static int batch_next(struct batch *b, char *buf, unsigned long *line,
+	char *next)
+{
+	size_t start, len;
+	int got, ret;
+
+	pthread_mutex_lock(&b->lock);
+	if (!b->ahead_line && (got = batch_read(b, b->ahead))) {
+		b->ahead_line = b->line;
+		b->ahead_long = got == 2;
+	}
+	if (!b->ahead_line) {
+		pthread_mutex_unlock(&b->lock);
+		return 0;
+	}
+	strcpy(buf, b->ahead);
+	*line = b->ahead_line;
+	ret = b->ahead_long ? 2 : 1;
+
+	got = batch_read(b, b->ahead);
+	b->ahead_line = got ? b->line : 0;
+	b->ahead_long = got == 2;
+	next[0] = 0;
+	if (b->ahead_line && !b->ahead_long) {
+		start = strspn(b->ahead, " \t\r\n");
+		len = strcspn(b->ahead + start, " \t\r\n");
+		memcpy(next, b->ahead + start, len);
+		next[len] = 0;
+	}
+	pthread_mutex_unlock(&b->lock);
+	return ret;
+}
+
+static void batch_report(struct batch *b, struct batch_job *job,
+	const char *err)
+{
+	pthread_mutex_lock(&b->lock);
+	if (err) {
+		b->failed++;
+		fprintf(b->status, "%lu\terror\t%s\t%s\n", job->line,
+			job->input ? job->input : "-", err);
+	} else {
+		fprintf(b->status, "%lu\tok\t%s\t%s\n", job->line, job->input,
+			job->output);
+	}
+	fflush(b->status);
+	pthread_mutex_unlock(&b->lock);
+}
+
+/**
+ * Create a temporary file next to the output of job, named in tmp, which holds
+ * len bytes. The output is written there and renamed into place once it is
+ * done, so a failed job leaves nothing behind, and an output that is its own
+ * input doesn't truncate the mapped input while it is being read.
+ */
+static FILE *batch_open_tmp(struct batch_job *job, char *tmp, size_t len)
+{
+	FILE *f;
+	int fd;
+
+	if ((size_t)snprintf(tmp, len, "%s.%ld.%lu.tmp", job->output,
+		(long)getpid(), job->line) >= len) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+	fd = open(tmp, O_WRONLY | O_CREAT | O_EXCL, 0666);
+	if (fd < 0) {
+		return NULL;
+	}
+	f = fdopen(fd, "wb");
+	if (!f) {
+		close(fd);
+		remove(tmp);
+	}
+	return f;
+}
+
+static void batch_job_run(struct batch *b, void *ctx, struct batch_job *job)
+{
+	struct mapped_file input;
+	char tmp[LINE_MAX_LEN + 64];
+	FILE *output;
+	const char *err;
+
+	if (load_file(&input, job->input)) {
+		batch_report(b, job, strerror(errno));
+		return;
+	}
+
+	output = batch_open_tmp(job, tmp, sizeof(tmp));
+	if (!output) {
+		batch_report(b, job, strerror(errno));
+		unmap_file(&input);
+		return;
+	}
+
+	err = NULL;
+	if (b->ops->run(ctx, input.buf, input.len, output, job, &err) &&
+		!err) {
+		err = "Unknown error";
+	}
+	unmap_file(&input);
+	if (fclose(output) && !err) {
+		err = strerror(errno);
+	}
+	if (!err && rename(tmp, job->output)) {
+		err = strerror(errno);
+	}
+	if (err) {
+		remove(tmp);
+	}
+	batch_report(b, job, err);
+}
+
+static void *batch_worker(void *arg)
+{
+	struct batch *b;
+	struct batch_job job;
+	char buf[LINE_MAX_LEN], next[LINE_MAX_LEN];
+	const char *err;
+	void *ctx;
+	int ret;
+
+	b = arg;
+	ctx = b->ops->ctx_new(b->ops->arg);
+
+	while ((ret = batch_next(b, buf, &job.line, next))) {
+		if (*next) {
+			prefetch_file(next);
+		}
+		if (ret == 2) {
+			job.input = NULL;
+			batch_report(b, &job, "Line too long");
+		} else if (batch_parse(buf, &job, &err)) {
+			batch_report(b, &job, err);
+		} else if (!ctx) {
+			batch_report(b, &job, "Unable to allocate worker context");
+		} else {
+			batch_job_run(b, ctx, &job);
+		}
+	}
+
+	if (ctx) {
+		b->ops->ctx_free(ctx);
+	}
+	return NULL;
+}
+
+int batch_run(FILE *jobs, FILE *status, struct batch_ops *ops,
+	unsigned threads)
+{
+	struct batch b;
+	pthread_t *tids;
+	unsigned i, started;
+
+	b.jobs = jobs;
+	b.status = status;
+	b.ops = ops;
+	b.line = 0;
+	b.ahead_line = 0;
+	b.ahead_long = 0;
+	b.failed = 0;
+	pthread_mutex_init(&b.lock, NULL);
+
+	tids = malloc(threads * sizeof(pthread_t));
+	if (!tids) {
+		pthread_mutex_destroy(&b.lock);
+		return -1;
+	}
+
+	for (started=0; started<threads; started++) {
+		if (pthread_create(&tids[started], NULL, batch_worker, &b)) {
+			break;
+		}
+	}
+
+	/* carry on with the threads we have, unless we have none */
+	if (!started) {
+		free(tids);
+		pthread_mutex_destroy(&b.lock);
+		return -1;
+	}
+
+	for (i=0; i<started; i++) {
+		pthread_join(tids[i], NULL);
+	}
+
+	free(tids);
+	pthread_mutex_destroy(&b.lock);
+	return b.failed;
+}
@@ -0,0 +1,94 @@
+/**
+ * Copyright (c) 2014-2016 Timothy Elliott
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Most options a job line can have after its size.
+ */
+#define BATCH_OPTS_MAX 16
+
+/**
+ * A job parsed from a line of the jobs stream.
+ */
+struct batch_job {
+	unsigned long line;
+	char *input;
+	char *output;
+	uint32_t width;
+	uint32_t height;
+	char *opts[BATCH_OPTS_MAX + 1]; // options of the job, NULL terminated
+};
+
+/**
+ * Callbacks used by batch_run().
+ *
+ * ctx_new() creates the context for one worker thread from arg. It is passed
+ * to every job run on that thread and freed with ctx_free() when the jobs run
+ * out.
+ *
+ * run() scales the in_len bytes at in, the input file of job in memory,
+ * into output. It returns 0 on success. On failure it returns non-zero and
+ * points err at a message describing the problem, which must stay valid until
+ * the next job on the same context.
+ */
+struct batch_ops {
+	void *(*ctx_new)(void *arg);
+	void (*ctx_free)(void *ctx);
+	int (*run)(void *ctx, const uint8_t *in, size_t in_len, FILE *output,
+		const struct batch_job *job, const char **err);
+	void *arg;
+};
+
+/**
+ * Run the jobs listed in the jobs stream on threads worker threads.
+ *
+ * Each line holds one job as whitespace separated fields:
+ *
+ *   INPUT OUTPUT WIDTH HEIGHT [OPTION]...
+ *
+ * The options are left to run() to apply on top of those of the whole batch.
+ * Empty lines and lines starting with # are skipped. Inputs are memory mapped,
+ * or read into memory when they can't be like pipes, and the input of the next
+ * job is prefetched while the current one runs. As each job finishes, a tab
+ * separated status line is written to status:
+ *
+ *   LINE ok INPUT OUTPUT
+ *   LINE error INPUT MESSAGE
+ *
+ * A job line longer than 8191 bytes fails with INPUT "-" and "Line too long".
+ *
+ * Outputs are written to a temporary file next to them and renamed into place
+ * when the job succeeds, so a failed job leaves no output behind and a job may
+ * replace its own input.
+ *
+ * Returns the number of jobs that failed, or -1 if a worker thread could not
+ * be started.
+ */
+int batch_run(FILE *jobs, FILE *status, struct batch_ops *ops,
+	unsigned threads);
+
+#endif
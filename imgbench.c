@@ -0,0 +1,546 @@
+#define _GNU_SOURCE
+#include "resample.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <jpeglib.h>
+#include <png.h>
+
+/**
+ * Each kernel benchmark repeats until it has run for at least this long, and
+ * keeps the fastest run.
+ */
+#define MIN_SECONDS 0.2
+
+/**
+ * Each tool is run up to TOOL_RUNS times, stopping early once it has run for
+ * TOOL_SECONDS. The fastest run is reported.
+ */
+#define TOOL_RUNS 3
+#define TOOL_SECONDS 1.0
+
+/**
+ * Input sizes and scale factors of the benchmark matrix. Scale factors are in
+ * eighths, so 1 is an 8x reduction and 16 a 2x enlargement.
+ */
+static const uint32_t sizes[][2] = {{640, 480}, {1920, 1080}};
+static const uint32_t scales[] = {1, 4, 6, 16};
+
+/**
+ * An uncompressed image, one malloc per scanline like the decoders produce.
+ */
+struct image {
+	uint32_t width;
+	uint32_t height;
+	uint8_t cmp;
+	uint8_t **sl;
+};
+
+/**
+ * One benchmark case. The function runs it once.
+ */
+struct bench {
+	const char *name;
+	struct image *img;
+	uint32_t out_width;
+	uint32_t out_height;
+	int kernel; // enum imgscale_filter
+	int fd; // encoded input for the tool benchmarks
+	const char *tool;
+};
+
+static const char *filter;
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Fill an image with gradients and noise, seeded so every run benchmarks the
+ * same pixels.
+ */
+static void image_init(struct image *img, uint32_t width, uint32_t height,
+	uint8_t cmp)
+{
+	uint32_t x, y, seed;
+	uint8_t c, *row;
+
+	img->width = width;
+	img->height = height;
+	img->cmp = cmp;
+	img->sl = malloc(height * sizeof(uint8_t *));
+	seed = 2463534242u;
+	for (y=0; y<height; y++) {
+		row = img->sl[y] = malloc((size_t)width * cmp);
+		for (x=0; x<width; x++) {
+			for (c=0; c<cmp; c++) {
+				seed ^= seed << 13;
+				seed ^= seed >> 17;
+				seed ^= seed << 5;
+				*row++ = (x * 255 / width + y * 3 + c * 80) ^
+					(seed & 0x1F);
+			}
+		}
+	}
+}
+
+static void image_free(struct image *img)
+{
+	uint32_t y;
+	for (y=0; y<img->height; y++) {
+		free(img->sl[y]);
+	}
+	free(img->sl);
+}
+
+/* kernels */
+
+/**
+ * x-scale every scanline with xscale_padded(), which sets up its coefficients
+ * on every call.
+ */
+static void run_xscale_padded(struct bench *b)
+{
+	struct image *img;
+	uint8_t *psl, *out;
+	size_t len, offset;
+	uint32_t y;
+
+	img = b->img;
+	len = padded_sl_len_offset(img->width, b->out_width, b->kernel, img->cmp,
+		&offset);
+	psl = malloc(len);
+	out = malloc((size_t)b->out_width * img->cmp);
+	for (y=0; y<img->height; y++) {
+		memcpy(psl + offset, img->sl[y], (size_t)img->width * img->cmp);
+		padded_sl_extend_edges(psl, img->width, offset, img->cmp);
+		xscale_padded(psl + offset, img->width, out, b->out_width,
+			b->kernel, img->cmp, 0);
+	}
+	free(out);
+	free(psl);
+}
+
+/**
+ * y-scale the image at its input width with strip_scale().
+ */
+static void run_strip_scale(struct bench *b)
+{
+	struct image *img;
+	uint8_t **virt, *out;
+	uint32_t i, y, taps;
+	int32_t pos, safe;
+	float ty;
+
+	img = b->img;
+	taps = calc_taps(img->height, b->out_height, b->kernel);
+	virt = malloc(taps * sizeof(uint8_t *));
+	out = malloc((size_t)img->width * img->cmp);
+	for (y=0; y<b->out_height; y++) {
+		pos = split_map(img->height, b->out_height, y, &ty) + 1 -
+			taps / 2;
+		for (i=0; i<taps; i++, pos++) {
+			safe = pos < 0 ? 0 : pos;
+			safe = safe > (int32_t)img->height - 1 ?
+				(int32_t)img->height - 1 : safe;
+			virt[i] = img->sl[safe];
+		}
+		strip_scale(virt, taps, (size_t)img->width * img->cmp, out, ty,
+			b->kernel, img->cmp, 0);
+	}
+	free(out);
+	free(virt);
+}
+
+/**
+ * x-scale every scanline with an xscaler.
+ */
+static void run_xscaler(struct bench *b)
+{
+	struct image *img;
+	struct xscaler xs;
+	uint8_t *out;
+	uint32_t y;
+
+	img = b->img;
+	xscaler_init(&xs, img->width, b->out_width, b->kernel, img->cmp, 0);
+	out = malloc((size_t)b->out_width * img->cmp);
+	for (y=0; y<img->height; y++) {
+		memcpy(xscaler_psl_pos0(&xs), img->sl[y],
+			(size_t)img->width * img->cmp);
+		xscaler_scale(&xs, out);
+	}
+	free(out);
+	xscaler_free(&xs);
+}
+
+/**
+ * Scale the whole image with the streaming xscaler/yscaler pipeline.
+ */
+static void run_imgscale(struct bench *b, int flags)
+{
+	struct image *img;
+	struct imgscale_ctx ctx;
+	uint8_t *row;
+	uint32_t i, y;
+	size_t j, len;
+
+	img = b->img;
+	imgscale_ctx_init(&ctx);
+	imgscale_ctx_reset(&ctx, img->width, img->height, b->out_width,
+		b->out_height, b->kernel, img->cmp, 0, flags);
+	len = (size_t)img->width * img->cmp;
+	y = 0;
+	for (i=0; i<b->out_height; i++) {
+		while ((row = imgscale_ctx_next(&ctx))) {
+			if (flags & IMGSCALE_16BIT) {
+				/* widen the samples as a 16-bit PNG holds them */
+				for (j=0; j<len; j++) {
+					((uint16_t *)row)[j] = img->sl[y][j] * 257;
+				}
+			} else {
+				memcpy(row, img->sl[y], len);
+			}
+			y++;
+			imgscale_ctx_push(&ctx);
+		}
+		imgscale_ctx_scale(&ctx, i);
+	}
+	imgscale_ctx_free(&ctx);
+}
+
+static void run_imgscale_cubic(struct bench *b)
+{
+	run_imgscale(b, 0);
+}
+
+static void run_imgscale_fast(struct bench *b)
+{
+	run_imgscale(b, IMGSCALE_FAST);
+}
+
+static void run_imgscale_linear(struct bench *b)
+{
+	run_imgscale(b, IMGSCALE_LINEAR);
+}
+
+static void run_imgscale_premul(struct bench *b)
+{
+	run_imgscale(b, IMGSCALE_PREMULTIPLY);
+}
+
+static void run_imgscale_16(struct bench *b)
+{
+	run_imgscale(b, IMGSCALE_16BIT);
+}
+
+/* tools */
+
+/**
+ * Encode an image as a JPEG into an unlinked temporary file.
+ */
+static FILE *encode_jpeg(struct image *img)
+{
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	FILE *f;
+	uint32_t y;
+
+	f = tmpfile();
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+	jpeg_stdio_dest(&cinfo, f);
+	cinfo.image_width = img->width;
+	cinfo.image_height = img->height;
+	cinfo.input_components = img->cmp;
+	cinfo.in_color_space = img->cmp == 1 ? JCS_GRAYSCALE : JCS_RGB;
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, 90, TRUE);
+	jpeg_start_compress(&cinfo, TRUE);
+	for (y=0; y<img->height; y++) {
+		jpeg_write_scanlines(&cinfo, img->sl + y, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+	jpeg_destroy_compress(&cinfo);
+	fflush(f);
+	return f;
+}
+
+/**
+ * Encode an image as a PNG into an unlinked temporary file.
+ */
+static FILE *encode_png(struct image *img, int interlace)
+{
+	static const int ctypes[] = {PNG_COLOR_TYPE_GRAY,
+		PNG_COLOR_TYPE_GRAY_ALPHA, PNG_COLOR_TYPE_RGB,
+		PNG_COLOR_TYPE_RGB_ALPHA};
+	png_structp png;
+	png_infop info;
+	FILE *f;
+
+	f = tmpfile();
+	png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	info = png_create_info_struct(png);
+	png_init_io(png, f);
+	png_set_compression_level(png, 1);
+	png_set_IHDR(png, info, img->width, img->height, 8,
+		ctypes[img->cmp - 1], interlace ? PNG_INTERLACE_ADAM7 :
+		PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+		PNG_FILTER_TYPE_DEFAULT);
+	png_set_rows(png, info, img->sl);
+	png_write_png(png, info, PNG_TRANSFORM_IDENTITY, NULL);
+	png_destroy_write_struct(&png, &info);
+	fflush(f);
+	return f;
+}
+
+/**
+ * Run a tool once on the encoded input and return its peak RSS in kilobytes,
+ * or -1 if it failed.
+ */
+static long run_tool(struct bench *b)
+{
+	struct rusage ru;
+	char width[16], height[16];
+	int status, devnull;
+	pid_t pid;
+
+	sprintf(width, "%u", b->out_width);
+	sprintf(height, "%u", b->out_height);
+	lseek(b->fd, 0, SEEK_SET);
+
+	pid = fork();
+	if (pid < 0) {
+		return -1;
+	}
+	if (!pid) {
+		devnull = open("/dev/null", O_WRONLY);
+		dup2(b->fd, 0);
+		dup2(devnull, 1);
+		dup2(devnull, 2);
+		execl(b->tool, b->tool, width, height, (char *)NULL);
+		_exit(127);
+	}
+
+	if (wait4(pid, &status, 0, &ru) < 0 || !WIFEXITED(status) ||
+		WEXITSTATUS(status)) {
+		return -1;
+	}
+	return ru.ru_maxrss;
+}
+
+/* reporting */
+
+static void report(struct bench *b, uint32_t runs, double best, long rss)
+{
+	struct image *img;
+
+	img = b->img;
+	printf("%s\t%u\t%ux%u\t%ux%u\t%u\t%.3f\t%.2f\t%ld\n", b->name, img->cmp,
+		img->width, img->height, b->out_width, b->out_height, runs,
+		best * 1000, (double)img->width * img->height / best / 1e6,
+		rss);
+	fflush(stdout);
+}
+
+static int skip(struct bench *b)
+{
+	return filter && !strstr(b->name, filter);
+}
+
+/**
+ * Timing of a kernel, passed from the child process that ran it.
+ */
+struct kernel_result {
+	uint32_t runs;
+	double best;
+};
+
+/**
+ * Run a kernel until MIN_SECONDS have passed.
+ */
+static void kernel_runs(struct bench *b, void (*fn)(struct bench *b),
+	struct kernel_result *res)
+{
+	double start, end, total;
+
+	res->best = total = 0;
+	for (res->runs=0; res->runs == 0 || total < MIN_SECONDS; res->runs++) {
+		start = now();
+		fn(b);
+		end = now();
+		total += end - start;
+		res->best = res->runs == 0 || end - start < res->best ?
+			end - start : res->best;
+	}
+}
+
+/**
+ * Time a kernel in a child process, so its peak RSS is that of the kernel
+ * rather than the high-water mark of every benchmark run before it.
+ */
+static void time_kernel(struct bench *b, void (*fn)(struct bench *b))
+{
+	struct kernel_result res;
+	struct rusage ru;
+	int fds[2], status;
+	ssize_t len;
+	pid_t pid;
+
+	if (skip(b)) {
+		return;
+	}
+
+	fflush(stdout);
+	if (pipe(fds)) {
+		fprintf(stderr, "%s failed\n", b->name);
+		return;
+	}
+	pid = fork();
+	if (!pid) {
+		close(fds[0]);
+		kernel_runs(b, fn, &res);
+		len = write(fds[1], &res, sizeof(res));
+		_exit(len != sizeof(res));
+	}
+
+	close(fds[1]);
+	len = pid < 0 ? -1 : read(fds[0], &res, sizeof(res));
+	close(fds[0]);
+	if (pid < 0 || wait4(pid, &status, 0, &ru) < 0 ||
+		!WIFEXITED(status) || WEXITSTATUS(status) ||
+		len != sizeof(res)) {
+		fprintf(stderr, "%s failed\n", b->name);
+		return;
+	}
+	report(b, res.runs, res.best, ru.ru_maxrss);
+}
+
+static void time_tool(struct bench *b)
+{
+	double start, end, total, best;
+	long rss, max_rss;
+	uint32_t runs;
+
+	if (skip(b)) {
+		return;
+	}
+
+	best = total = 0;
+	max_rss = 0;
+	for (runs=0; runs<TOOL_RUNS && (runs == 0 || total < TOOL_SECONDS);
+		runs++) {
+		start = now();
+		rss = run_tool(b);
+		end = now();
+		if (rss < 0) {
+			fprintf(stderr, "%s failed\n", b->name);
+			return;
+		}
+		total += end - start;
+		max_rss = rss > max_rss ? rss : max_rss;
+		best = runs == 0 || end - start < best ? end - start : best;
+	}
+	report(b, runs, best, max_rss);
+}
+
+/**
+ * Time a tool on an encoded image across the scale factors, then close it.
+ */
+static void time_tools(struct bench *b, const char *name, const char *tool,
+	FILE *input)
+{
+	uint32_t j;
+
+	b->name = name;
+	b->tool = tool;
+	b->fd = fileno(input);
+	for (j=0; j<sizeof(scales)/sizeof(scales[0]); j++) {
+		b->out_width = b->img->width * scales[j] / 8;
+		b->out_height = b->img->height * scales[j] / 8;
+		time_tool(b);
+	}
+	fclose(input);
+}
+
+int main(int argc, char *argv[])
+{
+	struct image img;
+	struct bench b;
+	uint32_t i, j;
+	uint8_t cmp;
+	char name[32];
+	int k;
+
+	if (argc > 2) {
+		fprintf(stderr, "Usage: %s [FILTER]\n", argv[0]);
+		return 1;
+	}
+	filter = argc == 2 ? argv[1] : NULL;
+
+	/* mpix_s is input megapixels per second of the fastest run, rss_kb the
+	 * peak resident set size of the process running the case */
+	printf("name\tcmp\tin\tout\truns\tms\tmpix_s\trss_kb\n");
+
+	for (i=0; i<sizeof(sizes)/sizeof(sizes[0]); i++) {
+		for (cmp=1; cmp<=4; cmp++) {
+			image_init(&img, sizes[i][0], sizes[i][1], cmp);
+			b.img = &img;
+
+			for (j=0; j<sizeof(scales)/sizeof(scales[0]); j++) {
+				b.out_width = img.width * scales[j] / 8;
+				b.out_height = img.height * scales[j] / 8;
+
+				b.kernel = FILTER_CATROM;
+				b.name = "xscale_padded";
+				time_kernel(&b, run_xscale_padded);
+				b.name = "strip_scale";
+				time_kernel(&b, run_strip_scale);
+				b.name = "xscaler";
+				time_kernel(&b, run_xscaler);
+				b.name = "imgscale";
+				time_kernel(&b, run_imgscale_cubic);
+				b.name = "imgscale_fast";
+				time_kernel(&b, run_imgscale_fast);
+				b.name = "imgscale_linear";
+				time_kernel(&b, run_imgscale_linear);
+				b.name = "imgscale_premul";
+				time_kernel(&b, run_imgscale_premul);
+				b.name = "imgscale_16";
+				time_kernel(&b, run_imgscale_16);
+
+				/* the other filters, on the whole pipeline */
+				for (k=FILTER_CATROM+1; k<FILTERS; k++) {
+					b.kernel = k;
+					snprintf(name, sizeof(name), "imgscale_%s",
+						filter_name(k));
+					b.name = name;
+					time_kernel(&b, run_imgscale_cubic);
+				}
+			}
+
+			/* libjpeg takes grayscale and RGB */
+			if (cmp == 1 || cmp == 3) {
+				time_tools(&b, "jpgscale", "./jpgscale",
+					encode_jpeg(&img));
+			}
+			time_tools(&b, "pngscale", "./pngscale",
+				encode_png(&img, 0));
+			time_tools(&b, "pngscale_interlaced", "./pngscale",
+				encode_png(&img, 1));
+
+			image_free(&img);
+		}
+	}
+	return 0;
+}
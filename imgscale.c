@@ -0,0 +1,204 @@
+/**
+ * Copyright (c) 2014-2016 Timothy Elliott
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "imgscale.h"
+#include "jpeg_scale.h"
+#include "png_scale.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int check_opts(const struct imgscale_opts *opts, int encoded)
+{
+	if (!opts) {
+		return 0;
+	}
+
+	/* encoded images are scaled at their own bit depth */
+	if (encoded && (opts->flags & IMGSCALE_16BIT)) {
+		return -1;
+	}
+	return filter_name(opts->filter) ? 0 : -1;
+}
+
+static void set_err(char *err, const char *msg)
+{
+	if (err) {
+		snprintf(err, IMGSCALE_ERR_LEN, "%s", msg);
+	}
+}
+
+int imgscale_jpeg(const uint8_t *in, size_t in_len, uint32_t width,
+	uint32_t height, const struct imgscale_opts *opts, uint8_t **out,
+	size_t *out_len, char *err)
+{
+	struct jpeg_ctx *ctx;
+	struct jpeg_io io;
+	int ret;
+
+	if (!in || !in_len || !width || !height || !out || !out_len ||
+		check_opts(opts, 1)) {
+		return -1; // bad input parameter
+	}
+
+	ctx = malloc(sizeof(struct jpeg_ctx));
+	if (!ctx) {
+		return -2; // unable to allocate the context
+	}
+	jpeg_ctx_init(ctx, 1);
+	if (opts) {
+		ctx->opts.flags = opts->flags;
+		ctx->opts.filter = opts->filter;
+		ctx->opts.cover = opts->cover;
+		ctx->opts.threads = opts->threads;
+	}
+
+	io.input = NULL;
+	io.in_buf = in;
+	io.in_len = in_len;
+	io.output = NULL;
+	ret = 0;
+	if (jpeg(ctx, &io, width, height, 0)) {
+		set_err(err, ctx->msg);
+		free(io.out_buf);
+		ret = -3; // libjpeg failed
+	} else {
+		*out = io.out_buf;
+		*out_len = io.out_len;
+	}
+
+	jpeg_ctx_free(ctx);
+	free(ctx);
+	return ret;
+}
+
+int imgscale_png(const uint8_t *in, size_t in_len, uint32_t width,
+	uint32_t height, const struct imgscale_opts *opts, uint8_t **out,
+	size_t *out_len, char *err)
+{
+	struct png_ctx *ctx;
+	struct png_src src;
+	struct png_target t;
+	unsigned threads;
+	int ret;
+
+	if (!in || !in_len || !width || !height || !out || !out_len ||
+		check_opts(opts, 1)) {
+		return -1; // bad input parameter
+	}
+
+	ctx = malloc(sizeof(struct png_ctx));
+	if (!ctx) {
+		return -2; // unable to allocate the context
+	}
+	png_ctx_init(ctx, 1);
+	threads = 1;
+	if (opts) {
+		ctx->opts.flags = opts->flags;
+		ctx->opts.filter = opts->filter;
+		threads = opts->threads ? opts->threads : 1;
+	}
+
+	src.input = NULL;
+	src.buf = in;
+	src.len = in_len;
+	src.pos = 0;
+	t.width = width;
+	t.height = height;
+	t.output = NULL;
+	ret = 0;
+	if (png(ctx, &src, &t, 1, threads, 0)) {
+		set_err(err, ctx->msg);
+		free(t.buf);
+		ret = -3; // libpng failed
+	} else {
+		*out = t.buf;
+		*out_len = t.len;
+	}
+
+	png_ctx_free(ctx);
+	free(ctx);
+	return ret;
+}
+
+int imgscale_pixels(const uint8_t *in, uint32_t in_width, uint32_t in_height,
+	size_t in_stride, uint8_t *out, uint32_t out_width, uint32_t out_height,
+	size_t out_stride, uint8_t cmp, const struct imgscale_opts *opts)
+{
+	struct imgscale_ctx sc;
+	struct xscale_pool pool;
+	uint32_t i, x, y, width, height;
+	size_t len;
+	uint8_t *row, bps;
+	int ret;
+
+	bps = opts && (opts->flags & IMGSCALE_16BIT) ? 2 : 1;
+	if (!in || !out || !cmp || check_opts(opts, 0) ||
+		in_stride < (size_t)in_width * cmp * bps ||
+		out_stride < (size_t)out_width * cmp * bps) {
+		return -1; // bad input parameter
+	}
+
+	x = y = 0;
+	width = in_width;
+	height = in_height;
+	if (opts && opts->cover) {
+		cover_crop(in_width, in_height, out_width, out_height, &x, &y,
+			&width, &height);
+	}
+
+	imgscale_ctx_init(&sc);
+	if (opts && opts->threads > 1) {
+		ret = xscale_pool_init(&pool, opts->threads);
+		if (ret) {
+			return ret;
+		}
+		sc.pool = &pool;
+	}
+	ret = imgscale_ctx_reset(&sc, width, height, out_width, out_height,
+		opts ? opts->filter : FILTER_CATROM, cmp, 0,
+		opts ? opts->flags : 0);
+	if (ret) {
+		goto out;
+	}
+
+	in += (size_t)y * in_stride + (size_t)x * cmp * bps;
+	len = (size_t)width * cmp * bps;
+	for (i=0; i<out_height; i++) {
+		while ((row = imgscale_ctx_next(&sc))) {
+			memcpy(row, in, len);
+			in += in_stride;
+			imgscale_ctx_push(&sc);
+		}
+		imgscale_ctx_scale(&sc, i);
+		memcpy(out, sc.outbuf, (size_t)out_width * cmp * bps);
+		out += out_stride;
+	}
+
+out:
+	imgscale_ctx_free(&sc);
+	if (opts && opts->threads > 1) {
+		xscale_pool_free(&pool);
+	}
+	return ret;
+}
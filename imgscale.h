@@ -0,0 +1,103 @@
+/**
+ * Copyright (c) 2014-2016 Timothy Elliott
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef IMGSCALE_H
+#define IMGSCALE_H
+
+#include "resample.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * libimgscale: scale encoded images held in memory, or raw pixels.
+ *
+ * The functions keep no state between calls and can be called from several
+ * threads at once.
+ */
+
+/**
+ * Size of the err buffers the encoded image functions fill in.
+ */
+#define IMGSCALE_ERR_LEN 256
+
+/**
+ * Options for a scaling call. A zeroed struct gives the defaults of the
+ * command-line tools.
+ */
+struct imgscale_opts {
+	int filter; // enum imgscale_filter, 0 is FILTER_CATROM
+	int flags; // imgscale_ctx_reset() flags
+	int cover; // fill the output size and crop off the overflow, not for PNGs
+	unsigned threads; // threads for interlaced PNGs and wide images, 0 is 1
+};
+
+/**
+ * Scale the JPEG in in to fit in width x height, or to fill it in cover mode,
+ * and encode the result as a JPEG. The image is turned according to its EXIF
+ * orientation.
+ *
+ * On success *out is set to a buffer of *out_len bytes which the caller frees
+ * with free(). err is NULL or IMGSCALE_ERR_LEN bytes which get the libjpeg
+ * error message on failure. Nothing is printed. Truncated or corrupt image data
+ * that libjpeg would only warn about fails the image, while harmless warnings
+ * such as extraneous bytes before a marker are ignored.
+ *
+ * returns 0 on success, otherwise a negative integer:
+ *
+ * -1 - bad input parameter
+ * -2 - unable to perform an allocation
+ * -3 - the image could not be decoded or encoded
+ */
+int imgscale_jpeg(const uint8_t *in, size_t in_len, uint32_t width,
+	uint32_t height, const struct imgscale_opts *opts, uint8_t **out,
+	size_t *out_len, char *err);
+
+/**
+ * Same as imgscale_jpeg(), for PNGs. The cover option is ignored. 16-bit PNGs
+ * keep their 16-bit samples by themselves, and IMGSCALE_16BIT in opts->flags
+ * is a bad input parameter here as it is for JPEGs.
+ */
+int imgscale_png(const uint8_t *in, size_t in_len, uint32_t width,
+	uint32_t height, const struct imgscale_opts *opts, uint8_t **out,
+	size_t *out_len, char *err);
+
+/**
+ * Scale in_width x in_height pixels of cmp 8-bit components each to exactly
+ * out_width x out_height. Scanlines are in_stride and out_stride bytes apart.
+ * The aspect ratio is only kept in cover mode, which crops the center of the
+ * input to the output ratio. opts may be NULL.
+ *
+ * With cmp 2 or 4 the last component is alpha. Set IMGSCALE_PREMULTIPLY in
+ * opts->flags to have straight alpha filtered premultiplied. PNGs always are.
+ * With IMGSCALE_16BIT the components are native endian uint16_t instead, and
+ * the strides still count bytes.
+ *
+ * returns 0 on success, otherwise a negative integer:
+ *
+ * -1 - bad input parameter
+ * -2 - unable to perform an allocation
+ * -3 - unable to start a thread
+ */
+int imgscale_pixels(const uint8_t *in, uint32_t in_width, uint32_t in_height,
+	size_t in_stride, uint8_t *out, uint32_t out_width, uint32_t out_height,
+	size_t out_stride, uint8_t cmp, const struct imgscale_opts *opts);
+
+#endif
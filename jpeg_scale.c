@@ -0,0 +1,1042 @@
+/**
+ * Copyright (c) 2014-2016 Timothy Elliott
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "jpeg_scale.h"
+#include "pipeline.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+#include <jerror.h>
+
+static void jpeg_read_row(void *arg, uint8_t *row)
+{
+	jpeg_read_scanlines(arg, &row, 1);
+}
+
+#if JPEG_LIB_VERSION >= 70
+#define DCT_H_SCALED_SIZE(comp) ((comp)->DCT_h_scaled_size)
+#define DCT_V_SCALED_SIZE(comp) ((comp)->DCT_v_scaled_size)
+#define MIN_DCT_V_SCALED_SIZE(dinfo) ((dinfo)->min_DCT_v_scaled_size)
+#else
+#define DCT_H_SCALED_SIZE(comp) ((comp)->DCT_scaled_size)
+#define DCT_V_SCALED_SIZE(comp) ((comp)->DCT_scaled_size)
+#define MIN_DCT_V_SCALED_SIZE(dinfo) ((dinfo)->min_DCT_scaled_size)
+#endif
+
+static void jpeg_recover_exit(j_common_ptr cinfo)
+{
+	struct jpeg_ctx *ctx;
+	ctx = cinfo->client_data;
+	cinfo->err->format_message(cinfo, ctx->msg);
+	longjmp(ctx->env, 1);
+}
+
+/**
+ * When recovering, warnings about truncated or damaged entropy data fail the
+ * image too, rather than being printed to stderr while the image is passed as
+ * good. Other warnings, like stray bytes between markers, leave the pixels
+ * intact and are dropped along with trace messages.
+ */
+static void jpeg_recover_emit(j_common_ptr cinfo, int msg_level)
+{
+	if (msg_level >= 0) {
+		return;
+	}
+	switch (cinfo->err->msg_code) {
+	case JWRN_JPEG_EOF:
+	case JWRN_HIT_MARKER:
+	case JWRN_HUFF_BAD_CODE:
+	case JWRN_ARITH_BAD_CODE:
+	case JWRN_MUST_RESYNC:
+		jpeg_recover_exit(cinfo);
+	}
+}
+
+/* Memory destination. jpeg_mem_dest() only hands its buffer back once the
+ * image is finished, which leaves nothing to free when libjpeg fails halfway,
+ * so io->out_buf is kept up to date here instead.
+ */
+
+static void jpeg_mem_grow(j_compress_ptr cinfo)
+{
+	struct jpeg_ctx *ctx;
+	struct jpeg_io *io;
+	uint8_t *buf;
+	size_t cap;
+
+	ctx = cinfo->client_data;
+	io = ctx->io;
+	cap = io->out_cap ? io->out_cap * 2 : 4096;
+	buf = realloc(io->out_buf, cap);
+	if (!buf) {
+		ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+	}
+	io->out_buf = buf;
+	io->out_cap = cap;
+	ctx->mem_dest.next_output_byte = buf + io->out_len;
+	ctx->mem_dest.free_in_buffer = cap - io->out_len;
+}
+
+static void jpeg_mem_init(j_compress_ptr cinfo)
+{
+	struct jpeg_ctx *ctx;
+	ctx = cinfo->client_data;
+	ctx->io->out_len = 0;
+	jpeg_mem_grow(cinfo);
+}
+
+static boolean jpeg_mem_empty(j_compress_ptr cinfo)
+{
+	struct jpeg_ctx *ctx;
+	ctx = cinfo->client_data;
+	ctx->io->out_len = ctx->io->out_cap;
+	jpeg_mem_grow(cinfo);
+	return TRUE;
+}
+
+static void jpeg_mem_term(j_compress_ptr cinfo)
+{
+	struct jpeg_ctx *ctx;
+	ctx = cinfo->client_data;
+	ctx->io->out_len = ctx->io->out_cap - ctx->mem_dest.free_in_buffer;
+}
+
+void jpeg_ctx_init(struct jpeg_ctx *ctx, int recover)
+{
+	int i;
+
+	memset(ctx, 0, sizeof(struct jpeg_ctx));
+	ctx->recover = recover;
+	ctx->dinfo.err = jpeg_std_error(&ctx->jerr);
+	if (recover) {
+		ctx->jerr.error_exit = jpeg_recover_exit;
+		ctx->jerr.emit_message = jpeg_recover_emit;
+	}
+	ctx->dinfo.client_data = ctx;
+	jpeg_create_decompress(&ctx->dinfo);
+	ctx->cinfo.err = &ctx->jerr;
+	ctx->cinfo.client_data = ctx;
+	jpeg_create_compress(&ctx->cinfo);
+	ctx->mem_dest.init_destination = jpeg_mem_init;
+	ctx->mem_dest.empty_output_buffer = jpeg_mem_empty;
+	ctx->mem_dest.term_destination = jpeg_mem_term;
+	imgscale_ctx_init(&ctx->sc);
+	for (i=0; i<3; i++) {
+		imgscale_ctx_init(&ctx->planes[i].sc);
+	}
+}
+
+void jpeg_ctx_free(struct jpeg_ctx *ctx)
+{
+	int i;
+
+	for (i=0; i<3; i++) {
+		imgscale_ctx_free(&ctx->planes[i].sc);
+		free(ctx->planes[i].pending);
+	}
+	imgscale_ctx_free(&ctx->sc);
+	if (ctx->pool) {
+		xscale_pool_free(ctx->pool);
+		free(ctx->pool);
+	}
+	jpeg_destroy_compress(&ctx->cinfo);
+	jpeg_destroy_decompress(&ctx->dinfo);
+}
+
+/**
+ * Point libjpeg at the input side of io and read the JPEG header.
+ */
+static void jpeg_open_src(struct jpeg_decompress_struct *dinfo,
+	struct jpeg_io *io)
+{
+	int i;
+
+	if (io->input) {
+		jpeg_stdio_src(dinfo, io->input);
+	} else {
+		jpeg_mem_src(dinfo, (unsigned char *)io->in_buf, io->in_len);
+	}
+
+	/* Save custom headers for the compressor, but ignore APP0 & APP14 so
+	 * libjpeg can handle them.
+	 */
+	jpeg_save_markers(dinfo, JPEG_COM, 0xFFFF);
+	for (i=1; i<14; i++) {
+		jpeg_save_markers(dinfo, JPEG_APP0+i, 0xFFFF);
+	}
+	jpeg_save_markers(dinfo, JPEG_APP0+15, 0xFFFF);
+	jpeg_read_header(dinfo, TRUE);
+
+#ifdef JCS_EXTENSIONS
+	if (dinfo->out_color_space == JCS_RGB) {
+		dinfo->out_color_space = JCS_EXT_RGBX;
+	}
+#endif
+}
+
+/**
+ * Start a compressor for a started decompressor and copy over the custom
+ * headers. The destination manager has to be set up already.
+ */
+static void jpeg_open_dest(struct jpeg_compress_struct *cinfo,
+	struct jpeg_decompress_struct *dinfo, uint32_t width, uint32_t height)
+{
+	jpeg_saved_marker_ptr marker;
+	int i;
+
+	cinfo->image_width = width;
+	cinfo->image_height = height;
+	cinfo->input_components = dinfo->output_components;
+	cinfo->in_color_space = dinfo->out_color_space;
+
+	jpeg_set_defaults(cinfo);
+	jpeg_set_quality(cinfo, 95, FALSE);
+
+	/* take raw planes with the sampling of the source */
+	cinfo->raw_data_in = dinfo->raw_data_out;
+	if (dinfo->raw_data_out) {
+		for (i=0; i<cinfo->num_components; i++) {
+			cinfo->comp_info[i].h_samp_factor =
+				dinfo->comp_info[i].h_samp_factor;
+			cinfo->comp_info[i].v_samp_factor =
+				dinfo->comp_info[i].v_samp_factor;
+		}
+	}
+	jpeg_start_compress(cinfo, TRUE);
+
+	/* Write custom headers */
+	for (marker=dinfo->marker_list; marker; marker=marker->next) {
+		jpeg_write_marker(cinfo, marker->marker, marker->data,
+			marker->data_length);
+	}
+}
+
+static uint32_t exif_get(uint8_t *p, int size, int big_endian)
+{
+	uint32_t val;
+	int i;
+
+	val = 0;
+	for (i=0; i<size; i++) {
+		val |= (uint32_t)p[big_endian ? i : size - 1 - i] <<
+			(8 * (size - 1 - i));
+	}
+	return val;
+}
+
+/**
+ * Read the orientation from the EXIF header of the image and set it to 1 in
+ * the saved marker, since the output gets turned the right way up. Returns 1
+ * if there is no orientation.
+ */
+static int jpeg_take_orientation(struct jpeg_decompress_struct *dinfo)
+{
+	jpeg_saved_marker_ptr marker;
+	uint32_t len, ifd, n, i;
+	uint8_t *tiff, *entry;
+	int big_endian, orientation;
+
+	for (marker=dinfo->marker_list; marker; marker=marker->next) {
+		if (marker->marker == JPEG_APP0 + 1 &&
+			marker->data_length >= 14 &&
+			!memcmp(marker->data, "Exif\0\0", 6)) {
+			break;
+		}
+	}
+	if (!marker) {
+		return 1;
+	}
+
+	tiff = marker->data + 6;
+	len = marker->data_length - 6;
+	if (!memcmp(tiff, "MM", 2)) {
+		big_endian = 1;
+	} else if (!memcmp(tiff, "II", 2)) {
+		big_endian = 0;
+	} else {
+		return 1;
+	}
+
+	ifd = exif_get(tiff + 4, 4, big_endian);
+	if (ifd > len - 2) {
+		return 1;
+	}
+	n = exif_get(tiff + ifd, 2, big_endian);
+	for (i=0; i<n && ifd + 2 + (i + 1) * 12 <= len; i++) {
+		entry = tiff + ifd + 2 + i * 12;
+		/* a single SHORT tagged 0x0112 */
+		if (exif_get(entry, 2, big_endian) != 0x0112 ||
+			exif_get(entry + 2, 2, big_endian) != 3 ||
+			exif_get(entry + 4, 4, big_endian) != 1) {
+			continue;
+		}
+		orientation = exif_get(entry + 8, 2, big_endian);
+		if (orientation < 1 || orientation > 8) {
+			return 1;
+		}
+		entry[8] = !big_endian;
+		entry[9] = big_endian;
+		return orientation;
+	}
+	return 1;
+}
+
+/**
+ * Size of the buffer jpeg_out needs for an orientation.
+ */
+static size_t jpeg_out_len(int orientation, uint32_t width, uint32_t height,
+	uint8_t cmp)
+{
+	size_t len;
+
+	if (orientation < 2) {
+		return 0;
+	}
+	len = (size_t)width * cmp;
+	if (orientation > 2) {
+		len = len * height + (size_t)(width > height ? width : height) *
+			cmp;
+	}
+	return len;
+}
+
+/**
+ * Set up writing scanlines of width by height to cinfo in the given
+ * orientation. Returns -2 if the buffer can't be allocated.
+ */
+static int jpeg_out_init(struct jpeg_out *out,
+	struct jpeg_compress_struct *cinfo, int orientation, uint32_t width,
+	uint32_t height, uint8_t cmp)
+{
+	size_t len;
+
+	out->cinfo = cinfo;
+	out->orientation = orientation;
+	out->width = width;
+	out->height = height;
+	out->cmp = cmp;
+	out->rows = 0;
+	out->buf = NULL;
+
+	len = jpeg_out_len(orientation, width, height, cmp);
+	if (len) {
+		out->buf = malloc(len);
+		if (!out->buf) {
+			return -2;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Copy len pixels of cmp bytes each, stepping step bytes through src.
+ */
+static void copy_pixels(uint8_t *dst, uint8_t *src, uint32_t len,
+	ptrdiff_t step, uint8_t cmp)
+{
+	uint32_t i;
+
+	for (i=0; i<len; i++) {
+		memcpy(dst, src, cmp);
+		dst += cmp;
+		src += step;
+	}
+}
+
+/**
+ * Take the next scaled scanline.
+ */
+static void jpeg_out_row(void *arg, uint8_t *row)
+{
+	struct jpeg_out *out;
+	size_t stride;
+
+	out = arg;
+	stride = (size_t)out->width * out->cmp;
+
+	switch (out->orientation) {
+	case 1:
+		jpeg_write_scanlines(out->cinfo, &row, 1);
+		break;
+	case 2:
+		copy_pixels(out->buf, row + stride - out->cmp, out->width,
+			-out->cmp, out->cmp);
+		jpeg_write_scanlines(out->cinfo, &out->buf, 1);
+		break;
+	default:
+		memcpy(out->buf + out->rows * stride, row, stride);
+	}
+	out->rows++;
+}
+
+/**
+ * Write out the oriented image once all scaled scanlines are in.
+ */
+static void jpeg_out_finish(struct jpeg_out *out)
+{
+	ptrdiff_t stride, step_x, step_y;
+	uint32_t i, len, rows;
+	uint8_t *img, *pos, *row;
+
+	if (out->orientation < 3) {
+		return;
+	}
+
+	img = out->buf;
+	stride = (ptrdiff_t)out->width * out->cmp;
+	row = img + stride * out->height;
+
+	/* where oriented scanlines start in the scaled image, and how to step
+	 * along them and from one to the next
+	 */
+	switch (out->orientation) {
+	case 3:
+		pos = img + stride * (out->height - 1) + stride - out->cmp;
+		step_x = -out->cmp;
+		step_y = -stride;
+		break;
+	case 4:
+		pos = img + stride * (out->height - 1);
+		step_x = out->cmp;
+		step_y = -stride;
+		break;
+	case 5:
+		pos = img;
+		step_x = stride;
+		step_y = out->cmp;
+		break;
+	case 6:
+		pos = img + stride * (out->height - 1);
+		step_x = -stride;
+		step_y = out->cmp;
+		break;
+	case 7:
+		pos = img + stride * (out->height - 1) + stride - out->cmp;
+		step_x = -stride;
+		step_y = -out->cmp;
+		break;
+	default:
+		pos = img + stride - out->cmp;
+		step_x = stride;
+		step_y = -out->cmp;
+	}
+
+	len = out->orientation > 4 ? out->height : out->width;
+	rows = out->orientation > 4 ? out->width : out->height;
+	for (i=0; i<rows; i++) {
+		copy_pixels(row, pos, len, step_x, out->cmp);
+		jpeg_write_scanlines(out->cinfo, &row, 1);
+		pos += step_y;
+	}
+}
+
+/**
+ * Set up the planes for scaling a raw mode JPEG once both the decompressor and
+ * the compressor have started.
+ */
+static void jpeg_raw_start(struct jpeg_ctx *ctx)
+{
+	struct jpeg_decompress_struct *dinfo;
+	struct jpeg_compress_struct *cinfo;
+	jpeg_component_info *dcomp, *ccomp;
+	struct jpeg_plane *p;
+	size_t len, in_strides[3];
+	uint32_t i, j, n;
+	uint8_t *buf;
+
+	dinfo = &ctx->dinfo;
+	cinfo = &ctx->cinfo;
+
+	len = 0;
+	n = 0;
+	for (i=0; i<3; i++) {
+		p = ctx->planes + i;
+		dcomp = dinfo->comp_info + i;
+		ccomp = cinfo->comp_info + i;
+
+		p->in_width = dcomp->downsampled_width;
+		p->in_height = dcomp->downsampled_height;
+		p->in_rows = dcomp->v_samp_factor * DCT_V_SCALED_SIZE(dcomp);
+		p->in_done = 0;
+		p->out_width = ccomp->downsampled_width;
+		p->out_height = ccomp->downsampled_height;
+		p->out_rows = ccomp->v_samp_factor * DCTSIZE;
+		p->out_stride = ccomp->width_in_blocks * DCTSIZE;
+		p->out_done = 0;
+		p->written = 0;
+
+		/* libjpeg may fill a partial MCU past the last whole block */
+		in_strides[i] = (dcomp->width_in_blocks + dinfo->max_h_samp_factor) *
+			DCT_H_SCALED_SIZE(dcomp);
+		len += p->in_rows * in_strides[i];
+		n += p->in_rows + p->out_rows;
+
+		if (imgscale_ctx_reset(&p->sc, p->in_width, p->in_height,
+			p->out_width, p->out_height, ctx->opts.filter, 1, 0,
+			ctx->opts.flags)) {
+			ERREXIT1(dinfo, JERR_OUT_OF_MEMORY, 0);
+		}
+	}
+
+	ctx->img_buf = malloc(n * sizeof(JSAMPROW) + len);
+	if (!ctx->img_buf) {
+		ERREXIT1(dinfo, JERR_OUT_OF_MEMORY, 1);
+	}
+	STATS(stats_alloc(ctx->st, n * sizeof(JSAMPROW) + len);)
+
+	buf = (uint8_t *)ctx->img_buf + n * sizeof(JSAMPROW);
+	n = 0;
+	for (i=0; i<3; i++) {
+		p = ctx->planes + i;
+		p->in = (JSAMPARRAY)ctx->img_buf + n;
+		p->out = p->in + p->in_rows;
+		n += p->in_rows + p->out_rows;
+		for (j=0; j<p->in_rows; j++) {
+			p->in[j] = buf;
+			buf += in_strides[i];
+		}
+	}
+}
+
+/**
+ * Scale scanlines into pending until the plane needs more input.
+ */
+static void jpeg_plane_drain(struct jpeg_ctx *ctx, struct jpeg_plane *p)
+{
+	uint8_t *row;
+	uint32_t cap;
+	STATS(uint64_t t;)
+
+	while (p->out_done < p->out_height && !imgscale_ctx_next(&p->sc)) {
+		if (p->out_done - p->written == p->pending_cap) {
+			cap = p->pending_cap ? p->pending_cap * 2 : p->out_rows * 2;
+			row = realloc(p->pending, cap * p->out_stride);
+			if (!row) {
+				ERREXIT1(&ctx->dinfo, JERR_OUT_OF_MEMORY, 2);
+			}
+			p->pending = row;
+			p->pending_cap = cap;
+		}
+		row = p->pending + (p->out_done - p->written) * p->out_stride;
+		STATS(t = stats_start(ctx->st);)
+		imgscale_ctx_scale(&p->sc, p->out_done);
+		STATS(stats_add(ctx->st, STATS_YSCALE, t, 1);)
+		memcpy(row, p->sc.outbuf, p->out_width);
+		memset(row + p->out_width, row[p->out_width - 1],
+			p->out_stride - p->out_width);
+		p->out_done++;
+	}
+}
+
+/**
+ * Write the next iMCU row if every plane has scaled enough of it. Returns 0 if
+ * some plane needs more input first.
+ */
+static int jpeg_raw_write(struct jpeg_ctx *ctx)
+{
+	struct jpeg_compress_struct *cinfo;
+	struct jpeg_plane *p;
+	JSAMPARRAY planes[3];
+	uint32_t i, j, imcu, pos, end;
+	STATS(uint64_t t;)
+
+	cinfo = &ctx->cinfo;
+	imcu = cinfo->next_scanline / (cinfo->max_v_samp_factor * DCTSIZE);
+
+	for (i=0; i<3; i++) {
+		p = ctx->planes + i;
+		end = (imcu + 1) * p->out_rows;
+		if (p->out_done < (end < p->out_height ? end : p->out_height)) {
+			return 0;
+		}
+	}
+
+	for (i=0; i<3; i++) {
+		p = ctx->planes + i;
+		/* repeat the last scanline to fill the bottom iMCU row */
+		for (j=0; j<p->out_rows; j++) {
+			pos = imcu * p->out_rows + j;
+			pos = pos < p->out_height ? pos : p->out_height - 1;
+			p->out[j] = p->pending + (pos - p->written) * p->out_stride;
+		}
+		planes[i] = p->out;
+	}
+
+	STATS(t = stats_start(ctx->st);)
+	jpeg_write_raw_data(cinfo, planes, cinfo->max_v_samp_factor * DCTSIZE);
+	STATS(stats_add(ctx->st, STATS_ENCODE, t,
+		cinfo->max_v_samp_factor * DCTSIZE);)
+
+	for (i=0; i<3; i++) {
+		p = ctx->planes + i;
+		end = (imcu + 1) * p->out_rows;
+		end = end < p->out_height ? end : p->out_height;
+		memmove(p->pending, p->pending + (end - p->written) *
+			p->out_stride, (p->out_done - end) * p->out_stride);
+		p->written = end;
+	}
+	return 1;
+}
+
+/**
+ * Scale a JPEG in raw mode. Each of the Y, Cb and Cr planes is scaled on its
+ * own at its subsampled size, so there is no color conversion and no chroma
+ * upsampling or downsampling.
+ */
+static void jpeg_raw(struct jpeg_ctx *ctx)
+{
+	struct jpeg_decompress_struct *dinfo;
+	struct jpeg_compress_struct *cinfo;
+	struct jpeg_plane *p;
+	JSAMPARRAY planes[3];
+	uint32_t i, j;
+	uint8_t *row;
+	STATS(uint64_t t;)
+
+	dinfo = &ctx->dinfo;
+	cinfo = &ctx->cinfo;
+
+	jpeg_raw_start(ctx);
+
+	while (dinfo->output_scanline < dinfo->output_height) {
+		for (i=0; i<3; i++) {
+			planes[i] = ctx->planes[i].in;
+		}
+		STATS(t = stats_start(ctx->st);)
+		jpeg_read_raw_data(dinfo, planes,
+			dinfo->max_v_samp_factor * MIN_DCT_V_SCALED_SIZE(dinfo));
+		STATS(stats_add(ctx->st, STATS_DECODE, t,
+			dinfo->max_v_samp_factor * MIN_DCT_V_SCALED_SIZE(dinfo));)
+
+		for (i=0; i<3; i++) {
+			p = ctx->planes + i;
+			for (j=0; j<p->in_rows && p->in_done<p->in_height; j++) {
+				jpeg_plane_drain(ctx, p);
+				row = imgscale_ctx_next(&p->sc);
+				if (row) {
+					memcpy(row, p->in[j], p->in_width);
+					STATS(t = stats_start(ctx->st);)
+					imgscale_ctx_push(&p->sc);
+					STATS(stats_add(ctx->st, STATS_XSCALE, t,
+						1);)
+				}
+				p->in_done++;
+			}
+			jpeg_plane_drain(ctx, p);
+		}
+
+		while (cinfo->next_scanline < cinfo->image_height &&
+			jpeg_raw_write(ctx));
+	}
+}
+
+/**
+ * Read a decoded scanline and keep the columns of the cover crop.
+ */
+static void jpeg_read_crop_row(void *arg, uint8_t *row)
+{
+	struct jpeg_ctx *ctx;
+	JSAMPROW buf;
+	uint8_t cmp;
+
+	ctx = arg;
+	buf = ctx->img_buf;
+	cmp = ctx->dinfo.output_components;
+	jpeg_read_scanlines(&ctx->dinfo, &buf, 1);
+	memcpy(row, buf + ctx->crop_x * cmp, ctx->crop_width * cmp);
+}
+
+/**
+ * Have a started decompressor only decode the cover crop for the output size,
+ * or rather the iMCU columns around it, starting at its top scanline. Returns
+ * the height of the crop.
+ */
+static uint32_t jpeg_crop(struct jpeg_ctx *ctx, uint32_t width_out,
+	uint32_t height_out)
+{
+	struct jpeg_decompress_struct *dinfo;
+	JDIMENSION xoffset, cols;
+	uint32_t x, y, width, height;
+
+	dinfo = &ctx->dinfo;
+	cover_crop(dinfo->output_width, dinfo->output_height, width_out,
+		height_out, &x, &y, &width, &height);
+
+	xoffset = x;
+	cols = width;
+	if (width < dinfo->output_width) {
+		jpeg_crop_scanline(dinfo, &xoffset, &cols);
+	}
+	ctx->crop_x = x - xoffset;
+	ctx->crop_width = width;
+
+	ctx->img_buf = malloc((size_t)dinfo->output_width *
+		dinfo->output_components);
+	if (!ctx->img_buf) {
+		ERREXIT1(dinfo, JERR_OUT_OF_MEMORY, 3);
+	}
+	STATS(stats_alloc(ctx->st, (size_t)dinfo->output_width *
+		dinfo->output_components);)
+
+	jpeg_skip_scanlines(dinfo, y);
+	return height;
+}
+
+#ifdef IMGSCALE_STATS
+/**
+ * Fill in the stats of a scaled image from the libjpeg objects and the
+ * scalers, and print them.
+ */
+static void jpeg_stats_end(struct jpeg_ctx *ctx, struct jpeg_io *io,
+	uint32_t width_in, uint32_t height_in, int pipelined)
+{
+	struct imgscale_stats *st;
+	struct jpeg_decompress_struct *dinfo;
+	struct jpeg_plane *p;
+	int i;
+
+	st = ctx->st;
+	if (!st) {
+		return;
+	}
+
+	dinfo = &ctx->dinfo;
+	st->in_width = width_in;
+	st->in_height = height_in;
+	st->out_width = ctx->cinfo.image_width;
+	st->out_height = ctx->cinfo.image_height;
+	st->cmp = dinfo->output_components;
+	st->scale_num = dinfo->scale_num;
+	st->scale_denom = dinfo->scale_denom;
+	st->filter = filter_name(ctx->opts.filter);
+
+	if (dinfo->raw_data_out) {
+		st->mode = "raw";
+		st->taps_x = ctx->planes[0].sc.xs.ct.taps;
+		st->taps_y = ctx->planes[0].sc.ys.ct.taps;
+		st->y_first = ctx->planes[0].sc.y_first;
+		for (i=0; i<3; i++) {
+			p = ctx->planes + i;
+			stats_alloc(st, p->sc.arena_len +
+				p->pending_cap * p->out_stride);
+		}
+	} else if (pipelined) {
+		st->mode = "pipelined";
+		st->y_first = yscale_first(width_in, height_in,
+			st->out_width, st->out_height, ctx->opts.filter);
+	} else {
+		st->taps_x = ctx->sc.xs.ct.taps;
+		st->taps_y = ctx->sc.ys.ct.taps;
+		st->y_first = ctx->sc.y_first;
+		stats_alloc(st, ctx->sc.arena_len);
+	}
+
+	st->bytes_in = io->input ? ftell(io->input) : (long)io->in_len;
+	if (st->bytes_in >= 0) {
+		st->bytes_in -= dinfo->src->bytes_in_buffer;
+	}
+	st->bytes_out = io->output ? ftell(io->output) : (long)io->out_len;
+	stats_print(st, stderr, "jpgscale");
+}
+#endif
+
+/**
+ * Start the threads that x-scale wide scanlines for the context, once.
+ */
+static int jpeg_ctx_pool(struct jpeg_ctx *ctx)
+{
+	if (ctx->pool) {
+		return 0;
+	}
+	ctx->pool = malloc(sizeof(struct xscale_pool));
+	if (!ctx->pool) {
+		return -2;
+	}
+	if (xscale_pool_init(ctx->pool, ctx->opts.threads)) {
+		free(ctx->pool);
+		ctx->pool = NULL;
+		return -3;
+	}
+	return 0;
+}
+
+int jpeg(struct jpeg_ctx *ctx, struct jpeg_io *io, uint32_t width_out,
+	uint32_t height_out, int pipelined)
+{
+	struct jpeg_decompress_struct *dinfo;
+	struct jpeg_compress_struct *cinfo;
+	struct imgscale_ctx *sc;
+	pipeline_row_fn read;
+	void *read_arg;
+	uint32_t i, x, y, width_in, height_in;
+	uint8_t cmp, *row;
+	int crop, orientation;
+	STATS(uint64_t t;)
+
+	dinfo = &ctx->dinfo;
+	cinfo = &ctx->cinfo;
+	sc = &ctx->sc;
+	STATS(ctx->st = stats_begin(&ctx->stats);)
+	ctx->io = io;
+	io->out_buf = NULL;
+	io->out_len = io->out_cap = 0;
+
+	if (setjmp(ctx->env)) {
+		free(ctx->img_buf);
+		ctx->img_buf = NULL;
+		free(ctx->out.buf);
+		ctx->out.buf = NULL;
+		jpeg_abort_compress(cinfo);
+		jpeg_abort_decompress(dinfo);
+		return -1;
+	}
+
+	jpeg_open_src(dinfo, io);
+
+	/* work out the size before turning the image */
+	orientation = jpeg_take_orientation(dinfo);
+	if (orientation > 4) {
+		i = width_out;
+		width_out = height_out;
+		height_out = i;
+	}
+
+	width_in = dinfo->image_width;
+	height_in = dinfo->image_height;
+	if (ctx->opts.cover) {
+		cover_crop(dinfo->image_width, dinfo->image_height, width_out,
+			height_out, &x, &y, &width_in, &height_in);
+	} else {
+		fix_ratio(dinfo->image_width, dinfo->image_height, &width_out,
+			&height_out);
+	}
+	crop = width_in != dinfo->image_width ||
+		height_in != dinfo->image_height;
+	dinfo->scale_num = cubic_scale_num(width_in, height_in, width_out,
+		height_out);
+	dinfo->scale_denom = 8;
+
+	/* YCbCr images are scaled plane by plane without converting to RGB,
+	 * unless the luma is subsampled too. libjpeg can't crop raw data,
+	 * turned images are oriented as RGB and linear light needs RGB.
+	 */
+	if (!pipelined && !crop && orientation == 1 &&
+		!(ctx->opts.flags & IMGSCALE_LINEAR) &&
+		dinfo->jpeg_color_space == JCS_YCbCr &&
+		dinfo->num_components == 3 &&
+		dinfo->comp_info[0].h_samp_factor == dinfo->max_h_samp_factor &&
+		dinfo->comp_info[0].v_samp_factor == dinfo->max_v_samp_factor) {
+		dinfo->raw_data_out = TRUE;
+		dinfo->out_color_space = JCS_YCbCr;
+	}
+
+	jpeg_start_decompress(dinfo);
+
+	cmp = dinfo->output_components;
+	width_in = dinfo->output_width;
+	height_in = dinfo->output_height;
+	read = jpeg_read_row;
+	read_arg = dinfo;
+	if (crop) {
+		height_in = jpeg_crop(ctx, width_out, height_out);
+		width_in = ctx->crop_width;
+		read = jpeg_read_crop_row;
+		read_arg = ctx;
+	}
+
+	if (io->output) {
+		jpeg_stdio_dest(cinfo, io->output);
+	} else {
+		cinfo->dest = &ctx->mem_dest;
+	}
+	if (orientation > 4) {
+		jpeg_open_dest(cinfo, dinfo, height_out, width_out);
+	} else {
+		jpeg_open_dest(cinfo, dinfo, width_out, height_out);
+	}
+	if (jpeg_out_init(&ctx->out, cinfo, orientation, width_out,
+		height_out, cmp)) {
+		ERREXIT1(dinfo, JERR_OUT_OF_MEMORY, 4);
+	}
+	STATS(stats_alloc(ctx->st, jpeg_out_len(orientation, width_out,
+		height_out, cmp));)
+
+	if (ctx->opts.threads > 1 && !pipelined && jpeg_ctx_pool(ctx)) {
+		ERREXIT1(dinfo, JERR_OUT_OF_MEMORY, 5);
+	}
+	for (i=0; i<3; i++) {
+		ctx->planes[i].sc.pool = ctx->pool;
+	}
+	sc->pool = ctx->pool;
+
+	if (dinfo->raw_data_out) {
+		jpeg_raw(ctx);
+	} else if (pipelined) {
+		if (pipeline_scale(read, read_arg, jpeg_out_row, &ctx->out,
+			width_in, height_in, width_out, height_out,
+			ctx->opts.filter, cmp, 1)) {
+			ERREXIT1(dinfo, JERR_OUT_OF_MEMORY, 6);
+		}
+	} else {
+		if (imgscale_ctx_reset(sc, width_in, height_in, width_out,
+			height_out, ctx->opts.filter, cmp, 1, ctx->opts.flags)) {
+			ERREXIT1(dinfo, JERR_OUT_OF_MEMORY, 0);
+		}
+		for(i=0; i<height_out; i++) {
+			while ((row = imgscale_ctx_next(sc))) {
+				STATS(t = stats_start(ctx->st);)
+				read(read_arg, row);
+				STATS(stats_add(ctx->st, STATS_DECODE, t, 1);)
+				STATS(t = stats_start(ctx->st);)
+				imgscale_ctx_push(sc);
+				STATS(stats_add(ctx->st, STATS_XSCALE, t, 1);)
+			}
+			STATS(t = stats_start(ctx->st);)
+			imgscale_ctx_scale(sc, i);
+			STATS(stats_add(ctx->st, STATS_YSCALE, t, 1);)
+			STATS(t = stats_start(ctx->st);)
+			jpeg_out_row(&ctx->out, sc->outbuf);
+			STATS(stats_add(ctx->st, STATS_ENCODE, t, 1);)
+		}
+	}
+
+	STATS(t = stats_start(ctx->st);)
+	jpeg_out_finish(&ctx->out);
+	free(ctx->out.buf);
+	ctx->out.buf = NULL;
+	jpeg_finish_compress(cinfo);
+	STATS(stats_add(ctx->st, STATS_ENCODE, t, 0);)
+	if (dinfo->output_scanline < dinfo->output_height) {
+		/* nothing below the crop is needed */
+		jpeg_abort_decompress(dinfo);
+	} else {
+		jpeg_finish_decompress(dinfo);
+	}
+	STATS(jpeg_stats_end(ctx, io, width_in, height_in, pipelined);)
+	free(ctx->img_buf);
+	ctx->img_buf = NULL;
+	return 0;
+}
+
+/**
+ * Free the first n encoders of a ladder along with the ladder's arrays.
+ */
+static void ladder_release(struct jpeg_compress_struct *cinfos,
+	struct ladder_out *outs, struct jpeg_out *jouts, uint32_t n)
+{
+	uint32_t i;
+
+	for (i=0; i<n; i++) {
+		free(jouts[i].buf);
+		jpeg_destroy_compress(cinfos + i);
+	}
+	free(jouts);
+	free(outs);
+	free(cinfos);
+}
+
+void jpeg_ladder(struct jpeg_ctx *ctx, struct jpeg_io *io,
+	struct jpeg_target *targets, uint32_t n)
+{
+	struct jpeg_decompress_struct *dinfo;
+	struct jpeg_compress_struct *cinfos;
+	struct ladder_out *outs;
+	struct jpeg_out *jouts;
+	uint32_t i, max_width, max_height, width, height;
+	int orientation, ret;
+
+	dinfo = &ctx->dinfo;
+	jpeg_open_src(dinfo, io);
+	orientation = jpeg_take_orientation(dinfo);
+
+	max_width = 0;
+	max_height = 0;
+	for (i=0; i<n; i++) {
+		if (orientation > 4) {
+			width = targets[i].width;
+			targets[i].width = targets[i].height;
+			targets[i].height = width;
+		}
+		fix_ratio(dinfo->image_width, dinfo->image_height,
+			&targets[i].width, &targets[i].height);
+		if (targets[i].width > max_width) {
+			max_width = targets[i].width;
+		}
+		if (targets[i].height > max_height) {
+			max_height = targets[i].height;
+		}
+	}
+	dinfo->scale_num = cubic_scale_num(dinfo->image_width,
+		dinfo->image_height, max_width, max_height);
+	dinfo->scale_denom = 8;
+
+	jpeg_start_decompress(dinfo);
+
+	cinfos = malloc(n * sizeof(struct jpeg_compress_struct));
+	outs = malloc(n * sizeof(struct ladder_out));
+	jouts = malloc(n * sizeof(struct jpeg_out));
+	if (!cinfos || !outs || !jouts) {
+		free(jouts);
+		free(outs);
+		free(cinfos);
+		ERREXIT1(dinfo, JERR_OUT_OF_MEMORY, 7);
+	}
+	for (i=0; i<n; i++) {
+		cinfos[i].err = &ctx->jerr;
+		jpeg_create_compress(cinfos + i);
+		width = targets[i].width;
+		height = targets[i].height;
+		jpeg_stdio_dest(cinfos + i, targets[i].output);
+		if (orientation > 4) {
+			jpeg_open_dest(cinfos + i, dinfo, height, width);
+		} else {
+			jpeg_open_dest(cinfos + i, dinfo, width, height);
+		}
+		if (jpeg_out_init(jouts + i, cinfos + i, orientation, width,
+			height, dinfo->output_components)) {
+			ladder_release(cinfos, outs, jouts, i + 1);
+			ERREXIT1(dinfo, JERR_OUT_OF_MEMORY, 4);
+		}
+		outs[i].width = width;
+		outs[i].height = height;
+		outs[i].write = jpeg_out_row;
+		outs[i].write_arg = jouts + i;
+	}
+
+	ret = ladder_scale(jpeg_read_row, dinfo, dinfo->output_width,
+		dinfo->output_height, ctx->opts.filter, dinfo->output_components,
+		1, outs, n);
+
+	for (i=0; !ret && i<n; i++) {
+		jpeg_out_finish(jouts + i);
+		jpeg_finish_compress(cinfos + i);
+	}
+	ladder_release(cinfos, outs, jouts, n);
+	if (ret) {
+		ERREXIT1(dinfo, JERR_OUT_OF_MEMORY, 8);
+	}
+
+	jpeg_finish_decompress(dinfo);
+}
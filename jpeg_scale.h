@@ -0,0 +1,165 @@
+/**
+ * Copyright (c) 2014-2016 Timothy Elliott
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef JPEG_SCALE_H
+#define JPEG_SCALE_H
+
+#include "resample.h"
+#include "stats.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+
+/**
+ * An output size and the file it gets written to.
+ */
+struct jpeg_target {
+	uint32_t width;
+	uint32_t height;
+	FILE *output;
+};
+
+/**
+ * Where jpeg() reads the image from and writes the scaled image to. Each side
+ * is either a FILE or a memory buffer.
+ */
+struct jpeg_io {
+	FILE *input; // NULL to read in_buf instead
+	const uint8_t *in_buf;
+	size_t in_len;
+	FILE *output; // NULL to write to out_buf instead
+	uint8_t *out_buf; // grows as the JPEG is written
+	size_t out_len; // bytes written to out_buf
+	size_t out_cap; // size of out_buf
+};
+
+/**
+ * Compressor for a scaled image that still has to be put in its EXIF
+ * orientation. Orientation 1 needs no change and 2 is a mirror image, so both
+ * are written as the scanlines come in. The others are turned or flipped
+ * upside down, which has to wait for the whole scaled image.
+ */
+struct jpeg_out {
+	struct jpeg_compress_struct *cinfo;
+	int orientation; // EXIF orientation, 1 to 8
+	uint32_t width; // scaled width, before orientation
+	uint32_t height; // scaled height, before orientation
+	uint8_t cmp;
+	uint32_t rows; // scaled scanlines received
+	uint8_t *buf; // scaled image followed by one oriented scanline
+};
+
+/**
+ * Scaling state for one Y, Cb or Cr plane of a JPEG scaled in raw mode.
+ *
+ * Scanlines are read and written an iMCU row at a time for all planes at once,
+ * but the planes don't produce output at quite the same pace. Scaled scanlines
+ * wait in pending until every plane has a whole iMCU row to write.
+ */
+struct jpeg_plane {
+	struct imgscale_ctx sc;
+	uint32_t in_width;
+	uint32_t in_height;
+	uint32_t in_rows; // scanlines per iMCU row read
+	uint32_t in_done; // scanlines fed to the scaler
+	JSAMPARRAY in; // in_rows scanlines filled by jpeg_read_raw_data()
+	uint32_t out_width;
+	uint32_t out_height;
+	uint32_t out_rows; // scanlines per iMCU row written
+	uint32_t out_done; // scanlines scaled
+	uint32_t written; // scanlines written, the position of pending[0]
+	size_t out_stride; // out_width padded to whole DCT blocks
+	JSAMPARRAY out; // out_rows scanlines for jpeg_write_raw_data()
+	uint8_t *pending; // scaled scanlines from written to out_done
+	uint32_t pending_cap; // scanlines that fit in pending
+};
+
+/**
+ * Options for every image scaled with a jpeg_ctx.
+ */
+struct jpeg_opts {
+	int flags; // imgscale_ctx_reset() flags
+	int filter; // enum imgscale_filter
+	int cover; // fill the output size and crop off the overflow
+	unsigned threads; // threads x-scaling wide scanlines, 0 is 1
+};
+
+/**
+ * libjpeg objects and scaling state. In batch mode each worker thread keeps
+ * one of these and reuses it for every job.
+ */
+struct jpeg_ctx {
+	struct jpeg_decompress_struct dinfo;
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_error_mgr jerr;
+	int recover; // return libjpeg errors instead of exiting
+	jmp_buf env; // where libjpeg errors go when recovering
+	char msg[JMSG_LENGTH_MAX]; // last libjpeg error message
+	struct jpeg_opts opts;
+	struct imgscale_ctx sc;
+	struct jpeg_plane planes[3]; // raw mode scaling state
+	void *img_buf; // scanline buffers of the current image
+	struct jpeg_out out;
+	struct jpeg_destination_mgr mem_dest; // writes to io->out_buf
+	struct jpeg_io *io; // io of the image being scaled
+	struct xscale_pool *pool; // x-scaling threads, started on first use
+#ifdef IMGSCALE_STATS
+	struct imgscale_stats stats;
+	struct imgscale_stats *st; // &stats, NULL if turned off
+#endif
+	uint32_t crop_x; // decoded columns left of the cover crop
+	uint32_t crop_width; // decoded columns in the cover crop
+};
+
+/**
+ * Create the libjpeg objects. With recover set, jpeg() returns an error when
+ * libjpeg fails or warns about truncated or corrupt image data, instead of
+ * exiting the process or printing the warning. Other warnings are dropped.
+ *
+ * libjpeg keeps the source and destination managers of its objects, so a
+ * context reads and writes either FILEs or memory buffers, not both.
+ */
+void jpeg_ctx_init(struct jpeg_ctx *ctx, int recover);
+void jpeg_ctx_free(struct jpeg_ctx *ctx);
+
+/**
+ * Scale a JPEG to fit in width x height, or to fill it in cover mode. With
+ * pipelined set, decompression, scaling and compression run on separate
+ * threads. In cover mode only the part of the image that ends up in the output
+ * is decoded.
+ *
+ * Returns 0 on success, or -1 if the context recovers from errors and libjpeg
+ * failed. The error message is left in ctx->msg. When writing to memory,
+ * io->out_buf is set in either case and has to be freed by the caller.
+
+ */
+int jpeg(struct jpeg_ctx *ctx, struct jpeg_io *io, uint32_t width,
+	uint32_t height, int pipelined);
+
+/**
+ * Scale a JPEG to several sizes while only decoding it once. The DCT scaling
+ * is picked for the largest target. Only the input side of io is used.
+ */
+void jpeg_ladder(struct jpeg_ctx *ctx, struct jpeg_io *io,
+	struct jpeg_target *targets, uint32_t n);
+
+#endif
@@ -1,117 +1,290 @@
-#include "resample.h"
+#include "jpeg_scale.h"
+#include "batch.h"
+#include "mapfile.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <jpeglib.h>
+#include <unistd.h>
 
-static void jpeg(FILE *input, FILE *output, uint32_t width_out,
-	uint32_t height_out)
+/* batch mode */
+
+/**
+ * Context of a batch worker thread.
+ */
+struct batch_ctx {
+	struct jpeg_ctx jpeg;
+	struct jpeg_opts opts; // options of the batch, before those of a job
+};
+
+static void *batch_ctx_new(void *opts)
 {
-	struct jpeg_decompress_struct dinfo;
-	struct jpeg_compress_struct cinfo;
-	struct jpeg_error_mgr jerr;
-	uint32_t i;
-	uint8_t cmp, *psl_pos0, *outbuf, *tmp;
-	size_t outbuf_len;
-	struct xscaler xs;
-	struct yscaler ys;
-	jpeg_saved_marker_ptr marker;
-
-	dinfo.err = jpeg_std_error(&jerr);
-	jpeg_create_decompress(&dinfo);
-	jpeg_stdio_src(&dinfo, input);
-
-	/* Save custom headers for the compressor, but ignore APP0 & APP14 so
-	 * libjpeg can handle them.
-	 */
-	jpeg_save_markers(&dinfo, JPEG_COM, 0xFFFF);
-	for (i=1; i<14; i++) {
-		jpeg_save_markers(&dinfo, JPEG_APP0+i, 0xFFFF);
+	struct batch_ctx *ctx;
+	ctx = malloc(sizeof(struct batch_ctx));
+	if (ctx) {
+		jpeg_ctx_init(&ctx->jpeg, 1);
+		ctx->opts = *(struct jpeg_opts *)opts;
 	}
-	jpeg_save_markers(&dinfo, JPEG_APP0+15, 0xFFFF);
-	jpeg_read_header(&dinfo, TRUE);
+	return ctx;
+}
+
+static void batch_ctx_free(void *ctx)
+{
+	jpeg_ctx_free(&((struct batch_ctx *)ctx)->jpeg);
+	free(ctx);
+}
 
-#ifdef JCS_EXTENSIONS
-	if (dinfo.out_color_space == JCS_RGB) {
-		dinfo.out_color_space = JCS_EXT_RGBX;
+/**
+ * Apply the -c, -f, -k and -l options of a job on top of opts.
+ */
+static int batch_opts(struct jpeg_opts *opts, char *const *argv,
+	const char **err)
+{
+	for (; *argv; argv++) {
+		if (!strcmp(*argv, "-c")) {
+			opts->cover = 1;
+		} else if (!strcmp(*argv, "-f")) {
+			opts->flags |= IMGSCALE_FAST;
+		} else if (!strcmp(*argv, "-l")) {
+			opts->flags |= IMGSCALE_LINEAR;
+		} else if (!strcmp(*argv, "-k") && argv[1]) {
+			opts->filter = filter_by_name(*++argv);
+			if (opts->filter < 0) {
+				*err = "Invalid filter";
+				return -1;
+			}
+		} else {
+			*err = "Invalid option";
+			return -1;
+		}
 	}
-#endif
-
-	fix_ratio(dinfo.image_width, dinfo.image_height, &width_out,
-		&height_out);
-	dinfo.scale_denom = cubic_scale_denom(dinfo.image_width, width_out);
-
-	jpeg_start_decompress(&dinfo);
-
-	cmp = dinfo.output_components;
-	outbuf_len = width_out * cmp;
-	outbuf = malloc(outbuf_len);
-
-	cinfo.err = dinfo.err;
-	jpeg_create_compress(&cinfo);
-	jpeg_stdio_dest(&cinfo, output);
-	cinfo.image_width = width_out;
-	cinfo.image_height = height_out;
-	cinfo.input_components = cmp;
-	cinfo.in_color_space = dinfo.out_color_space;
-
-	jpeg_set_defaults(&cinfo);
-	jpeg_set_quality(&cinfo, 95, FALSE);
-	jpeg_start_compress(&cinfo, TRUE);
-
-	/* Write custom headers */
-	for (marker=dinfo.marker_list; marker; marker=marker->next) {
-		jpeg_write_marker(&cinfo, marker->marker, marker->data,
-			marker->data_length);
+	return 0;
+}
+
+static int batch_job(void *arg, const uint8_t *in, size_t in_len,
+	FILE *output, const struct batch_job *job, const char **err)
+{
+	struct batch_ctx *ctx;
+	struct jpeg_io io;
+
+	ctx = arg;
+	ctx->jpeg.opts = ctx->opts;
+	if (batch_opts(&ctx->jpeg.opts, job->opts, err)) {
+		return -1;
 	}
 
-	xscaler_init(&xs, dinfo.output_width, width_out, cmp, 1);
-	yscaler_init(&ys, dinfo.output_height, height_out, outbuf_len);
-	psl_pos0 = xscaler_psl_pos0(&xs);
-	for(i=0; i<height_out; i++) {
-		while ((tmp = yscaler_next(&ys))) {
-			jpeg_read_scanlines(&dinfo, &psl_pos0, 1);
-			xscaler_scale(&xs, tmp);
-		}
-		yscaler_scale(&ys, outbuf, i, cmp, 1);
-		jpeg_write_scanlines(&cinfo, (JSAMPARRAY)&outbuf, 1);
+	io.input = NULL;
+	io.in_buf = in;
+	io.in_len = in_len;
+	io.output = output;
+	if (jpeg(&ctx->jpeg, &io, job->width, job->height, 0)) {
+		*err = ctx->jpeg.msg;
+		return -1;
 	}
+	return 0;
+}
 
-	jpeg_finish_compress(&cinfo);
-	jpeg_destroy_compress(&cinfo);
+/**
+ * Parse a WIDTHxHEIGHT:FILE target. FILE is left in file, to be opened once
+ * all the arguments are known to be good.
+ */
+static int parse_target(char *arg, struct jpeg_target *t, char **file)
+{
+	char *end;
+
+	t->width = strtoul(arg, &end, 10);
+	if (*end != 'x') {
+		return -1;
+	}
+	t->height = strtoul(end + 1, &end, 10);
+	if (*end != ':' || !t->width || !t->height) {
+		return -1;
+	}
+	t->output = NULL;
+	*file = end + 1;
+	return 0;
+}
 
-	jpeg_finish_decompress(&dinfo);
-	jpeg_destroy_decompress(&dinfo);
-	free(outbuf);
-	yscaler_free(&ys);
-	xscaler_free(&xs);
+static void usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-c] [-f] [-j THREADS] [-k FILTER] [-l] [-p] "
+		"WIDTH HEIGHT [INPUT]\n", name);
+	fprintf(stderr, "       %s [-k FILTER] -t WIDTHxHEIGHT:FILE [-t ...] "
+		"[INPUT]\n", name);
+	fprintf(stderr, "       %s -b [-c] [-f] [-k FILTER] [-l] [-j THREADS] "
+		"[JOBS]\n", name);
+	fprintf(stderr, "FILTER is catrom (default), mitchell, lanczos2, "
+		"lanczos3, bilinear or box\n");
 }
 
 int main(int argc, char *argv[])
 {
-	uint32_t width, height;
-	char *end;
+	uint32_t i, width, height, n;
+	struct jpeg_target *targets;
+	struct jpeg_ctx ctx;
+	struct jpeg_io io;
+	struct mapped_file map;
+	struct batch_ops ops;
+	struct jpeg_opts opts;
+	FILE *jobs;
+	unsigned threads;
+	char **files, *end;
+	int opt, pipelined, batch, ret;
+
+	pipelined = 0;
+	batch = 0;
+	opts.flags = 0;
+	opts.filter = FILTER_CATROM;
+	opts.cover = 0;
+	opts.threads = 1;
+	threads = 1;
+	width = 0;
+	height = 0;
+	n = 0;
+	targets = malloc(argc * sizeof(struct jpeg_target));
+	files = malloc(argc * sizeof(char *));
+	while ((opt = getopt(argc, argv, "bcfj:k:lpt:")) != -1) {
+		switch (opt) {
+		case 'b':
+			batch = 1;
+			break;
+		case 'c':
+			opts.cover = 1;
+			break;
+		case 'f':
+			opts.flags |= IMGSCALE_FAST;
+			break;
+		case 'j':
+			threads = strtoul(optarg, &end, 10);
+			if (*end || !threads) {
+				fprintf(stderr, "Error: Invalid thread count.\n");
+				return 1;
+			}
+			break;
+		case 'k':
+			opts.filter = filter_by_name(optarg);
+			if (opts.filter < 0) {
+				fprintf(stderr, "Error: Invalid filter.\n");
+				return 1;
+			}
+			break;
+		case 'l':
+			opts.flags |= IMGSCALE_LINEAR;
+			break;
+		case 'p':
+			pipelined = 1;
+			break;
+		case 't':
+			if (parse_target(optarg, targets + n, files + n)) {
+				fprintf(stderr, "Error: Invalid target.\n");
+				return 1;
+			}
+			n++;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	/* in batch mode -j sets the number of jobs run at once */
+	if (batch) {
+		if (n || pipelined || argc - optind > 1) {
+			usage(argv[0]);
+			return 1;
+		}
+		jobs = argc > optind ? fopen(argv[optind], "r") : stdin;
+		if (!jobs) {
+			perror(argv[optind]);
+			return 1;
+		}
+		ops.ctx_new = batch_ctx_new;
+		ops.ctx_free = batch_ctx_free;
+		ops.run = batch_job;
+		ops.arg = &opts;
+		ret = batch_run(jobs, stdout, &ops, threads);
+		fclose(jobs);
+		free(files);
+		free(targets);
+		return ret ? 1 : 0;
+	}
+
+	if (n) {
+		if (argc - optind > 1 || opts.cover || opts.flags ||
+			pipelined) {
+			usage(argv[0]);
+			return 1;
+		}
+	} else {
+		if (argc - optind < 2 || argc - optind > 3) {
+			usage(argv[0]);
+			return 1;
+		}
+
+		width = strtoul(argv[optind], &end, 10);
+		if (*end) {
+			fprintf(stderr, "Error: Invalid width.\n");
+			return 1;
+		}
 
-	if (argc != 3) {
-		fprintf(stderr, "Usage: %s WIDTH HEIGHT\n", argv[0]);
-		return 1;
+		height = strtoul(argv[optind + 1], &end, 10);
+		if (*end) {
+			fprintf(stderr, "Error: Invalid height.\n");
+			return 1;
+		}
+		optind += 2;
 	}
 
-	width = strtoul(argv[1], &end, 10);
-	if (*end) {
-		fprintf(stderr, "Error: Invalid width.\n");
-		return 1;
+	/* map an input file rather than reading it through stdio, unless it
+	 * can't be mapped, like a pipe */
+	io.input = stdin;
+	map.buf = NULL;
+	if (argc > optind) {
+		if (!map_file(&map, argv[optind])) {
+			io.input = NULL;
+			io.in_buf = map.buf;
+			io.in_len = map.len;
+		} else {
+			io.input = fopen(argv[optind], "rb");
+			if (!io.input) {
+				perror(argv[optind]);
+				return 1;
+			}
+		}
 	}
 
-	height = strtoul(argv[2], &end, 10);
-	if (*end) {
-		fprintf(stderr, "Error: Invalid height.\n");
-		return 1;
+	/* create the outputs only once the arguments and input are good */
+	for (i=0; i<n; i++) {
+		if (!targets[i].output) {
+			targets[i].output = fopen(files[i], "wb");
+			if (!targets[i].output) {
+				perror(files[i]);
+				return 1;
+			}
+		}
 	}
 
-	jpeg(stdin, stdout, width, height);
+	jpeg_ctx_init(&ctx, 0);
+	ctx.opts = opts;
+	ctx.opts.threads = threads;
 
+	if (n) {
+		jpeg_ladder(&ctx, &io, targets, n);
+		while (n--) {
+			fclose(targets[n].output);
+		}
+	} else {
+		io.output = stdout;
+		jpeg(&ctx, &io, width, height, pipelined);
+	}
+
+	jpeg_ctx_free(&ctx);
+	unmap_file(&map);
+	if (io.input && io.input != stdin) {
+		fclose(io.input);
+	}
+	free(files);
+	free(targets);
 	fclose(stdin);
 	return 0;
 }
@@ -0,0 +1,182 @@
+/**
+ * Copyright (c) 2014-2016 Timothy Elliott
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "mapfile.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * Map the regular file open on fd, which is closed.
+ */
+static int map_fd(struct mapped_file *m, int fd, off_t size)
+{
+	void *buf;
+
+	/* mmap() refuses zero lengths, leave it to the decoder to complain */
+	if (!size) {
+		close(fd);
+		return 0;
+	}
+
+	buf = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (buf == MAP_FAILED) {
+		return -1;
+	}
+#ifdef MADV_SEQUENTIAL
+	madvise(buf, size, MADV_SEQUENTIAL);
+#endif
+	m->buf = buf;
+	m->len = size;
+	return 0;
+}
+
+/**
+ * Read everything left on fd into memory, and close it.
+ */
+static int read_fd(struct mapped_file *m, int fd)
+{
+	uint8_t *buf, *tmp;
+	size_t cap, len;
+	ssize_t n;
+	int err;
+
+	buf = NULL;
+	cap = len = 0;
+	for (;;) {
+		if (len == cap) {
+			cap = cap ? cap * 2 : 65536;
+			tmp = realloc(buf, cap);
+			if (!tmp) {
+				err = ENOMEM;
+				goto fail;
+			}
+			buf = tmp;
+		}
+		n = read(fd, buf + len, cap - len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n < 0) {
+			err = errno;
+			goto fail;
+		}
+		if (!n) {
+			break;
+		}
+		len += n;
+	}
+	close(fd);
+
+	if (!len) {
+		free(buf);
+		buf = NULL;
+	}
+	m->buf = buf;
+	m->len = len;
+	m->loaded = 1;
+	return 0;
+
+fail:
+	free(buf);
+	close(fd);
+	errno = err;
+	return -1;
+}
+
+/**
+ * Open path and map it, or with load set read it if it is not a regular file.
+ */
+static int open_file(struct mapped_file *m, const char *path, int load)
+{
+	struct stat st;
+	int fd;
+
+	m->buf = NULL;
+	m->len = 0;
+	m->loaded = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st)) {
+		close(fd);
+		return -1;
+	}
+	if (S_ISREG(st.st_mode)) {
+		return map_fd(m, fd, st.st_size);
+	}
+	if (load && !S_ISDIR(st.st_mode)) {
+		return read_fd(m, fd);
+	}
+	close(fd);
+	errno = S_ISDIR(st.st_mode) ? EISDIR : ENODEV;
+	return -1;
+}
+
+int map_file(struct mapped_file *m, const char *path)
+{
+	return open_file(m, path, 0);
+}
+
+int load_file(struct mapped_file *m, const char *path)
+{
+	return open_file(m, path, 1);
+}
+
+void unmap_file(struct mapped_file *m)
+{
+	if (m->buf && m->loaded) {
+		free((void *)m->buf);
+	} else if (m->buf) {
+		munmap((void *)m->buf, m->len);
+	}
+	m->buf = NULL;
+	m->len = 0;
+	m->loaded = 0;
+}
+
+void prefetch_file(const char *path)
+{
+#ifdef POSIX_FADV_WILLNEED
+	struct stat st;
+	int fd;
+
+	if (stat(path, &st) || !S_ISREG(st.st_mode)) {
+		return;
+	}
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	close(fd);
+#else
+	(void)path;
+#endif
+}
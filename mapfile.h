@@ -0,0 +1,59 @@
+/**
+ * Copyright (c) 2014-2016 Timothy Elliott
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef MAPFILE_H
+#define MAPFILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A file mapped into memory for reading, so the decoders can read it straight
+ * from the page cache without copying it through stdio buffers.
+ */
+struct mapped_file {
+	const uint8_t *buf; // NULL for an empty file
+	size_t len;
+	int loaded; // buf was read into memory by load_file() rather than mapped
+};
+
+/**
+ * Map the file at path for sequential reading. Returns 0 on success and -1
+ * with errno set on failure, which includes paths that can't be mapped such
+ * as pipes. Those can still be read through stdio.
+ */
+int map_file(struct mapped_file *m, const char *path);
+
+/**
+ * Same as map_file(), except that files which can't be mapped, like pipes and
+ * terminals, are read into memory instead. unmap_file() frees them as well.
+ */
+int load_file(struct mapped_file *m, const char *path);
+void unmap_file(struct mapped_file *m);
+
+/**
+ * Ask the kernel to start reading the file at path into the page cache, so it
+ * is there by the time it gets mapped. Errors are ignored, and anything but a
+ * regular file is left alone, as opening a pipe could block.
+ */
+void prefetch_file(const char *path);
+
+#endif
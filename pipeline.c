@@ -0,0 +1,395 @@
+/**
+ * Copyright (c) 2014-2016 Timothy Elliott
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "pipeline.h"
+#include "resample.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+/**
+ * Number of scanlines each queue can hold.
+ */
+#define QUEUE_LEN 16
+
+/* single producer, single consumer scanline queue */
+
+int spsc_init(struct spsc *q, uint32_t size, size_t slot_len)
+{
+	q->buf = malloc(size * slot_len);
+	if (!q->buf) {
+		return -2;
+	}
+	q->slot_len = slot_len;
+	q->size = size;
+	atomic_init(&q->head, 0);
+	atomic_init(&q->tail, 0);
+	return 0;
+}
+
+void spsc_free(struct spsc *q)
+{
+	free(q->buf);
+}
+
+uint8_t *spsc_claim(struct spsc *q)
+{
+	unsigned head;
+	head = atomic_load_explicit(&q->head, memory_order_relaxed);
+	while (head - atomic_load_explicit(&q->tail, memory_order_acquire) ==
+		q->size) {
+		sched_yield();
+	}
+	return q->buf + (head % q->size) * q->slot_len;
+}
+
+void spsc_publish(struct spsc *q)
+{
+	atomic_fetch_add_explicit(&q->head, 1, memory_order_release);
+}
+
+uint8_t *spsc_peek(struct spsc *q)
+{
+	unsigned tail;
+	tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+	while (atomic_load_explicit(&q->head, memory_order_acquire) == tail) {
+		sched_yield();
+	}
+	return q->buf + (tail % q->size) * q->slot_len;
+}
+
+void spsc_release(struct spsc *q)
+{
+	atomic_fetch_add_explicit(&q->tail, 1, memory_order_release);
+}
+
+/* pipeline stages */
+
+struct pipeline {
+	pipeline_row_fn read;
+	void *read_arg;
+	uint32_t in_height;
+	uint32_t out_height;
+	uint8_t cmp;
+	int filler;
+	size_t psl_offset; // decoded rows are written at this offset in a slot
+	struct coeff_tbl ct; // horizontal coefficients
+	struct yscaler ys;
+	int y_first; // see yscale_first()
+	uint8_t *psl; // padded scanline to y-scale into when y_first is set
+	struct spsc in_q; // padded scanlines from the decoder
+	struct spsc out_q; // scaled scanlines for the encoder
+};
+
+static void *pipeline_decode(void *arg)
+{
+	struct pipeline *pl;
+	uint32_t i;
+
+	pl = arg;
+	for (i=0; i<pl->in_height; i++) {
+		pl->read(pl->read_arg, spsc_claim(&pl->in_q) + pl->psl_offset);
+		spsc_publish(&pl->in_q);
+	}
+	return NULL;
+}
+
+/**
+ * Pull as many decoded scanlines as needed off the input queue to produce
+ * output scanline i, and put it on the output queue.
+ */
+static void pipeline_resample_row(struct pipeline *pl, uint32_t i)
+{
+	uint8_t *tmp, *psl;
+
+	while ((tmp = yscaler_next(&pl->ys))) {
+		psl = spsc_peek(&pl->in_q);
+		if (pl->y_first) {
+			memcpy(tmp, psl + pl->psl_offset, pl->ys.rb.length);
+		} else {
+			padded_sl_extend_edges(psl, pl->ct.dim_in,
+				pl->psl_offset, pl->cmp);
+			xscale_tbl(psl + pl->psl_offset, tmp, &pl->ct, pl->cmp,
+				pl->filler);
+		}
+		spsc_release(&pl->in_q);
+	}
+
+	if (!pl->y_first) {
+		yscaler_scale(&pl->ys, spsc_claim(&pl->out_q), i, pl->cmp,
+			pl->filler);
+		spsc_publish(&pl->out_q);
+		return;
+	}
+	yscaler_scale(&pl->ys, pl->psl + pl->psl_offset, i, pl->cmp,
+		pl->filler);
+	padded_sl_extend_edges(pl->psl, pl->ct.dim_in, pl->psl_offset, pl->cmp);
+	xscale_tbl(pl->psl + pl->psl_offset, spsc_claim(&pl->out_q), &pl->ct,
+		pl->cmp, pl->filler);
+	spsc_publish(&pl->out_q);
+}
+
+static void *pipeline_resample(void *arg)
+{
+	struct pipeline *pl;
+	uint32_t i;
+
+	pl = arg;
+	for (i=0; i<pl->out_height; i++) {
+		pipeline_resample_row(pl, i);
+	}
+	return NULL;
+}
+
+int pipeline_scale(pipeline_row_fn read, void *read_arg, pipeline_row_fn write,
+	void *write_arg, uint32_t in_width, uint32_t in_height,
+	uint32_t out_width, uint32_t out_height, int filter, uint8_t cmp,
+	int filler)
+{
+	struct pipeline pl;
+	pthread_t decoder, resampler;
+	size_t psl_len, outbuf_len, sl_len;
+	uint32_t i;
+	int ret, scaling;
+
+	if (!cmp || !in_height || !out_height || !filter_name(filter)) {
+		return -1;
+	}
+
+	pl.read = read;
+	pl.read_arg = read_arg;
+	pl.in_height = in_height;
+	pl.out_height = out_height;
+	pl.cmp = cmp;
+	pl.filler = filler;
+	outbuf_len = (size_t)out_width * cmp;
+	psl_len = padded_sl_len_offset(in_width, out_width, filter, cmp,
+		&pl.psl_offset);
+
+	pl.y_first = yscale_first(in_width, in_height, out_width, out_height,
+		filter);
+	sl_len = pl.y_first ? (size_t)in_width * cmp : outbuf_len;
+
+	ret = coeff_tbl_init(&pl.ct, in_width, out_width, filter);
+	if (ret) {
+		return ret;
+	}
+	ret = yscaler_init(&pl.ys, in_height, out_height, filter, sl_len);
+	if (ret) {
+		goto free_ct;
+	}
+	pl.psl = NULL;
+	if (pl.y_first) {
+		pl.psl = malloc(psl_len);
+		if (!pl.psl) {
+			ret = -2;
+			goto free_ys;
+		}
+	}
+	ret = spsc_init(&pl.in_q, QUEUE_LEN, psl_len);
+	if (ret) {
+		goto free_psl;
+	}
+	ret = spsc_init(&pl.out_q, QUEUE_LEN, outbuf_len);
+	if (ret) {
+		goto free_in_q;
+	}
+
+	ret = -3;
+	if (pthread_create(&decoder, NULL, pipeline_decode, &pl)) {
+		goto free_out_q;
+	}
+	scaling = !pthread_create(&resampler, NULL, pipeline_resample, &pl);
+
+	for (i=0; i<out_height; i++) {
+		/* the decoder is already running, so if we could not start the
+		 * scaling thread we do the scaling here */
+		if (!scaling) {
+			pipeline_resample_row(&pl, i);
+		}
+		write(write_arg, spsc_peek(&pl.out_q));
+		spsc_release(&pl.out_q);
+	}
+
+	if (scaling) {
+		pthread_join(resampler, NULL);
+	}
+	pthread_join(decoder, NULL);
+	ret = 0;
+
+free_out_q:
+	spsc_free(&pl.out_q);
+free_in_q:
+	spsc_free(&pl.in_q);
+free_psl:
+	free(pl.psl);
+free_ys:
+	yscaler_free(&pl.ys);
+free_ct:
+	coeff_tbl_free(&pl.ct);
+	return ret;
+}
+
+/* size ladder */
+
+struct ladder_rung {
+	struct coeff_tbl ct; // horizontal coefficients
+	struct yscaler ys;
+	int y_first; // see yscale_first()
+	uint8_t *psl; // padded scanline to y-scale into when y_first is set
+	size_t psl_offset;
+	uint8_t *outbuf;
+	uint32_t row; // next output scanline
+};
+
+static void ladder_free(struct ladder_rung *rungs, uint32_t n)
+{
+	uint32_t i;
+	for (i=0; i<n; i++) {
+		free(rungs[i].outbuf);
+		free(rungs[i].psl);
+		yscaler_free(&rungs[i].ys);
+		coeff_tbl_free(&rungs[i].ct);
+	}
+	free(rungs);
+}
+
+static int ladder_rung_init(struct ladder_rung *r, uint32_t in_width,
+	uint32_t in_height, struct ladder_out *out, int filter, uint8_t cmp)
+{
+	size_t psl_len;
+	int ret;
+
+	/* pick the same order as a single scale to out so the pixels match */
+	r->y_first = yscale_first(in_width, in_height, out->width, out->height,
+		filter);
+	psl_len = padded_sl_len_offset(in_width, out->width, filter, cmp,
+		&r->psl_offset);
+
+	ret = coeff_tbl_init(&r->ct, in_width, out->width, filter);
+	if (ret) {
+		return ret;
+	}
+	ret = yscaler_init(&r->ys, in_height, out->height, filter,
+		(size_t)(r->y_first ? in_width : out->width) * cmp);
+	if (ret) {
+		coeff_tbl_free(&r->ct);
+		return ret;
+	}
+	r->psl = r->y_first ? malloc(psl_len) : NULL;
+	r->outbuf = malloc((size_t)out->width * cmp);
+	if (!r->outbuf || (r->y_first && !r->psl)) {
+		free(r->outbuf);
+		free(r->psl);
+		yscaler_free(&r->ys);
+		coeff_tbl_free(&r->ct);
+		return -2;
+	}
+	r->row = 0;
+	return 0;
+}
+
+static void ladder_emit(struct ladder_rung *r, struct ladder_out *out,
+	uint8_t cmp, int filler)
+{
+	if (r->y_first) {
+		yscaler_scale(&r->ys, r->psl + r->psl_offset, r->row++, cmp,
+			filler);
+		padded_sl_extend_edges(r->psl, r->ct.dim_in, r->psl_offset,
+			cmp);
+		xscale_tbl(r->psl + r->psl_offset, r->outbuf, &r->ct, cmp,
+			filler);
+	} else {
+		yscaler_scale(&r->ys, r->outbuf, r->row++, cmp, filler);
+	}
+	out->write(out->write_arg, r->outbuf);
+}
+
+int ladder_scale(pipeline_row_fn read, void *read_arg, uint32_t in_width,
+	uint32_t in_height, int filter, uint8_t cmp, int filler,
+	struct ladder_out *outs, uint32_t n)
+{
+	struct ladder_rung *rungs, *r;
+	size_t pad, offset;
+	uint32_t i, k;
+	uint8_t *psl, *tmp;
+	int ret;
+
+	if (!cmp || !in_width || !in_height || !filter_name(filter) || !n) {
+		return -1;
+	}
+
+	rungs = calloc(n, sizeof(struct ladder_rung));
+	if (!rungs) {
+		return -2;
+	}
+
+	/* All outputs share one padded scanline with the widest padding */
+	pad = 0;
+	for (k=0; k<n; k++) {
+		ret = ladder_rung_init(rungs + k, in_width, in_height, outs + k,
+			filter, cmp);
+		if (ret) {
+			ladder_free(rungs, k);
+			return ret;
+		}
+		padded_sl_len_offset(in_width, outs[k].width, filter, cmp,
+			&offset);
+		pad = offset > pad ? offset : pad;
+	}
+
+	psl = malloc((size_t)in_width * cmp + pad * 2);
+	if (!psl) {
+		ladder_free(rungs, n);
+		return -2;
+	}
+
+	for (i=0; i<in_height; i++) {
+		read(read_arg, psl + pad);
+		padded_sl_extend_edges(psl, in_width, pad, cmp);
+		for (k=0; k<n; k++) {
+			r = rungs + k;
+			tmp = NULL;
+			while (r->row < outs[k].height &&
+				!(tmp = yscaler_next(&r->ys))) {
+				ladder_emit(r, outs + k, cmp, filler);
+			}
+			if (tmp && r->y_first) {
+				memcpy(tmp, psl + pad, r->ys.rb.length);
+			} else if (tmp) {
+				xscale_tbl(psl + pad, tmp, &r->ct, cmp, filler);
+			}
+		}
+	}
+
+	/* flush the scanlines at the bottom of each output */
+	for (k=0; k<n; k++) {
+		while (rungs[k].row < outs[k].height) {
+			ladder_emit(rungs + k, outs + k, cmp, filler);
+		}
+	}
+
+	free(psl);
+	ladder_free(rungs, n);
+	return 0;
+}
@@ -0,0 +1,112 @@
+/**
+ * Copyright (c) 2014-2016 Timothy Elliott
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef PIPELINE_H
+#define PIPELINE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+/**
+ * Bounded lock-free queue of scanlines with a single producer and a single
+ * consumer. The producer claims a slot, fills it and publishes it. The
+ * consumer peeks at the oldest published slot and releases it when done.
+ */
+struct spsc {
+	uint8_t *buf; // size slots of slot_len bytes each
+	size_t slot_len;
+	uint32_t size;
+	atomic_uint head; // number of slots published
+	atomic_uint tail; // number of slots released
+};
+
+int spsc_init(struct spsc *q, uint32_t size, size_t slot_len);
+void spsc_free(struct spsc *q);
+
+/**
+ * Wait for a free slot and return it. It is not visible to the consumer until
+ * spsc_publish() is called.
+ */
+uint8_t *spsc_claim(struct spsc *q);
+void spsc_publish(struct spsc *q);
+
+/**
+ * Wait for a published slot and return it. It is not reused by the producer
+ * until spsc_release() is called.
+ */
+uint8_t *spsc_peek(struct spsc *q);
+void spsc_release(struct spsc *q);
+
+/**
+ * Callback that reads or writes a single scanline.
+ */
+typedef void (*pipeline_row_fn)(void *arg, uint8_t *row);
+
+/**
+ * Scale an image with decoding, scaling and encoding on separate threads.
+ *
+ * The read callback is called in_height times from a decoder thread, and the
+ * scaling runs on a second thread. The write callback is called out_height
+ * times from the calling thread. The stages are connected by bounded queues so
+ * memory use stays constant, just like the single threaded loop.
+ *
+ * returns 0 on success, otherwise a negative integer:
+ *
+ * -1 - bad input parameter
+ * -2 - unable to perform an allocation
+ * -3 - unable to start a thread
+ */
+int pipeline_scale(pipeline_row_fn read, void *read_arg, pipeline_row_fn write,
+	void *write_arg, uint32_t in_width, uint32_t in_height,
+	uint32_t out_width, uint32_t out_height, int filter, uint8_t cmp,
+	int filler);
+
+/**
+ * One output size of ladder_scale(). The write callback is called height times
+ * with scanlines of width samples.
+ */
+struct ladder_out {
+	uint32_t width;
+	uint32_t height;
+	pipeline_row_fn write;
+	void *write_arg;
+};
+
+/**
+ * Scale an image to several sizes from a single decode.
+ *
+ * The read callback is called in_height times. Each decoded scanline is
+ * padded once and then fanned out to an x-scaler and y-scaler per output, and
+ * output scanlines are written as soon as they can be produced. Each output
+ * scales in the order yscale_first() picks for it, so it matches a single
+ * scale to that size.
+ *
+ * returns 0 on success, otherwise a negative integer:
+ *
+ * -1 - bad input parameter
+ * -2 - unable to perform an allocation
+ */
+int ladder_scale(pipeline_row_fn read, void *read_arg, uint32_t in_width,
+	uint32_t in_height, int filter, uint8_t cmp, int filler,
+	struct ladder_out *outs, uint32_t n);
+
+#endif
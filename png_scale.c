@@ -0,0 +1,915 @@
+/**
+ * Copyright (c) 2014-2016 Timothy Elliott
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "png_scale.h"
+#include "pipeline.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <setjmp.h>
+#include <png.h>
+#include <pthread.h>
+
+static void png_error_exit(png_structp png, png_const_charp msg,
+	const char *what)
+{
+	struct png_ctx *ctx;
+
+	ctx = png_get_error_ptr(png);
+	if (!ctx->recover) {
+		fprintf(stderr, "%s\n", what);
+		exit(1);
+	}
+	snprintf(ctx->msg, sizeof(ctx->msg), "%s", msg);
+	longjmp(ctx->env, 1);
+}
+
+static void png_read_error(png_structp png, png_const_charp msg)
+{
+	png_error_exit(png, msg, "PNG Decoding Error.");
+}
+
+static void png_write_error(png_structp png, png_const_charp msg)
+{
+	png_error_exit(png, msg, "PNG Encoding Error.");
+}
+
+/**
+ * libpng warnings are harmless, so they are only printed when not recovering,
+ * which keeps them off the stderr of processes using the library.
+ */
+static void png_warn(png_structp png, png_const_charp msg)
+{
+	struct png_ctx *ctx;
+
+	ctx = png_get_error_ptr(png);
+	if (!ctx->recover) {
+		fprintf(stderr, "libpng warning: %s\n", msg);
+	}
+}
+
+/**
+ * Whether the decoded rows have alpha, which has them scaled premultiplied. The
+ * filler byte added to RGB rows isn't alpha.
+ */
+static int png_has_alpha(png_structp rpng, png_infop rinfo)
+{
+	return png_get_color_type(rpng, rinfo) & PNG_COLOR_MASK_ALPHA ? 1 : 0;
+}
+
+void png_ctx_init(struct png_ctx *ctx, int recover)
+{
+	memset(ctx, 0, sizeof(struct png_ctx));
+	ctx->recover = recover;
+	imgscale_ctx_init(&ctx->sc);
+}
+
+void png_ctx_free(struct png_ctx *ctx)
+{
+	imgscale_ctx_free(&ctx->sc);
+	if (ctx->pool) {
+		xscale_pool_free(ctx->pool);
+		free(ctx->pool);
+	}
+}
+
+/**
+ * PNG samples of 16 bits are big endian, and the scaler takes native endian
+ * ones.
+ */
+static int little_endian(void)
+{
+	uint16_t x;
+
+	x = 1;
+	return *(uint8_t *)&x;
+}
+
+/**
+ * Free the decoded image of a job.
+ */
+static void png_ctx_release(struct png_ctx *ctx)
+{
+	uint32_t i;
+
+	if (ctx->sl) {
+		for (i=0; i<ctx->sl_len; i++) {
+			free(ctx->sl[i]);
+		}
+		free(ctx->sl);
+	}
+	ctx->sl = NULL;
+	ctx->sl_len = 0;
+}
+
+/**
+ * State shared by the threads scaling a fully decoded image.
+ *
+ * Workers claim output rows in order and scale them into a window of rows. The
+ * main thread writes finished rows out in order, and a worker may not claim a
+ * row until its slot in the window has been written.
+ *
+ * When x-scaling first is cheaper, the workers first x-scale every input row
+ * into xsl, and the output rows are then y-scaled from there.
+ */
+struct row_pool {
+	uint8_t **sl; // decoded input scanlines
+	uint8_t **xsl; // x-scaled input scanlines, unless y_first is set
+	uint32_t in_width;
+	uint32_t in_height;
+	uint32_t out_width;
+	uint32_t out_height;
+	int filter; // enum imgscale_filter
+	png_byte cmp;
+	int alpha; // rows are premultiplied, see png_has_alpha()
+	int y_first; // see yscale_first()
+	uint8_t *rows; // window of scaled output rows
+	uint8_t *done; // whether each row in the window is ready to be written
+	uint32_t window; // number of rows in the window
+	uint32_t next; // next output row to be claimed by a worker
+	uint32_t written; // number of output rows written so far
+	unsigned failed; // workers that couldn't set up their scalers
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+/**
+ * A worker couldn't set up its scalers and leaves its share of rows to the
+ * others.
+ */
+static void row_pool_fail(struct row_pool *rp)
+{
+	pthread_mutex_lock(&rp->lock);
+	rp->failed++;
+	pthread_cond_broadcast(&rp->cond);
+	pthread_mutex_unlock(&rp->lock);
+}
+
+/**
+ * X-scale the input rows claimed in turn into rp->xsl.
+ */
+static void *row_pool_xworker(void *arg)
+{
+	struct row_pool *rp;
+	struct xscaler xs;
+	uint32_t i;
+
+	rp = arg;
+	if (xscaler_init(&xs, rp->in_width, rp->out_width, rp->filter, rp->cmp,
+		!rp->alpha)) {
+		row_pool_fail(rp);
+		return NULL;
+	}
+
+	for (;;) {
+		pthread_mutex_lock(&rp->lock);
+		i = rp->next;
+		if (i < rp->in_height) {
+			rp->next++;
+		}
+		pthread_mutex_unlock(&rp->lock);
+		if (i == rp->in_height) {
+			break;
+		}
+
+		memcpy(xscaler_psl_pos0(&xs), rp->sl[i],
+			(size_t)rp->in_width * rp->cmp);
+		xscaler_scale(&xs, rp->xsl[i]);
+	}
+
+	xscaler_free(&xs);
+	return NULL;
+}
+
+static void *row_pool_worker(void *arg)
+{
+	struct row_pool *rp;
+	struct imgscale_ctx sc;
+	uint8_t *yscaled, *out;
+	uint32_t i, slot;
+	size_t outbuf_len;
+
+	rp = arg;
+	outbuf_len = rp->out_width * rp->cmp;
+	imgscale_ctx_init(&sc);
+	if (imgscale_ctx_reset(&sc, rp->in_width, rp->in_height, rp->out_width,
+		rp->out_height, rp->filter, rp->cmp, !rp->alpha, 0)) {
+		row_pool_fail(rp);
+		return NULL;
+	}
+	yscaled = xscaler_psl_pos0(&sc.xs);
+
+	for (;;) {
+		pthread_mutex_lock(&rp->lock);
+		while (rp->next < rp->out_height &&
+			rp->next >= rp->written + rp->window) {
+			pthread_cond_wait(&rp->cond, &rp->lock);
+		}
+		if (rp->next == rp->out_height) {
+			pthread_mutex_unlock(&rp->lock);
+			break;
+		}
+		i = rp->next++;
+		pthread_mutex_unlock(&rp->lock);
+
+		slot = i % rp->window;
+		out = rp->rows + slot * outbuf_len;
+		if (!rp->y_first) {
+			yscaler_prealloc_row(&sc.ys, rp->xsl, out, i,
+				rp->out_width, rp->cmp, !rp->alpha);
+		} else {
+			yscaler_prealloc_row(&sc.ys, rp->sl, yscaled, i,
+				rp->in_width, rp->cmp, !rp->alpha);
+			xscaler_scale(&sc.xs, out);
+		}
+		if (rp->alpha) {
+			unpremultiply_row(out, rp->out_width, rp->cmp);
+		}
+
+		pthread_mutex_lock(&rp->lock);
+		rp->done[slot] = 1;
+		pthread_cond_broadcast(&rp->cond);
+		pthread_mutex_unlock(&rp->lock);
+	}
+
+	imgscale_ctx_free(&sc);
+	return NULL;
+}
+
+/**
+ * Start up to threads workers running fn, and return how many started.
+ */
+static unsigned row_pool_start(pthread_t *tids, unsigned threads,
+	void *(*fn)(void *), struct row_pool *rp)
+{
+	unsigned t;
+
+	rp->failed = 0;
+	for (t=0; t<threads; t++) {
+		if (pthread_create(&tids[t], NULL, fn, rp)) {
+			break;
+		}
+	}
+	return t;
+}
+
+static void row_pool_join(pthread_t *tids, unsigned started)
+{
+	unsigned t;
+
+	for (t=0; t<started; t++) {
+		pthread_join(tids[t], NULL);
+	}
+}
+
+static void row_pool_free(struct row_pool *rp, pthread_t *tids)
+{
+	free(tids);
+	free(rp->xsl);
+	pthread_cond_destroy(&rp->cond);
+	pthread_mutex_destroy(&rp->lock);
+	free(rp->done);
+	free(rp->rows);
+}
+
+/**
+ * Scale a fully decoded image with several threads and write the rows out in
+ * order. The rows are scaled by the threads that could be started.
+ *
+ * Returns 0 once the image is written, or -1 without writing anything if no
+ * thread could be started to scale the output rows.
+ */
+static int png_interlaced_threaded(png_structp wpng, struct row_pool *rp,
+	unsigned threads)
+{
+	pthread_t *tids;
+	uint32_t i, slot;
+	unsigned started;
+	size_t outbuf_len;
+	uint8_t *buf, ready;
+
+	outbuf_len = rp->out_width * rp->cmp;
+	rp->window = threads * 4;
+	rp->rows = malloc(rp->window * outbuf_len);
+	rp->done = calloc(rp->window, 1);
+	tids = malloc(threads * sizeof(pthread_t));
+	rp->next = rp->written = 0;
+	rp->xsl = NULL;
+	pthread_mutex_init(&rp->lock, NULL);
+	pthread_cond_init(&rp->cond, NULL);
+	if (!rp->rows || !rp->done || !tids) {
+		row_pool_free(rp, tids);
+		png_error(wpng, "Out of memory");
+	}
+
+	/* fall back to y-scaling first if the x-scaled rows don't fit */
+	if (!rp->y_first) {
+		rp->xsl = malloc(rp->in_height *
+			(sizeof(uint8_t *) + outbuf_len));
+		rp->y_first = !rp->xsl;
+	}
+	if (!rp->y_first) {
+		buf = (uint8_t *)(rp->xsl + rp->in_height);
+		for (i=0; i<rp->in_height; i++) {
+			rp->xsl[i] = buf + i * outbuf_len;
+		}
+		started = row_pool_start(tids, threads, row_pool_xworker, rp);
+		if (!started) {
+			row_pool_xworker(rp);
+		}
+		row_pool_join(tids, started);
+
+		/* every worker failed before claiming the rows left */
+		if (rp->next < rp->in_height) {
+			row_pool_free(rp, tids);
+			png_error(wpng, "Out of memory");
+		}
+		rp->next = 0;
+	}
+
+	/* the writer can't scale rows as well, so scale on this thread alone
+	 * if there are no workers */
+	started = row_pool_start(tids, threads, row_pool_worker, rp);
+	if (!started) {
+		row_pool_free(rp, tids);
+		return -1;
+	}
+
+	for (i=0; i<rp->out_height; i++) {
+		slot = i % rp->window;
+		pthread_mutex_lock(&rp->lock);
+		while (!rp->done[slot] && rp->failed < started) {
+			pthread_cond_wait(&rp->cond, &rp->lock);
+		}
+		ready = rp->done[slot];
+		pthread_mutex_unlock(&rp->lock);
+
+		/* the workers that could have scaled the row failed */
+		if (!ready) {
+			row_pool_join(tids, started);
+			row_pool_free(rp, tids);
+			png_error(wpng, "Out of memory");
+		}
+
+		png_write_row(wpng, rp->rows + slot * outbuf_len);
+
+		pthread_mutex_lock(&rp->lock);
+		rp->done[slot] = 0;
+		rp->written++;
+		pthread_cond_broadcast(&rp->cond);
+		pthread_mutex_unlock(&rp->lock);
+	}
+
+	row_pool_join(tids, started);
+	row_pool_free(rp, tids);
+	return 0;
+}
+
+/**
+ * Scale a fully decoded image to the size of the PNG being written. With
+ * threads > 1 the output rows are spread across a pool of worker threads, or
+ * scaled on this thread if none of them start.
+ */
+static void png_scale_image(struct png_ctx *ctx, uint32_t in_width,
+	uint32_t in_height, png_byte cmp, int alpha, png_structp wpng,
+	png_infop winfo, unsigned threads)
+{
+	struct imgscale_ctx *sc;
+	uint8_t *yscaled, *row;
+	uint32_t i, j, out_width, out_height;
+	struct row_pool rp;
+	STATS(uint64_t t;)
+
+	out_width = png_get_image_width(wpng, winfo);
+	out_height = png_get_image_height(wpng, winfo);
+
+	if (threads > 1) {
+		rp.sl = ctx->sl;
+		rp.in_width = in_width;
+		rp.in_height = in_height;
+		rp.out_width = out_width;
+		rp.out_height = out_height;
+		rp.filter = ctx->opts.filter;
+		rp.cmp = cmp;
+		rp.alpha = alpha;
+		rp.y_first = yscale_first(in_width, in_height, out_width,
+			out_height, ctx->opts.filter);
+		if (!png_interlaced_threaded(wpng, &rp, threads)) {
+			STATS(stats_alloc(ctx->st, rp.window * out_width * cmp +
+				(rp.y_first ? 0 : in_height *
+				(sizeof(uint8_t *) + out_width * cmp)));)
+			return;
+		}
+	}
+
+	sc = &ctx->sc;
+	if (imgscale_ctx_reset(sc, in_width, in_height, out_width, out_height,
+		ctx->opts.filter, cmp, !alpha, 0)) {
+		png_error(wpng, "Out of memory");
+	}
+	yscaled = xscaler_psl_pos0(&sc->xs);
+	j = 0;
+
+	for (i=0; i<out_height; i++) {
+		if (sc->y_first) {
+			STATS(t = stats_start(ctx->st);)
+			yscaler_prealloc_row(&sc->ys, ctx->sl, yscaled, i,
+				in_width, cmp, !alpha);
+			STATS(stats_add(ctx->st, STATS_YSCALE, t, 1);)
+			STATS(t = stats_start(ctx->st);)
+			xscaler_scale(&sc->xs, sc->outbuf);
+			STATS(stats_add(ctx->st, STATS_XSCALE, t, 1);)
+		} else {
+			/* stream the decoded rows through sc */
+			while ((row = imgscale_ctx_next(sc))) {
+				memcpy(row, ctx->sl[j++], (size_t)in_width * cmp);
+				STATS(t = stats_start(ctx->st);)
+				imgscale_ctx_push(sc);
+				STATS(stats_add(ctx->st, STATS_XSCALE, t, 1);)
+			}
+			STATS(t = stats_start(ctx->st);)
+			imgscale_ctx_scale(sc, i);
+			STATS(stats_add(ctx->st, STATS_YSCALE, t, 1);)
+		}
+		if (alpha) {
+			unpremultiply_row(sc->outbuf, out_width, cmp);
+		}
+		STATS(t = stats_start(ctx->st);)
+		png_write_row(wpng, sc->outbuf);
+		STATS(stats_add(ctx->st, STATS_ENCODE, t, 1);)
+	}
+}
+
+/** Interlaced PNGs need to be fully decompressed before we can scale the image.
+  *
+  * The whole image is at hand, so y-scaling first needs no ring buffer. Still,
+  * when yscale_first() finds x-scaling first to be less work, the rows are
+  * x-scaled first.
+  *
+  * Every output row only depends on the decoded image, so with threads > 1 the
+  * output rows are spread across a pool of worker threads. Images with alpha
+  * are premultiplied once after decoding.
+  */
+static void png_interlaced(struct png_ctx *ctx, png_structp rpng,
+	png_infop rinfo, struct png_target *targets, uint32_t n, unsigned threads)
+{
+	uint32_t i, in_width, in_height;
+	size_t buf_len;
+	png_byte cmp;
+	int alpha;
+	STATS(uint64_t t;)
+
+	in_width = png_get_image_width(rpng, rinfo);
+	in_height = png_get_image_height(rpng, rinfo);
+	cmp = png_get_channels(rpng, rinfo);
+	alpha = png_has_alpha(rpng, rinfo);
+
+	ctx->sl = malloc(in_height * sizeof(uint8_t *));
+	if (!ctx->sl) {
+		png_error(rpng, "Out of memory");
+	}
+
+	buf_len = png_get_rowbytes(rpng, rinfo);
+	for (i=0; i<in_height; i++) {
+		ctx->sl[i] = malloc(buf_len);
+		if (!ctx->sl[i]) {
+			png_error(rpng, "Out of memory");
+		}
+		ctx->sl_len++;
+	}
+
+	STATS(stats_alloc(ctx->st, in_height * (buf_len + sizeof(uint8_t *)));)
+
+	STATS(t = stats_start(ctx->st);)
+	png_read_image(rpng, ctx->sl);
+	if (alpha) {
+		for (i=0; i<in_height; i++) {
+			premultiply_row(ctx->sl[i], in_width, cmp);
+		}
+	}
+	STATS(stats_add(ctx->st, STATS_DECODE, t, in_height);)
+
+	for (i=0; i<n; i++) {
+		png_scale_image(ctx, in_width, in_height, cmp, alpha,
+			targets[i].wpng, targets[i].winfo, threads);
+	}
+}
+
+/**
+ * Argument of png_read_cb() and png_write_cb(). Rows of an image with alpha
+ * are premultiplied as they are read and unpremultiplied before they are
+ * written, on the threads that read and write them.
+ */
+struct png_rows {
+	png_structp png;
+	uint32_t width;
+	png_byte cmp;
+	int alpha; // see png_has_alpha()
+};
+
+static void png_rows_init(struct png_rows *r, png_structp png, uint32_t width,
+	png_byte cmp, int alpha)
+{
+	r->png = png;
+	r->width = width;
+	r->cmp = cmp;
+	r->alpha = alpha;
+}
+
+static void png_read_cb(void *arg, uint8_t *row)
+{
+	struct png_rows *r;
+
+	r = arg;
+	png_read_row(r->png, row, NULL);
+	if (r->alpha) {
+		premultiply_row(row, r->width, r->cmp);
+	}
+}
+
+static void png_write_cb(void *arg, uint8_t *row)
+{
+	struct png_rows *r;
+
+	r = arg;
+	if (r->alpha) {
+		unpremultiply_row(row, r->width, r->cmp);
+	}
+	png_write_row(r->png, row);
+}
+
+/**
+ * Start the threads that x-scale wide scanlines for the context, once.
+ */
+static int png_ctx_pool(struct png_ctx *ctx, unsigned threads)
+{
+	if (ctx->pool) {
+		return 0;
+	}
+	ctx->pool = malloc(sizeof(struct xscale_pool));
+	if (!ctx->pool) {
+		return -2;
+	}
+	if (xscale_pool_init(ctx->pool, threads)) {
+		free(ctx->pool);
+		ctx->pool = NULL;
+		return -3;
+	}
+	return 0;
+}
+
+/**
+ * Non-interlaced PNGs are streamed one scanline at a time. With pipelined set,
+ * decoding, scaling and encoding run on separate threads. Otherwise the scaler
+ * premultiplies rows with alpha itself as they are pushed, and wide scanlines
+ * are x-scaled on threads threads.
+ */
+static void png_noninterlaced(struct png_ctx *ctx, png_structp rpng,
+	png_infop rinfo, png_structp wpng, png_infop winfo, unsigned threads,
+	int pipelined)
+{
+	uint32_t i, in_width, in_height, out_width, out_height;
+	uint8_t *row;
+	struct imgscale_ctx *sc;
+	struct png_rows rrows, wrows;
+	png_byte cmp;
+	int alpha, flags;
+	STATS(uint64_t t;)
+
+	in_width = png_get_image_width(rpng, rinfo);
+	in_height = png_get_image_height(rpng, rinfo);
+	out_width = png_get_image_width(wpng, winfo);
+	out_height = png_get_image_height(wpng, winfo);
+	cmp = png_get_channels(rpng, rinfo);
+	alpha = png_has_alpha(rpng, rinfo);
+
+	if (pipelined) {
+		png_rows_init(&rrows, rpng, in_width, cmp, alpha);
+		png_rows_init(&wrows, wpng, out_width, cmp, alpha);
+		switch (pipeline_scale(png_read_cb, &rrows, png_write_cb,
+			&wrows, in_width, in_height, out_width, out_height,
+			ctx->opts.filter, cmp, !alpha)) {
+		case 0:
+			return;
+		case -3:
+			png_error(wpng, "Unable to start threads");
+		default:
+			png_error(wpng, "Out of memory");
+		}
+	}
+
+	/* only this path keeps 16-bit samples, see png() */
+	flags = (ctx->opts.flags & ~IMGSCALE_16BIT) | IMGSCALE_PREMULTIPLY;
+	if (png_get_bit_depth(rpng, rinfo) == 16) {
+		flags |= IMGSCALE_16BIT;
+	}
+
+	sc = &ctx->sc;
+	if (threads > 1 && png_ctx_pool(ctx, threads)) {
+		png_error(wpng, "Unable to start threads");
+	}
+	sc->pool = ctx->pool;
+	if (imgscale_ctx_reset(sc, in_width, in_height, out_width, out_height,
+		ctx->opts.filter, cmp, !alpha, flags)) {
+		png_error(wpng, "Out of memory");
+	}
+	for(i=0; i<out_height; i++) {
+		while ((row = imgscale_ctx_next(sc))) {
+			STATS(t = stats_start(ctx->st);)
+			png_read_row(rpng, row, NULL);
+			STATS(stats_add(ctx->st, STATS_DECODE, t, 1);)
+			STATS(t = stats_start(ctx->st);)
+			imgscale_ctx_push(sc);
+			STATS(stats_add(ctx->st, STATS_XSCALE, t, 1);)
+		}
+		STATS(t = stats_start(ctx->st);)
+		imgscale_ctx_scale(sc, i);
+		STATS(stats_add(ctx->st, STATS_YSCALE, t, 1);)
+		STATS(t = stats_start(ctx->st);)
+		png_write_row(wpng, sc->outbuf);
+		STATS(stats_add(ctx->st, STATS_ENCODE, t, 1);)
+	}
+}
+
+/**
+ * Scale a non-interlaced PNG to several sizes while only decoding it once.
+ */
+static void png_ladder(png_structp rpng, png_infop rinfo,
+	struct png_target *targets, uint32_t n, int filter)
+{
+	struct ladder_out *outs;
+	struct png_rows *rows;
+	uint32_t i, in_width;
+	png_byte cmp;
+	int alpha, ret;
+
+	in_width = png_get_image_width(rpng, rinfo);
+	cmp = png_get_channels(rpng, rinfo);
+	alpha = png_has_alpha(rpng, rinfo);
+
+	/* rows[n] is for reading */
+	outs = malloc(n * sizeof(struct ladder_out));
+	rows = malloc((n + 1) * sizeof(struct png_rows));
+	if (!outs || !rows) {
+		free(rows);
+		free(outs);
+		png_error(rpng, "Out of memory");
+	}
+	for (i=0; i<n; i++) {
+		png_rows_init(rows + i, targets[i].wpng, targets[i].width, cmp,
+			alpha);
+		outs[i].width = targets[i].width;
+		outs[i].height = targets[i].height;
+		outs[i].write = png_write_cb;
+		outs[i].write_arg = rows + i;
+	}
+	png_rows_init(rows + n, rpng, in_width, cmp, alpha);
+
+	ret = ladder_scale(png_read_cb, rows + n, in_width,
+		png_get_image_height(rpng, rinfo), filter, cmp, !alpha, outs,
+		n);
+	free(rows);
+	free(outs);
+	if (ret) {
+		png_error(rpng, "Out of memory");
+	}
+}
+
+static void png_read_mem(png_structp png, png_bytep data, png_size_t len)
+{
+	struct png_src *src;
+
+	src = png_get_io_ptr(png);
+	if (len > src->len - src->pos) {
+		png_error(png, "Read Error");
+	}
+	memcpy(data, src->buf + src->pos, len);
+	src->pos += len;
+}
+
+static void png_write_mem(png_structp png, png_bytep data, png_size_t len)
+{
+	struct png_target *t;
+	uint8_t *buf;
+	size_t cap;
+
+	t = png_get_io_ptr(png);
+	if (len > t->cap - t->len) {
+		cap = t->cap ? t->cap : 4096;
+		while (len > cap - t->len) {
+			cap *= 2;
+		}
+		buf = realloc(t->buf, cap);
+		if (!buf) {
+			png_error(png, "Out of memory");
+		}
+		t->buf = buf;
+		t->cap = cap;
+	}
+	memcpy(t->buf + t->len, data, len);
+	t->len += len;
+}
+
+static void png_flush_mem(png_structp png)
+{
+}
+
+/**
+ * Create the PNG writer for a target and write the PNG header. RGB rows of cmp
+ * 4 carry a filler sample, and rows of depth 16 hold native endian samples.
+ */
+static void png_open_dest(struct png_ctx *ctx, struct png_target *t,
+	png_byte ctype, png_byte cmp, png_byte depth)
+{
+	t->wpng = png_create_write_struct(PNG_LIBPNG_VER_STRING, ctx,
+		png_write_error, png_warn);
+	t->winfo = png_create_info_struct(t->wpng);
+	if (t->output) {
+		png_init_io(t->wpng, t->output);
+	} else {
+		png_set_write_fn(t->wpng, t, png_write_mem, png_flush_mem);
+	}
+
+	png_set_IHDR(t->wpng, t->winfo, t->width, t->height, depth, ctype,
+		PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+		PNG_FILTER_TYPE_DEFAULT);
+
+	png_write_info(t->wpng, t->winfo);
+
+	if (ctype == PNG_COLOR_TYPE_RGB && cmp == 4) {
+		png_set_filler(t->wpng, 0, PNG_FILLER_AFTER);
+	}
+	if (depth == 16 && little_endian()) {
+		png_set_swap(t->wpng);
+	}
+}
+
+#ifdef IMGSCALE_STATS
+/**
+ * Fill in the stats of a scaled image and print them. With several targets
+ * the first one is reported as the output.
+ */
+static void png_stats_end(struct png_ctx *ctx, png_structp rpng,
+	png_infop rinfo, struct png_src *src, struct png_target *targets,
+	uint32_t n, unsigned threads, int pipelined)
+{
+	struct imgscale_stats *st;
+	int interlaced;
+
+	st = ctx->st;
+	if (!st) {
+		return;
+	}
+
+	st->in_width = png_get_image_width(rpng, rinfo);
+	st->in_height = png_get_image_height(rpng, rinfo);
+	st->out_width = targets[0].width;
+	st->out_height = targets[0].height;
+	st->cmp = png_get_channels(rpng, rinfo);
+	st->filter = filter_name(ctx->opts.filter);
+
+	interlaced = png_get_interlace_type(rpng, rinfo) == PNG_INTERLACE_ADAM7;
+	if (interlaced) {
+		st->mode = threads > 1 ? "interlaced_threaded" : "interlaced";
+	} else if (n > 1) {
+		st->mode = "ladder";
+	} else if (pipelined) {
+		st->mode = "pipelined";
+	}
+	if (interlaced || pipelined) {
+		st->y_first = yscale_first(st->in_width, st->in_height,
+			st->out_width, st->out_height, ctx->opts.filter);
+	}
+
+	/* the other modes scale with scalers of their own */
+	if (interlaced ? threads == 1 : n == 1 && !pipelined) {
+		st->taps_x = ctx->sc.xs.ct.taps;
+		st->taps_y = ctx->sc.ys.ct.taps;
+		st->y_first = ctx->sc.y_first;
+		stats_alloc(st, ctx->sc.arena_len);
+	}
+
+	st->bytes_in = src->input ? ftell(src->input) : (long)src->pos;
+	st->bytes_out = targets[0].output ? ftell(targets[0].output) :
+		(long)targets[0].len;
+	stats_print(st, stderr, "pngscale");
+}
+#endif
+
+int png(struct png_ctx *ctx, struct png_src *src, struct png_target *targets,
+	uint32_t n, unsigned threads, int pipelined)
+{
+	png_structp rpng;
+	png_infop rinfo;
+	png_uint_32 in_width, in_height;
+	png_byte ctype;
+	uint32_t i;
+
+	STATS(ctx->st = stats_begin(&ctx->stats);)
+	rpng = png_create_read_struct(PNG_LIBPNG_VER_STRING, ctx,
+		png_read_error, png_warn);
+	if (!rpng) {
+		snprintf(ctx->msg, sizeof(ctx->msg), "Out of memory");
+		return -1;
+	}
+	rinfo = png_create_info_struct(rpng);
+	for (i=0; i<n; i++) {
+		targets[i].wpng = NULL;
+		targets[i].winfo = NULL;
+		targets[i].buf = NULL;
+		targets[i].len = targets[i].cap = 0;
+	}
+
+	if (setjmp(ctx->env)) {
+		for (i=0; i<n; i++) {
+			png_destroy_write_struct(&targets[i].wpng,
+				&targets[i].winfo);
+		}
+		png_destroy_read_struct(&rpng, &rinfo, NULL);
+		png_ctx_release(ctx);
+		return -1;
+	}
+
+	if (src->input) {
+		png_init_io(rpng, src->input);
+	} else {
+		png_set_read_fn(rpng, src, png_read_mem);
+	}
+	png_read_info(rpng, rinfo);
+
+	/* 16-bit samples are kept on the plain streaming path, the other modes
+	 * scale 8-bit samples */
+	png_set_packing(rpng);
+	if (png_get_bit_depth(rpng, rinfo) == 16 && n == 1 && !pipelined &&
+		png_get_interlace_type(rpng, rinfo) == PNG_INTERLACE_NONE) {
+		if (little_endian()) {
+			png_set_swap(rpng);
+		}
+	} else {
+		png_set_strip_16(rpng);
+	}
+	png_set_expand(rpng);
+
+	ctype = png_get_color_type(rpng, rinfo);
+	if (ctype == PNG_COLOR_TYPE_RGB) {
+		png_set_filler(rpng, 0, PNG_FILLER_AFTER);
+	}
+	png_read_update_info(rpng, rinfo);
+
+	/* write what the rows were expanded to, a palette becomes RGB, or
+	 * RGBA with transparency */
+	ctype = png_get_color_type(rpng, rinfo);
+	in_width = png_get_image_width(rpng, rinfo);
+	in_height = png_get_image_height(rpng, rinfo);
+
+	for (i=0; i<n; i++) {
+		fix_ratio(in_width, in_height, &targets[i].width,
+			&targets[i].height);
+		png_open_dest(ctx, targets + i, ctype,
+			png_get_channels(rpng, rinfo),
+			png_get_bit_depth(rpng, rinfo));
+	}
+
+	switch (png_get_interlace_type(rpng, rinfo)) {
+	case PNG_INTERLACE_NONE:
+		if (n == 1) {
+			png_noninterlaced(ctx, rpng, rinfo, targets[0].wpng,
+				targets[0].winfo, threads, pipelined);
+		} else {
+			png_ladder(rpng, rinfo, targets, n, ctx->opts.filter);
+		}
+		break;
+	case PNG_INTERLACE_ADAM7:
+		png_interlaced(ctx, rpng, rinfo, targets, n, threads);
+		break;
+	}
+
+	for (i=0; i<n; i++) {
+		png_write_end(targets[i].wpng, targets[i].winfo);
+		png_destroy_write_struct(&targets[i].wpng, &targets[i].winfo);
+	}
+	STATS(png_stats_end(ctx, rpng, rinfo, src, targets, n, threads,
+		pipelined);)
+	png_destroy_read_struct(&rpng, &rinfo, NULL);
+	png_ctx_release(ctx);
+	return 0;
+}
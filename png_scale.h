@@ -0,0 +1,106 @@
+/**
+ * Copyright (c) 2014-2016 Timothy Elliott
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef PNG_SCALE_H
+#define PNG_SCALE_H
+
+#include "resample.h"
+#include "stats.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <setjmp.h>
+#include <png.h>
+
+/**
+ * Where png() reads the image from: a FILE or a memory buffer.
+ */
+struct png_src {
+	FILE *input; // NULL to read buf instead
+	const uint8_t *buf;
+	size_t len;
+	size_t pos; // bytes read from buf
+};
+
+/**
+ * An output size and where it gets written to: a FILE or a memory buffer that
+ * grows as the PNG is written.
+ */
+struct png_target {
+	uint32_t width;
+	uint32_t height;
+	FILE *output; // NULL to write to buf instead
+	uint8_t *buf;
+	size_t len; // bytes written to buf
+	size_t cap; // size of buf
+	png_structp wpng;
+	png_infop winfo;
+};
+
+/**
+ * Options for every image scaled with a png_ctx.
+ */
+struct png_opts {
+	int flags; // imgscale_ctx_reset() flags, for the streaming path
+	int filter; // enum imgscale_filter
+};
+
+/**
+ * Error state and scaling state. In batch mode each worker thread keeps one
+ * of these. libpng structs can't be reset, so unlike jpgscale they are still
+ * created for every image.
+ */
+struct png_ctx {
+	int recover; // return libpng errors instead of exiting
+	jmp_buf env; // where libpng errors go when recovering
+	char msg[256]; // last libpng error message
+	struct png_opts opts;
+	struct imgscale_ctx sc;
+	uint8_t **sl; // decoded image of an interlaced PNG
+	uint32_t sl_len; // number of rows in sl
+	struct xscale_pool *pool; // x-scaling threads, started on first use
+#ifdef IMGSCALE_STATS
+	struct imgscale_stats stats;
+	struct imgscale_stats *st; // &stats, NULL if turned off
+#endif
+};
+
+/**
+ * With recover set, png() returns an error when libpng fails instead of
+ * exiting the process, and libpng warnings aren't printed.
+ */
+void png_ctx_init(struct png_ctx *ctx, int recover);
+void png_ctx_free(struct png_ctx *ctx);
+
+/**
+ * Scale a PNG to fit in the size of every target. Interlaced PNGs are scaled
+ * on threads threads, as are wide scanlines of a non-interlaced PNG scaled to a
+ * single target. With pipelined set a non-interlaced PNG is decoded, scaled and
+ * encoded on separate threads.
+ *
+ * Returns 0 on success, or -1 if the context recovers from errors and libpng
+ * failed. The error message is left in ctx->msg. The buf of targets written to
+ * memory is set in either case and has to be freed by the caller.
+ */
+int png(struct png_ctx *ctx, struct png_src *src, struct png_target *targets,
+	uint32_t n, unsigned threads, int pipelined);
+
+#endif
@@ -1,178 +1,281 @@
-#include "resample.h"
+#include "png_scale.h"
+#include "batch.h"
+#include "mapfile.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <png.h>
-
-/** Interlaced PNGs need to be fully decompressed before we can scale the image.
-  *
-  * We scale along the y-axis first because it is more memory efficient in this
-  * case.
-  */
-static void png_interlaced(png_structp rpng, png_infop rinfo, png_structp wpng,
-	png_infop winfo)
-{
-	uint8_t **sl, *yscaled, *out;
-	uint32_t i, in_width, in_height, out_width, out_height;
-	size_t buf_len, outbuf_len;
-	png_byte cmp;
-	struct xscaler xs;
-
-	in_width = png_get_image_width(rpng, rinfo);
-	in_height = png_get_image_height(rpng, rinfo);
-	out_width = png_get_image_width(wpng, winfo);
-	out_height = png_get_image_height(wpng, winfo);
-	cmp = png_get_channels(rpng, rinfo);
-
-	sl = malloc(in_height * sizeof(uint8_t *));
-
-	buf_len = png_get_rowbytes(rpng, rinfo);
-	for (i=0; i<in_height; i++) {
-		sl[i] = malloc(buf_len);
-	}
+#include <unistd.h>
 
-	outbuf_len = out_width * cmp;
-	out = malloc(outbuf_len);
-	xscaler_init(&xs, in_width, out_width, cmp, 1);
-	yscaled = xscaler_psl_pos0(&xs);
+/* batch mode */
 
-	png_read_image(rpng, sl);
+/**
+ * Context of a batch worker thread.
+ */
+struct batch_ctx {
+	struct png_ctx png;
+	struct png_opts opts; // options of the batch, before those of a job
+};
 
-	for (i=0; i<out_height; i++) {
-		yscaler_prealloc_scale(in_height, out_height, sl, yscaled, i,
-			in_width, cmp, 1);
-		xscaler_scale(&xs, out);
-		png_write_row(wpng, out);
+static void *batch_ctx_new(void *opts)
+{
+	struct batch_ctx *ctx;
+	ctx = malloc(sizeof(struct batch_ctx));
+	if (ctx) {
+		png_ctx_init(&ctx->png, 1);
+		ctx->opts = *(struct png_opts *)opts;
 	}
+	return ctx;
+}
 
-	for (i=0; i<in_height; i++) {
-		free(sl[i]);
-	}
-	free(sl);
-	free(out);
-	xscaler_free(&xs);
+static void batch_ctx_free(void *ctx)
+{
+	png_ctx_free(&((struct batch_ctx *)ctx)->png);
+	free(ctx);
 }
 
-static void png_noninterlaced(png_structp rpng, png_infop rinfo,
-	png_structp wpng, png_infop winfo)
+/**
+ * Apply the -f, -k and -l options of a job on top of opts.
+ */
+static int batch_opts(struct png_opts *opts, char *const *argv,
+	const char **err)
 {
-	uint32_t i, in_width, in_height, out_width, out_height;
-	uint8_t *inbuf, *outbuf, *tmp;
-	size_t outbuf_len;
-	struct xscaler xs;
-	struct yscaler ys;
-	png_byte cmp;
-
-	in_width = png_get_image_width(rpng, rinfo);
-	in_height = png_get_image_height(rpng, rinfo);
-	out_width = png_get_image_width(wpng, winfo);
-	out_height = png_get_image_height(wpng, winfo);
-	cmp = png_get_channels(rpng, rinfo);
-
-	outbuf_len = out_width * cmp;
-	outbuf = malloc(outbuf_len);
-
-	xscaler_init(&xs, in_width, out_width, cmp, 1);
-	yscaler_init(&ys, in_height, out_height, outbuf_len);
-	inbuf = xscaler_psl_pos0(&xs);
-	for(i=0; i<out_height; i++) {
-		while ((tmp = yscaler_next(&ys))) {
-			png_read_row(rpng, inbuf, NULL);
-			xscaler_scale(&xs, tmp);
+	for (; *argv; argv++) {
+		if (!strcmp(*argv, "-f")) {
+			opts->flags |= IMGSCALE_FAST;
+		} else if (!strcmp(*argv, "-l")) {
+			opts->flags |= IMGSCALE_LINEAR;
+		} else if (!strcmp(*argv, "-k") && argv[1]) {
+			opts->filter = filter_by_name(*++argv);
+			if (opts->filter < 0) {
+				*err = "Invalid filter";
+				return -1;
+			}
+		} else {
+			*err = "Invalid option";
+			return -1;
 		}
-		yscaler_scale(&ys, outbuf, i, cmp, 1);
-		png_write_row(wpng, outbuf);
 	}
-
-	free(outbuf);
-	yscaler_free(&ys);
-	xscaler_free(&xs);
+	return 0;
 }
 
-static void png(FILE *input, FILE *output, uint32_t width, uint32_t height)
+static int batch_job(void *arg, const uint8_t *in, size_t in_len,
+	FILE *output, const struct batch_job *job, const char **err)
 {
-	png_structp rpng, wpng;
-	png_infop rinfo, winfo;
-	png_uint_32 in_width, in_height;
-	png_byte ctype;
-
-	rpng = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-
-	if (setjmp(png_jmpbuf(rpng))) {
-		fprintf(stderr, "PNG Decoding Error.\n");
-		exit(1);
+	struct batch_ctx *ctx;
+	struct png_src src;
+	struct png_target t;
+
+	ctx = arg;
+	ctx->png.opts = ctx->opts;
+	if (batch_opts(&ctx->png.opts, job->opts, err)) {
+		return -1;
 	}
 
-	rinfo = png_create_info_struct(rpng);
-	png_init_io(rpng, input);
-	png_read_info(rpng, rinfo);
-
-	png_set_packing(rpng);
-	png_set_strip_16(rpng);
-	png_set_expand(rpng);
-
-	ctype = png_get_color_type(rpng, rinfo);
-	if (ctype == PNG_COLOR_TYPE_RGB) {
-		png_set_filler(rpng, 0, PNG_FILLER_AFTER);
+	src.input = NULL;
+	src.buf = in;
+	src.len = in_len;
+	src.pos = 0;
+	t.width = job->width;
+	t.height = job->height;
+	t.output = output;
+	if (png(&ctx->png, &src, &t, 1, 1, 0)) {
+		*err = ctx->png.msg;
+		return -1;
 	}
-	png_read_update_info(rpng, rinfo);
-
-	in_width = png_get_image_width(rpng, rinfo);
-	in_height = png_get_image_height(rpng, rinfo);
-	fix_ratio(in_width, in_height, &width, &height);
-
-	wpng = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	winfo = png_create_info_struct(wpng);
-	png_init_io(wpng, output);
-
-	png_set_IHDR(wpng, winfo, width, height, 8, ctype, PNG_INTERLACE_NONE,
-		PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	return 0;
+}
 
-	png_write_info(wpng, winfo);
+/**
+ * Parse a WIDTHxHEIGHT:FILE target. FILE is left in file, to be opened once
+ * all the arguments are known to be good.
+ */
+static int parse_target(char *arg, struct png_target *t, char **file)
+{
+	char *end;
 
-	if (ctype == PNG_COLOR_TYPE_RGB) {
-		png_set_filler(wpng, 0, PNG_FILLER_AFTER);
+	t->width = strtoul(arg, &end, 10);
+	if (*end != 'x') {
+		return -1;
 	}
-
-	switch (png_get_interlace_type(rpng, rinfo)) {
-	case PNG_INTERLACE_NONE:
-		png_noninterlaced(rpng, rinfo, wpng, winfo);
-		break;
-	case PNG_INTERLACE_ADAM7:
-		png_interlaced(rpng, rinfo, wpng, winfo);
-		break;
+	t->height = strtoul(end + 1, &end, 10);
+	if (*end != ':' || !t->width || !t->height) {
+		return -1;
 	}
+	t->output = NULL;
+	*file = end + 1;
+	return 0;
+}
 
-	png_write_end(wpng, winfo);
-	png_destroy_write_struct(&wpng, &winfo);
-	png_destroy_read_struct(&rpng, &rinfo, NULL);
+static void usage(char *name)
+{
+	fprintf(stderr, "Usage: %s [-f] [-j THREADS] [-k FILTER] [-l] [-p] "
+		"WIDTH HEIGHT [INPUT]\n", name);
+	fprintf(stderr, "       %s [-j THREADS] [-k FILTER] -t WIDTHxHEIGHT:FILE "
+		"[-t ...] [INPUT]\n", name);
+	fprintf(stderr, "       %s -b [-f] [-j THREADS] [-k FILTER] [-l] "
+		"[JOBS]\n", name);
+	fprintf(stderr, "FILTER is catrom (default), mitchell, lanczos2, "
+		"lanczos3, bilinear or box\n");
 }
 
 int main(int argc, char *argv[])
 {
-	uint32_t width, height;
-	char *end;
+	uint32_t i, n;
+	struct png_target *targets;
+	struct png_ctx ctx;
+	struct png_src src;
+	struct mapped_file map;
+	struct batch_ops ops;
+	struct png_opts opts;
+	FILE *jobs;
+	unsigned threads;
+	char **files, *end;
+	int opt, pipelined, batch, ret;
+
+	threads = 1;
+	pipelined = 0;
+	batch = 0;
+	opts.flags = 0;
+	opts.filter = FILTER_CATROM;
+	n = 0;
+	targets = malloc(argc * sizeof(struct png_target));
+	files = malloc(argc * sizeof(char *));
+	while ((opt = getopt(argc, argv, "bfj:k:lpt:")) != -1) {
+		switch (opt) {
+		case 'b':
+			batch = 1;
+			break;
+		case 'f':
+			opts.flags |= IMGSCALE_FAST;
+			break;
+		case 'k':
+			opts.filter = filter_by_name(optarg);
+			if (opts.filter < 0) {
+				fprintf(stderr, "Error: Invalid filter.\n");
+				return 1;
+			}
+			break;
+		case 'l':
+			opts.flags |= IMGSCALE_LINEAR;
+			break;
+		case 'p':
+			pipelined = 1;
+			break;
+		case 'j':
+			threads = strtoul(optarg, &end, 10);
+			if (*end || !threads) {
+				fprintf(stderr, "Error: Invalid thread count.\n");
+				return 1;
+			}
+			break;
+		case 't':
+			if (parse_target(optarg, targets + n, files + n)) {
+				fprintf(stderr, "Error: Invalid target.\n");
+				return 1;
+			}
+			n++;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
 
-	if (argc != 3) {
-		fprintf(stderr, "Usage: %s WIDTH HEIGHT\n", argv[0]);
-		return 1;
+	/* in batch mode -j sets the number of jobs run at once */
+	if (batch) {
+		if (n || pipelined || argc - optind > 1) {
+			usage(argv[0]);
+			return 1;
+		}
+		jobs = argc > optind ? fopen(argv[optind], "r") : stdin;
+		if (!jobs) {
+			perror(argv[optind]);
+			return 1;
+		}
+		ops.ctx_new = batch_ctx_new;
+		ops.ctx_free = batch_ctx_free;
+		ops.run = batch_job;
+		ops.arg = &opts;
+		ret = batch_run(jobs, stdout, &ops, threads);
+		fclose(jobs);
+		free(files);
+		free(targets);
+		return ret ? 1 : 0;
 	}
 
-	width = strtoul(argv[1], &end, 10);
-	if (*end) {
-		fprintf(stderr, "Error: Invalid width.\n");
+	if (!n) {
+		if (argc - optind < 2 || argc - optind > 3) {
+			usage(argv[0]);
+			return 1;
+		}
+
+		targets[0].width = strtoul(argv[optind], &end, 10);
+		if (*end) {
+			fprintf(stderr, "Error: Invalid width.\n");
+			return 1;
+		}
+
+		targets[0].height = strtoul(argv[optind + 1], &end, 10);
+		if (*end) {
+			fprintf(stderr, "Error: Invalid height.\n");
+			return 1;
+		}
+
+		targets[0].output = stdout;
+		n = 1;
+		optind += 2;
+	} else if (argc - optind > 1 || opts.flags || pipelined) {
+		usage(argv[0]);
 		return 1;
 	}
 
-	height = strtoul(argv[2], &end, 10);
-	if (*end) {
-		fprintf(stderr, "Error: Invalid height.\n");
-		return 1;
+	/* map an input file rather than reading it through stdio, unless it
+	 * can't be mapped, like a pipe */
+	src.input = stdin;
+	map.buf = NULL;
+	if (argc > optind) {
+		if (!map_file(&map, argv[optind])) {
+			src.input = NULL;
+			src.buf = map.buf;
+			src.len = map.len;
+			src.pos = 0;
+		} else {
+			src.input = fopen(argv[optind], "rb");
+			if (!src.input) {
+				perror(argv[optind]);
+				return 1;
+			}
+		}
+	}
+
+	/* create the outputs only once the arguments and input are good */
+	for (i=0; i<n; i++) {
+		if (!targets[i].output) {
+			targets[i].output = fopen(files[i], "wb");
+			if (!targets[i].output) {
+				perror(files[i]);
+				return 1;
+			}
+		}
 	}
 
-	png(stdin, stdout, width, height);
+	png_ctx_init(&ctx, 0);
+	ctx.opts = opts;
+	png(&ctx, &src, targets, n, threads, pipelined);
+	png_ctx_free(&ctx);
+	unmap_file(&map);
+	if (src.input && src.input != stdin) {
+		fclose(src.input);
+	}
 
+	while (n--) {
+		if (targets[n].output != stdout) {
+			fclose(targets[n].output);
+		}
+	}
+	free(files);
+	free(targets);
 	fclose(stdin);
 	return 0;
 }
@@ -20,16 +20,59 @@
  */
 
 #include "resample.h"
+#include "resample_simd.h"
 #include <stdint.h>
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <pthread.h>
+
+#define PI 3.14159265358979f
+
+/**
+ * Strips of up to this many scanlines keep their coefficients on the stack in
+ * strip_scale() and yscaler_prealloc_scale(). That covers reductions of up to
+ * 16x without allocating.
+ */
+#define STACK_TAPS 64
+
+/**
+ * DCT scaling leaves at least this much reduction to the cubic filter.
+ */
+#ifndef DCT_MIN_RATIO
+#define DCT_MIN_RATIO 2
+#endif
+
+/**
+ * Alignment of the buffers that share one allocation.
+ */
+#define ARENA_ALIGN 64
+
+/**
+ * The box prefilter leaves at least this much reduction to the cubic filter.
+ */
+#define BOX_MIN_RATIO 2
+
+/**
+ * Largest box prefilter factor along one dimension. The last box can take up
+ * to twice as many scanlines, and their column sums have to fit in a uint16_t.
+ */
+#define BOX_MAX_FACTOR 128
 
 /**
- * Bicubic interpolation. 2 base taps on either side.
+ * How many y-scaling multiply-adds an x-scaling one costs. The y kernels run
+ * along whole scanlines of bytes, while the x kernels gather taps per sample.
+ * Measured at 1.5-5x depending on cmp.
  */
-#define TAPS 4
+#define XSCALE_COST 4
+
+/**
+ * Multiply-adds of x-scaling that a range of an xscale_pool takes at least. A
+ * range handed to another thread costs a few microseconds in wakeups, so
+ * narrower scanlines are scaled on the calling thread.
+ */
+#define XSCALE_RANGE_WORK 65536
 
 /**
  * 64-bit type that uses 1 bit for signedness, 33 bits for the integer, and 30
@@ -60,6 +103,31 @@ typedef int64_t fix33_30;
 typedef int32_t fix1_30;
 #define ONE_FIX1_30 (1<<30)
 
+/**
+ * Largest linear light sample.
+ *
+ * Wide scalers hold int16_t samples, which go through pmaddwd as they are.
+ * Linear light samples range from 0 to LINEAR_MAX, and 16-bit image samples
+ * are biased by 32768 to fit.
+ */
+#define LINEAR_MAX 32767
+#define BIAS16 0x8000
+
+/**
+ * Most fractional bits of the 16-bit coefficients for 8-bit and for int16_t
+ * samples. The sums of products have to fit in an int32_t. The magnitudes of
+ * the weights of every filter add up to less than 2, so int16_t samples fit
+ * with 15 bits.
+ *
+ * A weight of one only fits in an int16_t with 14 bits, which tables holding
+ * one, like enlarging by a whole factor, fall back to. The SIMD kernels for
+ * int16_t samples then stay within 10 LSB of the scalar ones, a bound reached
+ * by full range noise enlarged with lanczos3. Reductions get 15 bits and stay
+ * within 7 LSB, under 1 LSB on average.
+ */
+#define SHIFT16_MAX 22
+#define SHIFT16_WIDE 15
+
 /**
  * Calculate the greatest common denominator between a and b.
  */
@@ -95,6 +163,19 @@ static uint8_t clamp(fix33_30 x)
 	return x >> 30;
 }
 
+/**
+ * Round and saturate a fix33_30 value to an int16_t, for the samples of wide
+ * scalers. Negative linear light is clamped when converting back to sRGB.
+ */
+static int16_t clamp16(fix33_30 x)
+{
+	x = (x + (1<<29)) >> 30;
+	if (x < INT16_MIN) {
+		return INT16_MIN;
+	}
+	return x > INT16_MAX ? INT16_MAX : x;
+}
+
 /**
  * Given input and output dimensions and an output position, return the
  * corresponding input position and put the sub-pixel remainder in rest.
@@ -114,6 +195,102 @@ int32_t split_map(uint32_t dim_in, uint32_t dim_out, uint32_t pos, float *rest)
 	return smp_i;
 }
 
+/**
+ * Catmull-Rom interpolator.
+ */
+static float catrom(float x)
+{
+	if (x<1) {
+		return (3*x*x*x - 5*x*x + 2) / 2;
+	}
+	if (x<2) {
+		return (-1*x*x*x + 5*x*x - 8*x + 4) / 2;
+	}
+	return 0;
+}
+
+/**
+ * Mitchell-Netravali cubic with B = C = 1/3. Softer than Catmull-Rom, with
+ * less ringing.
+ */
+static float mitchell(float x)
+{
+	if (x<1) {
+		return (7*x*x*x - 12*x*x + 16.0f/3) / 6;
+	}
+	if (x<2) {
+		return (-7.0f/3*x*x*x + 12*x*x - 20*x + 32.0f/3) / 6;
+	}
+	return 0;
+}
+
+static float sinc(float x)
+{
+	if (x == 0) {
+		return 1;
+	}
+	x *= PI;
+	return sinf(x) / x;
+}
+
+static float lanczos2(float x)
+{
+	return x<2 ? sinc(x) * sinc(x / 2) : 0;
+}
+
+static float lanczos3(float x)
+{
+	return x<3 ? sinc(x) * sinc(x / 3) : 0;
+}
+
+static float bilinear(float x)
+{
+	return x<1 ? 1 - x : 0;
+}
+
+/**
+ * Nearest neighbour when enlarging, an average of whole samples when reducing.
+ * A sample that sits exactly on the edge is shared by both sides.
+ */
+static float box(float x)
+{
+	return x<=0.5f ? 1 : 0;
+}
+
+/**
+ * Filter kernels, indexed by enum imgscale_filter. taps is the number of input
+ * samples the kernel covers when it isn't stretched for a reduction, which is
+ * twice its support rounded up to an even number.
+ */
+static const struct {
+	const char *name;
+	float (*fn)(float);
+	uint32_t taps;
+} filters[FILTERS] = {
+	{"catrom", catrom, 4},
+	{"mitchell", mitchell, 4},
+	{"lanczos2", lanczos2, 4},
+	{"lanczos3", lanczos3, 6},
+	{"bilinear", bilinear, 2},
+	{"box", box, 2},
+};
+
+const char *filter_name(int filter)
+{
+	return filter >= 0 && filter < FILTERS ? filters[filter].name : NULL;
+}
+
+int filter_by_name(const char *name)
+{
+	int i;
+	for (i=0; i<FILTERS; i++) {
+		if (!strcmp(name, filters[i].name)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
 /**
  * Given input and output dimension, calculate the total number of taps that
  * will be needed to calculate an output sample.
@@ -121,27 +298,16 @@ int32_t split_map(uint32_t dim_in, uint32_t dim_out, uint32_t pos, float *rest)
  * When we reduce an image by a factor of two, we need to scale our resampling
  * function by two as well in order to avoid aliasing.
  */
-uint64_t calc_taps(uint32_t dim_in, uint32_t dim_out)
+uint64_t calc_taps(uint32_t dim_in, uint32_t dim_out, int filter)
 {
 	uint64_t tmp;
 	if (dim_out > dim_in) {
-		return TAPS;
+		return filters[filter].taps;
 	}
-	tmp = (uint64_t)TAPS * dim_in / dim_out;
+	tmp = (uint64_t)filters[filter].taps * dim_in / dim_out;
 	return tmp + (tmp & 1);
 }
 
-/**
- * Catmull-Rom interpolator.
- */
-static float catrom(float x)
-{
-	if (x<1) {
-		return (3*x*x*x - 5*x*x + 2) / 2;
-	}
-	return (-1*x*x*x + 5*x*x - 8*x + 4) / 2;
-}
-
 /**
  * Convert a single-precision float to a fix1_30 fixed point int. x must be
  * between 0 and 1.
@@ -152,31 +318,279 @@ static fix1_30 f_to_fix1_30(float x)
 }
 
 /**
- * Given an offset tx, calculate TAPS * tap_mult coefficients.
+ * Given an offset tx, calculate the taps coefficients of filter, stretched by
+ * taps over the filter's own tap count.
  *
- * The coefficients are stored as fix1_30 fixed point ints in coeffs.
+ * The coefficients are normalized so that they add up to one, and stored as
+ * fix1_30 fixed point ints in coeffs.
  */
-static void calc_coeffs(fix1_30 *coeffs, float tx, uint32_t taps)
+static void calc_coeffs(fix1_30 *coeffs, float tx, uint32_t taps, int filter)
 {
 	uint32_t i;
-	float tmp, tap_mult;
-	fix1_30 tmp_fixed;
+	float tap_mult, sum, x;
+	float (*fn)(float);
 
-	tap_mult = (float)taps / TAPS;
+	fn = filters[filter].fn;
+	tap_mult = (float)taps / filters[filter].taps;
 	tx = 1 - tx - taps / 2;
 
-	for (i=0; i<taps; i++) {
-		tmp = catrom(fabsf(tx) / tap_mult) / tap_mult;
-		tmp_fixed = f_to_fix1_30(tmp);
-		coeffs[i] = tmp_fixed;
-		tx += 1;
+	sum = 0;
+	for (i=0, x=tx; i<taps; i++, x+=1) {
+		sum += fn(fabsf(x) / tap_mult);
+	}
+
+	for (i=0, x=tx; i<taps; i++, x+=1) {
+		coeffs[i] = f_to_fix1_30(fn(fabsf(x) / tap_mult) / sum);
 	}
 }
 
-/* bicubic y-scaler */
+/* coefficient tables */
 
-void strip_scale_generic(uint8_t **in, uint32_t strip_height, size_t len,
-	uint8_t *out, fix1_30 *coeffs)
+/**
+ * Convert len fix1_30 coefficients to the 16-bit coefficients used by the SIMD
+ * kernels and return the number of fractional bits used.
+ *
+ * The shift is chosen as large as possible while every coefficient still fits
+ * in an int16_t, up to max_shift, which keeps a sum of products with the
+ * samples in an int32_t. Large reductions have small coefficients, so they get
+ * more fractional bits.
+ */
+static uint8_t coeffs_to16(fix1_30 *coeffs, int16_t *coeffs16, size_t len,
+	uint8_t max_shift)
+{
+	size_t i;
+	fix1_30 max;
+	int64_t rounded;
+	uint8_t shift;
+
+	max = 0;
+	for (i=0; i<len; i++) {
+		max = abs(coeffs[i]) > max ? abs(coeffs[i]) : max;
+	}
+
+	shift = max_shift;
+	while (shift > 1 && ((int64_t)max + (1 << (29 - shift))) >>
+		(30 - shift) > INT16_MAX) {
+		shift--;
+	}
+
+	for (i=0; i<len; i++) {
+		rounded = ((int64_t)coeffs[i] + (1 << (29 - shift))) >>
+			(30 - shift);
+		coeffs16[i] = rounded;
+	}
+	return shift;
+}
+
+/**
+ * Drop the taps at either end that are zero for every output position, so the
+ * kernels don't multiply by them. The box filter has them when reducing, and
+ * enlarging by a whole factor with it, or not scaling at all, leaves a single
+ * tap. Any other tap count is kept even for the SIMD kernels.
+ */
+static void coeff_tbl_trim(struct coeff_tbl *ct)
+{
+	uint32_t i, k, lo, hi, taps;
+	fix1_30 *c;
+
+	lo = ct->taps;
+	hi = 0;
+	for (i=0; i<ct->period; i++) {
+		c = ct->coeffs + (size_t)i * ct->taps;
+		for (k=0; k<ct->taps; k++) {
+			if (c[k]) {
+				lo = k < lo ? k : lo;
+				hi = k > hi ? k : hi;
+			}
+		}
+	}
+	if (lo > hi) {
+		return;
+	}
+
+	taps = hi - lo + 1;
+	if (taps > 1 && (taps & 1)) {
+		if (hi + 1 < ct->taps) {
+			hi++;
+		} else {
+			lo--;
+		}
+		taps++;
+	}
+	if (taps == ct->taps) {
+		return;
+	}
+
+	/* the trimmed rows only move down, offsets and coeffs16 stay put */
+	for (i=0; i<ct->period; i++) {
+		memmove(ct->coeffs + (size_t)i * taps,
+			ct->coeffs + (size_t)i * ct->taps + lo,
+			taps * sizeof(fix1_30));
+		ct->offsets[i] += lo;
+	}
+	ct->taps = taps;
+}
+
+/**
+ * Round an arena length up so that the next buffer in the arena is aligned.
+ */
+static size_t arena_align(size_t len)
+{
+	return (len + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+size_t coeff_tbl_size(uint32_t dim_in, uint32_t dim_out, int filter)
+{
+	uint64_t taps;
+	size_t period;
+
+	taps = calc_taps(dim_in, dim_out, filter);
+	period = dim_out / gcd(dim_in, dim_out);
+	return period * (taps + 1) * sizeof(fix1_30) +
+		period * taps * sizeof(int16_t);
+}
+
+int coeff_tbl_init(struct coeff_tbl *ct, uint32_t dim_in, uint32_t dim_out,
+	int filter)
+{
+	void *buf;
+
+	if (!dim_in || !dim_out || !filter_name(filter)) {
+		return -1; // bad input parameter
+	}
+
+	buf = malloc(coeff_tbl_size(dim_in, dim_out, filter));
+	if (!buf) {
+		return -2; // unable to allocate space for coefficients
+	}
+	coeff_tbl_init_buf(ct, dim_in, dim_out, filter, buf);
+	ct->mem = buf;
+	return 0;
+}
+
+int coeff_tbl_init_buf(struct coeff_tbl *ct, uint32_t dim_in,
+	uint32_t dim_out, int filter, void *buf)
+{
+	uint32_t i, scale_gcd;
+	uint64_t taps;
+	float tx;
+
+	if (!dim_in || !dim_out || !filter_name(filter)) {
+		return -1; // bad input parameter
+	}
+
+	taps = calc_taps(dim_in, dim_out, filter);
+	scale_gcd = gcd(dim_in, dim_out);
+	ct->dim_in = dim_in;
+	ct->dim_out = dim_out;
+	ct->taps = taps;
+	ct->period = dim_out / scale_gcd;
+	ct->in_step = dim_in / scale_gcd;
+	ct->mem = NULL;
+
+	ct->coeffs = buf;
+	ct->offsets = ct->coeffs + ct->period * taps;
+	ct->coeffs16 = (int16_t *)(ct->offsets + ct->period);
+
+	for (i=0; i<ct->period; i++) {
+		ct->offsets[i] = split_map(dim_in, dim_out, i, &tx) + 1 -
+			(int32_t)(taps / 2);
+		calc_coeffs(ct->coeffs + i * taps, tx, taps, filter);
+	}
+	coeff_tbl_trim(ct);
+	ct->shift16 = coeffs_to16(ct->coeffs, ct->coeffs16,
+		(size_t)ct->period * ct->taps, SHIFT16_MAX);
+	return 0;
+}
+
+void coeff_tbl_free(struct coeff_tbl *ct)
+{
+	free(ct->mem);
+}
+
+int32_t coeff_tbl_pos(struct coeff_tbl *ct, uint32_t pos, uint32_t *idx)
+{
+	*idx = pos % ct->period;
+	return ct->offsets[*idx] + (pos / ct->period) * ct->in_step;
+}
+
+/* point sampling
+ *
+ * A table with a single tap has a weight of one, so each output pixel is a
+ * copy of an input pixel, and each output scanline of an input scanline.
+ */
+
+/**
+ * Zero the filler of len samples that are 4 components each.
+ */
+static void clear_filler(uint8_t *row, size_t len, uint8_t bps)
+{
+	size_t i;
+
+	for (i=3; i<len; i+=4) {
+		memset(row + i * bps, 0, bps);
+	}
+}
+
+/**
+ * Copy the input pixel of each output pixel, bpp bytes each. xscale_point()
+ * passes constants for bpp.
+ */
+static KERNEL_INLINE void xscale_point_kernel(uint8_t *in, uint8_t *out,
+	struct coeff_tbl *ct, size_t bpp)
+{
+	uint32_t i, j, reps;
+	uint8_t *src, *dst;
+
+	reps = ct->dim_out / ct->period;
+	for (i=0; i<ct->period; i++) {
+		src = in + (ptrdiff_t)ct->offsets[i] * bpp;
+		dst = out + (size_t)i * bpp;
+		for (j=0; j<reps; j++) {
+			memcpy(dst, src, bpp);
+			src += (size_t)ct->in_step * bpp;
+			dst += (size_t)ct->period * bpp;
+		}
+	}
+}
+
+/**
+ * x-scale a padded scanline of cmp components of bps bytes with a single tap
+ * table. Enlarging by a whole factor with the box filter replicates pixels.
+ */
+static void xscale_point(uint8_t *in, uint8_t *out, struct coeff_tbl *ct,
+	uint8_t cmp, uint8_t bps, int filler)
+{
+	switch (cmp * bps) {
+	case 1: xscale_point_kernel(in, out, ct, 1); break;
+	case 2: xscale_point_kernel(in, out, ct, 2); break;
+	case 3: xscale_point_kernel(in, out, ct, 3); break;
+	case 4: xscale_point_kernel(in, out, ct, 4); break;
+	case 6: xscale_point_kernel(in, out, ct, 6); break;
+	case 8: xscale_point_kernel(in, out, ct, 8); break;
+	default: xscale_point_kernel(in, out, ct, (size_t)cmp * bps); break;
+	}
+	if (cmp == 4 && filler) {
+		clear_filler(out, (size_t)ct->dim_out * 4, bps);
+	}
+}
+
+/**
+ * y-scale a strip of a single scanline of len samples of bps bytes.
+ */
+static void strip_scale_point(uint8_t *in, size_t len, uint8_t *out,
+	uint8_t bps, uint8_t cmp, int filler)
+{
+	memcpy(out, in, len * bps);
+	if (cmp == 4 && filler) {
+		clear_filler(out, len, bps);
+	}
+}
+
+/* y-scaler */
+
+static KERNEL_INLINE void strip_scale_generic(uint8_t **in,
+	uint32_t strip_height, size_t len, uint8_t *out, fix1_30 *coeffs)
 {
 	size_t i;
 	uint32_t j;
@@ -184,6 +598,7 @@ void strip_scale_generic(uint8_t **in, uint32_t strip_height, size_t len,
 
 	for (i=0; i<len; i++) {
 		total = 0;
+		UNROLL_TAPS
 		for (j=0; j<strip_height; j++) {
 			coeff = coeffs[j];
 			total += coeff * in[j][i];
@@ -240,16 +655,38 @@ void strip_scale_32(uint8_t **in, uint32_t strip_height, size_t len,
 	}
 }
 
-int strip_scale(uint8_t **in, uint32_t strip_height, size_t len, uint8_t *out,
-	float ty, uint8_t cmp, int filler)
+/**
+ * Scale a strip with coefficients that have already been calculated. coeffs16
+ * holds the same coefficients with shift16 fractional bits for the SIMD
+ * kernels.
+ */
+static void strip_scale_coeffs(uint8_t **in, uint32_t strip_height, size_t len,
+	uint8_t *out, fix1_30 *coeffs, int16_t *coeffs16, uint8_t shift16,
+	uint8_t cmp, int filler)
 {
-	fix1_30 *coeffs;
+	size_t i;
+
+	if (strip_height == 1) {
+		strip_scale_point(in[0], len, out, 1, cmp, filler);
+		return;
+	}
+	if (simd_strip_scale(in, strip_height, len, out, coeffs16, shift16, cmp,
+		filler)) {
+		return;
+	}
 
-	coeffs = malloc(strip_height * sizeof(fix1_30));
-	if (!coeffs) {
-		return -2; // unable to allocate
+	switch (strip_height) {
+	case 2: case 4: case 6: case 8: case 12: case 16:
+#define STRIP_SCALE(n, arg) strip_scale_generic(in, n, len, out, coeffs)
+		TAPS_DISPATCH(strip_height, STRIP_SCALE, 0);
+#undef STRIP_SCALE
+		if (cmp == 4 && filler) {
+			for (i=3; i<len; i+=4) {
+				out[i] = 0;
+			}
+		}
+		return;
 	}
-	calc_coeffs(coeffs, ty, strip_height);
 
 	if (cmp == 4 && filler) {
 		strip_scale_rgbx(in, strip_height, len, out, coeffs);
@@ -258,81 +695,164 @@ int strip_scale(uint8_t **in, uint32_t strip_height, size_t len, uint8_t *out,
 	} else {
 		strip_scale_generic(in, strip_height, len, out, coeffs);
 	}
+}
+
+int strip_scale(uint8_t **in, uint32_t strip_height, size_t len, uint8_t *out,
+	float ty, int filter, uint8_t cmp, int filler)
+{
+	fix1_30 stack_coeffs[STACK_TAPS], *coeffs;
+	int16_t stack_coeffs16[STACK_TAPS], *coeffs16;
+	uint8_t shift16;
+
+	if (!filter_name(filter)) {
+		return -1; // bad input parameter
+	}
 
-	free(coeffs);
+	coeffs = stack_coeffs;
+	coeffs16 = stack_coeffs16;
+	if (strip_height > STACK_TAPS) {
+		coeffs = malloc(strip_height *
+			(sizeof(fix1_30) + sizeof(int16_t)));
+		if (!coeffs) {
+			return -2; // unable to allocate
+		}
+		coeffs16 = (int16_t *)(coeffs + strip_height);
+	}
+	calc_coeffs(coeffs, ty, strip_height, filter);
+	shift16 = coeffs_to16(coeffs, coeffs16, strip_height, SHIFT16_MAX);
+	strip_scale_coeffs(in, strip_height, len, out, coeffs, coeffs16, shift16,
+		cmp, filler);
+	if (coeffs != stack_coeffs) {
+		free(coeffs);
+	}
 	return 0;
 }
 
-/* Bicubic x scaler */
-
-static void sample_generic(uint32_t taps, fix1_30 *coeffs, uint8_t *in,
-	uint8_t *out, uint8_t cmp)
+/**
+ * strip_scale_generic() for 16-bit samples. len is in samples.
+ */
+static KERNEL_INLINE void strip_scale16_generic(int16_t **in,
+	uint32_t strip_height, size_t len, int16_t *out, fix1_30 *coeffs)
 {
-	uint8_t i;
+	size_t i;
 	uint32_t j;
-	fix33_30 total, coeff;
+	fix33_30 coeff, total;
 
-	for (i=0; i<cmp; i++) {
+	for (i=0; i<len; i++) {
 		total = 0;
-		for (j=0; j<taps; j++){
+		UNROLL_TAPS
+		for (j=0; j<strip_height; j++) {
 			coeff = coeffs[j];
-			total += coeff * in[j * cmp + i];
+			total += coeff * in[j][i];
 		}
-		out[i] = clamp(total);
+		out[i] = clamp16(total);
 	}
 }
 
-static void sample_rgba(uint32_t taps, fix1_30 *coeffs, uint8_t *in,
-	uint8_t *out)
+/**
+ * Scale a strip of int16_t samples. coeffs16 has to be set up for them, see
+ * coeff_tbl_wide().
+ */
+static void strip_scale16(int16_t **in, uint32_t strip_height, size_t len,
+	int16_t *out, fix1_30 *coeffs, int16_t *coeffs16, uint8_t shift16,
+	uint8_t cmp, int filler)
 {
-	uint32_t i, sample;
-	fix33_30 sum[4], coeff;
+	size_t i;
 
-	sum[0] = sum[1] = sum[2] = sum[3] = 0;
-	for (i=0; i<taps; i++) {
-		coeff = coeffs[i];
-		sample = ((uint32_t *)in)[i];
-		sum[0] += coeff *  (sample & 0x000000FF);
-		sum[1] += coeff * ((sample & 0x0000FF00) >> 8);
-		sum[2] += coeff * ((sample & 0x00FF0000) >> 16);
-		sum[3] += coeff * ((sample & 0xFF000000) >> 24);
+	if (strip_height == 1) {
+		strip_scale_point((uint8_t *)in[0], len, (uint8_t *)out, 2, cmp,
+			filler);
+		return;
+	}
+	if (simd_strip_scale16(in, strip_height, len, out, coeffs16, shift16,
+		cmp, filler)) {
+		return;
+	}
+
+#define STRIP_SCALE16(n, arg) strip_scale16_generic(in, n, len, out, coeffs)
+	TAPS_DISPATCH(strip_height, STRIP_SCALE16, 0);
+#undef STRIP_SCALE16
+	if (cmp == 4 && filler) {
+		for (i=3; i<len; i+=4) {
+			out[i] = 0;
+		}
 	}
-	*(uint32_t *)out = clamp(sum[0]) +
-		((uint32_t)clamp(sum[1]) << 8) +
-		((uint32_t)clamp(sum[2]) << 16) +
-		((uint32_t)clamp(sum[3]) << 24);
 }
 
-static void sample_rgbx(uint32_t taps, fix1_30 *coeffs, uint8_t *in,
-	uint8_t *out)
-{
-	uint32_t i, sample;
-	fix33_30 sum[3], coeff;
+/* x-scaler */
 
-	sum[0] = sum[1] = sum[2] = 0;
-	for (i=0; i<taps; i++) {
-		coeff = coeffs[i];
-		sample = ((uint32_t *)in)[i];
-		sum[0] += coeff *  (sample & 0x000000FF);
-		sum[1] += coeff * ((sample & 0x0000FF00) >> 8);
-		sum[2] += coeff * ((sample & 0x00FF0000) >> 16);
+/**
+ * Scale the samples of a padded scanline with cmp components each. xscale_tbl()
+ * passes constants for taps and cmp, so this is compiled into a kernel for
+ * each combination.
+ */
+static KERNEL_INLINE void xscale_kernel(uint8_t *in, uint8_t *out,
+	struct coeff_tbl *ct, uint32_t taps, uint8_t cmp, int filler)
+{
+	uint32_t i, j, k, reps;
+	uint8_t c, *src, *dst;
+	fix1_30 *coeffs;
+	fix33_30 total;
+
+	reps = ct->dim_out / ct->period;
+	coeffs = ct->coeffs;
+	for (i=0; i<ct->period; i++) {
+		src = in + (ptrdiff_t)ct->offsets[i] * cmp;
+		dst = out + (size_t)i * cmp;
+		for (j=0; j<reps; j++) {
+			for (c=0; c<cmp; c++) {
+				total = 0;
+				UNROLL_TAPS
+				for (k=0; k<taps; k++) {
+					total += (fix33_30)coeffs[k] *
+						src[k * cmp + c];
+				}
+				dst[c] = clamp(total);
+			}
+			if (cmp == 4 && filler) {
+				dst[3] = 0;
+			}
+			src += (size_t)ct->in_step * cmp;
+			dst += (size_t)ct->period * cmp;
+		}
+		coeffs += taps;
 	}
-	*(uint32_t *)out = clamp(sum[0]) +
-		((uint32_t)clamp(sum[1]) << 8) +
-		((uint32_t)clamp(sum[2]) << 16);
 }
 
-static void xscale_set_sample(uint32_t taps, fix1_30 *coeffs, uint8_t *in,
-	uint8_t *out, uint8_t cmp, int filler)
+/**
+ * xscale_kernel() for 16-bit samples.
+ */
+static KERNEL_INLINE void xscale16_kernel(int16_t *in, int16_t *out,
+	struct coeff_tbl *ct, uint32_t taps, uint8_t cmp, int filler)
 {
-	if (cmp == 4) {
-		if (filler) {
-			sample_rgbx(taps, coeffs, in, out);
-		} else {
-			sample_rgba(taps, coeffs, in, out);
+	uint32_t i, j, k, reps;
+	int16_t *src, *dst;
+	uint8_t c;
+	fix1_30 *coeffs;
+	fix33_30 total;
+
+	reps = ct->dim_out / ct->period;
+	coeffs = ct->coeffs;
+	for (i=0; i<ct->period; i++) {
+		src = in + (ptrdiff_t)ct->offsets[i] * cmp;
+		dst = out + (size_t)i * cmp;
+		for (j=0; j<reps; j++) {
+			for (c=0; c<cmp; c++) {
+				total = 0;
+				UNROLL_TAPS
+				for (k=0; k<taps; k++) {
+					total += (fix33_30)coeffs[k] *
+						src[k * cmp + c];
+				}
+				dst[c] = clamp16(total);
+			}
+			if (cmp == 4 && filler) {
+				dst[3] = 0;
+			}
+			src += (size_t)ct->in_step * cmp;
+			dst += (size_t)ct->period * cmp;
 		}
-	} else {
-		sample_generic(taps, coeffs, in, out, cmp);
+		coeffs += taps;
 	}
 }
 
@@ -348,11 +868,11 @@ void padded_sl_extend_edges(uint8_t *buf, uint32_t width, size_t pad_len,
 	}
 }
 
-size_t padded_sl_len_offset(uint32_t in_width, uint32_t out_width,
+size_t padded_sl_len_offset(uint32_t in_width, uint32_t out_width, int filter,
 	uint8_t cmp, size_t *offset)
 {
 	uint64_t taps;
-	taps = calc_taps(in_width, out_width);
+	taps = calc_taps(in_width, out_width, filter);
 	*offset = (taps / 2 + 1) * cmp;
 	return (size_t)in_width * cmp + *offset * 2;
 }
@@ -386,70 +906,121 @@ void xscale2(uint8_t *row_in, uint8_t *out, uint32_t width_in,
 	}
 }
 
-int xscale_padded(uint8_t *in, uint32_t in_width, uint8_t *out,
-	uint32_t out_width, uint8_t cmp, int filler)
+void xscale_tbl(uint8_t *in, uint8_t *out, struct coeff_tbl *ct, uint8_t cmp,
+	int filler)
 {
-	float tx;
-	fix1_30 *coeffs;
-	uint32_t i, j, in_chunk, out_chunk, scale_gcd;
-	int32_t xsmp_i;
-	uint64_t taps;
-	uint8_t *out_pos, *tmp;
-
-	if (!in_width || !out_width || !cmp) {
-		return -1; // bad input parameter
+	if (ct->taps == 1) {
+		xscale_point(in, out, ct, cmp, 1, filler);
+		return;
+	}
+	if (simd_xscale(in, out, ct, cmp, filler)) {
+		return;
 	}
 
-	taps = calc_taps(in_width, out_width);
-	coeffs = malloc(taps * sizeof(fix1_30));
-	if (!coeffs) {
-		return -2; // unable to allocate space for coefficients
+	switch (cmp) {
+#define XSCALE(n, c) xscale_kernel(in, out, ct, n, c, filler)
+	case 1:
+		TAPS_DISPATCH(ct->taps, XSCALE, 1);
+		break;
+	case 2:
+		TAPS_DISPATCH(ct->taps, XSCALE, 2);
+		break;
+	case 3:
+		TAPS_DISPATCH(ct->taps, XSCALE, 3);
+		break;
+	case 4:
+		TAPS_DISPATCH(ct->taps, XSCALE, 4);
+		break;
+	default:
+		XSCALE(ct->taps, cmp);
+#undef XSCALE
 	}
+}
 
-	scale_gcd = gcd(in_width, out_width);
-	in_chunk = in_width / scale_gcd;
-	out_chunk = out_width / scale_gcd;
+/**
+ * xscale_tbl() for 16-bit samples.
+ */
+static void xscale16_tbl(int16_t *in, int16_t *out, struct coeff_tbl *ct,
+	uint8_t cmp, int filler)
+{
+	if (ct->taps == 1) {
+		xscale_point((uint8_t *)in, (uint8_t *)out, ct, cmp, 2, filler);
+		return;
+	}
+	if (simd_xscale16(in, out, ct, cmp, filler)) {
+		return;
+	}
 
-	for (i=0; i<out_chunk; i++) {
-		xsmp_i = split_map(in_width, out_width, i, &tx);
-		calc_coeffs(coeffs, tx, taps);
+	switch (cmp) {
+#define XSCALE16(n, c) xscale16_kernel(in, out, ct, n, c, filler)
+	case 1:
+		TAPS_DISPATCH(ct->taps, XSCALE16, 1);
+		break;
+	case 2:
+		TAPS_DISPATCH(ct->taps, XSCALE16, 2);
+		break;
+	case 3:
+		TAPS_DISPATCH(ct->taps, XSCALE16, 3);
+		break;
+	case 4:
+		TAPS_DISPATCH(ct->taps, XSCALE16, 4);
+		break;
+	default:
+		XSCALE16(ct->taps, cmp);
+#undef XSCALE16
+	}
+}
 
-		xsmp_i += 1 - taps / 2;
-		out_pos = out + i * cmp;
-		for (j=0; j<scale_gcd; j++) {
-			tmp = in + xsmp_i * cmp;
-			xscale_set_sample(taps, coeffs, tmp, out_pos, cmp, filler);
-			out_pos += out_chunk * cmp;
-			xsmp_i += in_chunk;
-		}
+int xscale_padded(uint8_t *in, uint32_t in_width, uint8_t *out,
+	uint32_t out_width, int filter, uint8_t cmp, int filler)
+{
+	struct coeff_tbl ct;
+	int ret;
+
+	if (!cmp) {
+		return -1; // bad input parameter
 	}
 
-	free(coeffs);
+	ret = coeff_tbl_init(&ct, in_width, out_width, filter);
+	if (ret) {
+		return ret;
+	}
+	xscale_tbl(in, out, &ct, cmp, filler);
+	coeff_tbl_free(&ct);
 	return 0;
 }
 
 /* scanline ring buffer */
 
+size_t sl_rbuf_size(uint32_t height, size_t sl_len)
+{
+	return (sizeof(uint8_t *) + sl_len) * height;
+}
+
 int sl_rbuf_init(struct sl_rbuf *rb, uint32_t height, size_t sl_len)
 {
-	rb->height = height;
-	rb->count = 0;
-	rb->length = sl_len;
-	rb->buf = malloc(sl_len * height);
-	if (!rb->buf) {
-		return -2;
-	}
-	rb->virt = malloc(sizeof(uint8_t *) * height);
-	if (!rb->virt) {
-		free(rb->buf);
+	void *buf;
+
+	buf = malloc(sl_rbuf_size(height, sl_len));
+	if (!buf) {
 		return -2;
 	}
+	sl_rbuf_init_buf(rb, height, sl_len, buf);
 	return 0;
 }
 
+void sl_rbuf_init_buf(struct sl_rbuf *rb, uint32_t height, size_t sl_len,
+	void *buf)
+{
+	rb->height = height;
+	rb->count = 0;
+	rb->length = sl_len;
+	rb->virt = buf;
+	rb->buf = (uint8_t *)(rb->virt + height);
+}
+
 void sl_rbuf_free(struct sl_rbuf *rb)
 {
-	free(rb->buf);
 	free(rb->virt);
 }
 
@@ -479,31 +1050,60 @@ uint8_t **sl_rbuf_virt(struct sl_rbuf *rb, uint32_t last_target)
 
 /* xscaler */
 
+size_t xscaler_size(uint32_t width_in, uint32_t width_out, int filter,
+	uint8_t cmp)
+{
+	size_t psl_offset;
+
+	return arena_align(coeff_tbl_size(width_in, width_out, filter)) +
+		padded_sl_len_offset(width_in, width_out, filter, cmp,
+		&psl_offset);
+}
+
 int xscaler_init(struct xscaler *xs, uint32_t width_in, uint32_t width_out,
-	uint8_t cmp, int filler)
+	int filter, uint8_t cmp, int filler)
 {
-	size_t psl_len, psl_offset;
-	uint8_t *psl_buf;
+	void *buf;
 
-	psl_len = padded_sl_len_offset(width_in, width_out, cmp, &psl_offset);
-	psl_buf = malloc(psl_len);
-	if (!psl_buf) {
+	if (!width_in || !width_out || !filter_name(filter) || !cmp) {
+		return -1; // bad input parameter
+	}
+
+	buf = malloc(xscaler_size(width_in, width_out, filter, cmp));
+	if (!buf) {
 		return -2;
 	}
+	xscaler_init_buf(xs, width_in, width_out, filter, cmp, filler, buf);
+	xs->mem = buf;
+	return 0;
+}
+
+int xscaler_init_buf(struct xscaler *xs, uint32_t width_in,
+	uint32_t width_out, int filter, uint8_t cmp, int filler, void *buf)
+{
+	if (!width_in || !width_out || !filter_name(filter) || !cmp) {
+		return -1; // bad input parameter
+	}
 
-	xs->psl_buf = psl_buf;
-	xs->psl_offset = psl_offset;
+	coeff_tbl_init_buf(&xs->ct, width_in, width_out, filter, buf);
+	xs->psl_buf = (uint8_t *)buf +
+		arena_align(coeff_tbl_size(width_in, width_out, filter));
+	padded_sl_len_offset(width_in, width_out, filter, cmp,
+		&xs->psl_offset);
 	xs->width_in = width_in;
 	xs->width_out = width_out;
 	xs->cmp = cmp;
 	xs->filler = filler;
+	xs->wide = 0;
+	xs->pool = NULL;
+	xs->mem = NULL;
 
 	return 0;
 }
 
 void xscaler_free(struct xscaler *xs)
 {
-	free(xs->psl_buf);
+	free(xs->mem);
 }
 
 uint8_t *xscaler_psl_pos0(struct xscaler *xs)
@@ -511,38 +1111,254 @@ uint8_t *xscaler_psl_pos0(struct xscaler *xs)
 	return xs->psl_buf + xs->psl_offset;
 }
 
+/**
+ * x-scale len output columns from first on. The columns are either whole
+ * periods, which the table applies to as it is from input position
+ * first / period * in_step on, or part of a single period, which a view of the
+ * table starting at the phase of first applies to.
+ */
+static void xscaler_scale_cols(struct xscaler *xs, uint8_t *out_buf,
+	uint32_t first, uint32_t len)
+{
+	struct coeff_tbl ct;
+	uint32_t phase;
+	uint8_t *in;
+	size_t bpp;
+
+	bpp = xs->wide ? xs->cmp * 2 : xs->cmp;
+	ct = xs->ct;
+	phase = first % ct.period;
+	if (phase || len < ct.period) {
+		ct.coeffs += (size_t)phase * ct.taps;
+		ct.coeffs16 += (size_t)phase * ct.taps;
+		ct.offsets += phase;
+		ct.period = len;
+	}
+	ct.dim_out = len;
+	in = xs->psl_buf + xs->psl_offset +
+		(size_t)(first / xs->ct.period) * ct.in_step * bpp;
+	out_buf += (size_t)first * bpp;
+	if (xs->wide) {
+		xscale16_tbl((int16_t *)in, (int16_t *)out_buf, &ct, xs->cmp,
+			xs->filler);
+	} else {
+		xscale_tbl(in, out_buf, &ct, xs->cmp, xs->filler);
+	}
+}
+
+/**
+ * Claim and scale ranges of the current scanline until there are none left.
+ * Called and returns with the lock held.
+ */
+static void xscale_pool_ranges(struct xscale_pool *pool)
+{
+	struct xscaler *xs;
+	uint32_t r, first, end;
+
+	while (pool->next < pool->ranges) {
+		xs = pool->xs;
+		r = pool->next++;
+		if (pool->period_ranges) {
+			first = r / pool->period_ranges * xs->ct.period;
+			end = first + xs->ct.period;
+			first += r % pool->period_ranges * pool->range_len;
+		} else {
+			first = r * pool->range_len;
+			end = xs->width_out;
+		}
+		end = end - first < pool->range_len ? end :
+			first + pool->range_len;
+		pthread_mutex_unlock(&pool->lock);
+
+		xscaler_scale_cols(xs, pool->out, first, end - first);
+
+		pthread_mutex_lock(&pool->lock);
+		if (++pool->finished == pool->ranges) {
+			pthread_cond_signal(&pool->done);
+		}
+	}
+}
+
+static void *xscale_pool_worker(void *arg)
+{
+	struct xscale_pool *pool;
+
+	pool = arg;
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->quit) {
+		xscale_pool_ranges(pool);
+		if (!pool->quit) {
+			pthread_cond_wait(&pool->work, &pool->lock);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+int xscale_pool_init(struct xscale_pool *pool, unsigned threads)
+{
+	unsigned i;
+
+	if (!threads) {
+		return -1; // bad input parameter
+	}
+
+	pool->workers = threads - 1;
+	pool->tids = malloc(pool->workers * sizeof(pthread_t));
+	if (!pool->tids && pool->workers) {
+		return -2; // unable to allocate the thread ids
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->work, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	pool->ranges = pool->next = pool->finished = 0;
+	pool->quit = 0;
+
+	for (i=0; i<pool->workers; i++) {
+		if (pthread_create(&pool->tids[i], NULL, xscale_pool_worker,
+			pool)) {
+			pool->workers = i;
+			xscale_pool_free(pool);
+			return -3; // unable to start a thread
+		}
+	}
+	return 0;
+}
+
+void xscale_pool_free(struct xscale_pool *pool)
+{
+	unsigned i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->work);
+	pthread_mutex_unlock(&pool->lock);
+	for (i=0; i<pool->workers; i++) {
+		pthread_join(pool->tids[i], NULL);
+	}
+	free(pool->tids);
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->work);
+	pthread_mutex_destroy(&pool->lock);
+}
+
+/**
+ * Scale the padded scanline of xs with the pool. Returns 0 without scaling if
+ * it would take less than two ranges.
+ */
+static int xscale_pool_run(struct xscale_pool *pool, struct xscaler *xs,
+	uint8_t *out_buf)
+{
+	uint64_t work;
+	uint32_t ranges, len, period, period_ranges;
+
+	work = (uint64_t)xs->width_out * xs->cmp * xs->ct.taps;
+	ranges = work / XSCALE_RANGE_WORK;
+	ranges = ranges > pool->workers + 1 ? pool->workers + 1 : ranges;
+	if (ranges < 2) {
+		return 0;
+	}
+
+	/* ranges are whole periods, or split a period that is longer than a
+	 * range into equal parts */
+	period = xs->ct.period;
+	len = (xs->width_out + ranges - 1) / ranges;
+	if (len >= period) {
+		len = (len + period - 1) / period * period;
+		period_ranges = 0;
+		ranges = (xs->width_out + len - 1) / len;
+	} else {
+		period_ranges = (period + len - 1) / len;
+		len = (period + period_ranges - 1) / period_ranges;
+		ranges = xs->width_out / period * period_ranges;
+	}
+	if (ranges < 2) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->xs = xs;
+	pool->out = out_buf;
+	pool->range_len = len;
+	pool->period_ranges = period_ranges;
+	pool->ranges = ranges;
+	pool->next = pool->finished = 0;
+	pthread_cond_broadcast(&pool->work);
+	xscale_pool_ranges(pool);
+	while (pool->finished < pool->ranges) {
+		pthread_cond_wait(&pool->done, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return 1;
+}
+
 void xscaler_scale(struct xscaler *xs, uint8_t *out_buf)
 {
-	padded_sl_extend_edges(xs->psl_buf, xs->width_in, xs->psl_offset, xs->cmp);
-	xscale_padded(xs->psl_buf + xs->psl_offset, xs->width_in, out_buf,
-		xs->width_out, xs->cmp, xs->filler);
+	padded_sl_extend_edges(xs->psl_buf, xs->width_in, xs->psl_offset,
+		xs->wide ? xs->cmp * 2 : xs->cmp);
+	if (xs->pool && xscale_pool_run(xs->pool, xs, out_buf)) {
+		return;
+	}
+	xscaler_scale_cols(xs, out_buf, 0, xs->width_out);
 }
 
 /* yscaler */
 
 static void yscaler_map_pos(struct yscaler *ys, uint32_t pos)
 {
-	long target;
-	target = split_map(ys->in_height, ys->out_height, pos, &ys->ty);
-	ys->target = target + ys->rb.height / 2;
+	int32_t first;
+	first = coeff_tbl_pos(&ys->ct, pos, &ys->idx);
+	ys->target = first + ys->rb.height - 1;
 }
 
-int yscaler_init(struct yscaler *ys, uint32_t in_height, uint32_t out_height,
+size_t yscaler_size(uint32_t in_height, uint32_t out_height, int filter,
 	size_t scanline_len)
 {
-	int ret;
-	uint32_t taps;
-	taps = calc_taps(in_height, out_height);
+	return arena_align(coeff_tbl_size(in_height, out_height, filter)) +
+		sl_rbuf_size(calc_taps(in_height, out_height, filter),
+		scanline_len);
+}
+
+int yscaler_init(struct yscaler *ys, uint32_t in_height, uint32_t out_height,
+	int filter, size_t scanline_len)
+{
+	void *buf;
+
+	if (!in_height || !out_height || !filter_name(filter)) {
+		return -1; // bad input parameter
+	}
+
+	buf = malloc(yscaler_size(in_height, out_height, filter,
+		scanline_len));
+	if (!buf) {
+		return -2;
+	}
+	yscaler_init_buf(ys, in_height, out_height, filter, scanline_len, buf);
+	ys->mem = buf;
+	return 0;
+}
+
+int yscaler_init_buf(struct yscaler *ys, uint32_t in_height,
+	uint32_t out_height, int filter, size_t scanline_len, void *buf)
+{
+	if (!in_height || !out_height || !filter_name(filter)) {
+		return -1; // bad input parameter
+	}
+
 	ys->in_height = in_height;
 	ys->out_height = out_height;
-	ret = sl_rbuf_init(&ys->rb, taps, scanline_len);
+	ys->wide = 0;
+	ys->mem = NULL;
+	coeff_tbl_init_buf(&ys->ct, in_height, out_height, filter, buf);
+	sl_rbuf_init_buf(&ys->rb, ys->ct.taps, scanline_len, (uint8_t *)buf +
+		arena_align(coeff_tbl_size(in_height, out_height, filter)));
 	yscaler_map_pos(ys, 0);
-	return ret;
+	return 0;
 }
 
 void yscaler_free(struct yscaler *ys)
 {
-	sl_rbuf_free(&ys->rb);
+	free(ys->mem);
 }
 
 unsigned char *yscaler_next(struct yscaler *ys)
@@ -556,46 +1372,655 @@ unsigned char *yscaler_next(struct yscaler *ys)
 int yscaler_scale(struct yscaler *ys, uint8_t *out, uint32_t pos, uint8_t cmp,
 	int filler)
 {
-	int ret;
 	uint8_t **virt;
 	virt = sl_rbuf_virt(&ys->rb, ys->target);
-	ret = strip_scale(virt, ys->rb.height, ys->rb.length, out, ys->ty, cmp,
+	if (ys->wide) {
+		strip_scale16((int16_t **)virt, ys->rb.height,
+			ys->rb.length / 2, (int16_t *)out,
+			ys->ct.coeffs + ys->idx * ys->ct.taps,
+			ys->ct.coeffs16 + ys->idx * ys->ct.taps, ys->ct.shift16,
+			cmp, filler);
+		yscaler_map_pos(ys, pos + 1);
+		return 0;
+	}
+	strip_scale_coeffs(virt, ys->rb.height, ys->rb.length, out,
+		ys->ct.coeffs + ys->idx * ys->ct.taps,
+		ys->ct.coeffs16 + ys->idx * ys->ct.taps, ys->ct.shift16, cmp,
 		filler);
 	yscaler_map_pos(ys, pos + 1);
-	return ret;
+	return 0;
+}
+
+/**
+ * Point virt at the taps scanlines of an in-memory image starting at strip_pos,
+ * repeating the first and last scanline past the edges.
+ */
+static void prealloc_strip(uint8_t **in, uint32_t in_height, uint8_t **virt,
+	uint32_t taps, int32_t strip_pos)
+{
+	uint32_t i;
+	int32_t safe_pos;
+
+	for (i=0; i<taps; i++) {
+		safe_pos = strip_pos < 0 ? 0 : strip_pos;
+		safe_pos = (uint32_t)safe_pos > in_height - 1 ? (int32_t)in_height - 1 : safe_pos;
+		virt[i] = in[safe_pos];
+		strip_pos++;
+	}
+}
+
+int yscaler_prealloc_row(struct yscaler *ys, uint8_t **in, uint8_t *out,
+	uint32_t pos, uint32_t width, uint8_t cmp, int filler)
+{
+	uint32_t idx, taps;
+	int32_t strip_pos;
+
+	taps = ys->ct.taps;
+	strip_pos = coeff_tbl_pos(&ys->ct, pos, &idx);
+	prealloc_strip(in, ys->in_height, ys->rb.virt, taps, strip_pos);
+	strip_scale_coeffs(ys->rb.virt, taps, (size_t)width * cmp, out,
+		ys->ct.coeffs + idx * taps, ys->ct.coeffs16 + idx * taps,
+		ys->ct.shift16, cmp, filler);
+	return 0;
 }
 
 int yscaler_prealloc_scale(uint32_t in_height, uint32_t out_height,
-	uint8_t **in, uint8_t *out, uint32_t pos, uint32_t width, uint8_t cmp,
-	int filler)
+	int filter, uint8_t **in, uint8_t *out, uint32_t pos, uint32_t width,
+	uint8_t cmp, int filler)
 {
-	uint32_t i, taps;
-	int32_t smp_i, strip_pos, safe_pos;
-	uint8_t **virt;
+	uint32_t taps;
+	int32_t smp_i, strip_pos;
+	uint8_t *stack_virt[STACK_TAPS], **virt;
 	float ty;
 	int ret;
 
-	taps = calc_taps(in_height, out_height);
-	virt = malloc(taps * sizeof(uint8_t *));
-	if (!virt) {
-		return -2;
+	if (!filter_name(filter)) {
+		return -1; // bad input parameter
+	}
+
+	taps = calc_taps(in_height, out_height, filter);
+	virt = stack_virt;
+	if (taps > STACK_TAPS) {
+		virt = malloc(taps * sizeof(uint8_t *));
+		if (!virt) {
+			return -2;
+		}
 	}
 	smp_i = split_map(in_height, out_height, pos, &ty);
 	strip_pos = smp_i + 1 - taps / 2;
+	prealloc_strip(in, in_height, virt, taps, strip_pos);
 
-	for (i=0; i<taps; i++) {
-		safe_pos = strip_pos < 0 ? 0 : strip_pos;
-		safe_pos = (uint32_t)safe_pos > in_height - 1 ? (int32_t)in_height - 1 : safe_pos;
-		virt[i] = in[safe_pos];
-		strip_pos++;
+	ret = strip_scale(virt, taps, (size_t)width * cmp, out, ty, filter,
+		cmp, filler);
+	if (virt != stack_virt) {
+		free(virt);
 	}
-
-	ret = strip_scale(virt, taps, (size_t)width * cmp, out, ty, cmp,
-		filler);
-	free(virt);
 	return ret;
 }
 
+/* box prefilter */
+
+uint32_t box_factor(uint32_t dim_in, uint32_t dim_out)
+{
+	uint64_t factor;
+
+	factor = dim_in / ((uint64_t)dim_out * BOX_MIN_RATIO);
+	if (factor > BOX_MAX_FACTOR) {
+		return BOX_MAX_FACTOR;
+	}
+	return factor < 2 ? 1 : factor;
+}
+
+size_t box_size(uint32_t in_width, uint8_t cmp)
+{
+	return arena_align((size_t)in_width * cmp) +
+		(size_t)in_width * cmp * sizeof(uint16_t);
+}
+
+void box_init_buf(struct box_reducer *br, uint32_t in_width,
+	uint32_t in_height, uint32_t fx, uint32_t fy, uint8_t cmp, void *buf)
+{
+	br->in_width = in_width;
+	br->in_height = in_height;
+	br->fx = fx;
+	br->fy = fy;
+	br->out_width = in_width / fx;
+	br->out_height = in_height / fy;
+	br->cmp = cmp;
+	br->rows = 0;
+	br->done = 0;
+	br->row = buf;
+	br->sums = (uint16_t *)((uint8_t *)buf +
+		arena_align((size_t)in_width * cmp));
+	memset(br->sums, 0, (size_t)in_width * cmp * sizeof(uint16_t));
+}
+
+/**
+ * Number of input samples or scanlines that go into box i. The last box also
+ * takes the remainder.
+ */
+static uint32_t box_len(uint32_t i, uint32_t factor, uint32_t dim_in,
+	uint32_t dim_out)
+{
+	return i == dim_out - 1 ? dim_in - i * factor : factor;
+}
+
+int box_add(struct box_reducer *br, uint8_t *out)
+{
+	uint32_t i, j, n, total, div;
+	uint16_t *sums;
+	size_t len;
+	uint8_t k, cmp;
+
+	/* Sum scanlines column by column first. That is the part that runs for
+	 * every input scanline, and it is a straight add of bytes to 16-bit
+	 * sums. */
+	cmp = br->cmp;
+	len = (size_t)br->in_width * cmp;
+	if (!simd_box_sum(br->sums, br->row, len)) {
+		for (i=0; i<len; i++) {
+			br->sums[i] += br->row[i];
+		}
+	}
+
+	if (++br->rows < box_len(br->done, br->fy, br->in_height,
+		br->out_height)) {
+		return 0;
+	}
+
+	sums = br->sums;
+	for (i=0; i<br->out_width; i++) {
+		n = box_len(i, br->fx, br->in_width, br->out_width);
+		div = n * br->rows;
+		for (k=0; k<cmp; k++) {
+			total = 0;
+			for (j=0; j<n; j++) {
+				total += sums[j * cmp + k];
+			}
+			*out++ = (total + div / 2) / div;
+		}
+		sums += n * cmp;
+	}
+	memset(br->sums, 0, len * sizeof(uint16_t));
+	br->rows = 0;
+	br->done++;
+	return 1;
+}
+
+/* linear light */
+
+/**
+ * sRGB to linear light and back, built once by linear_init(). Alpha is
+ * already linear and only widened by alpha_to16.
+ */
+static uint16_t to_linear[256];
+static uint16_t alpha_to16[256];
+static uint8_t to_srgb[LINEAR_MAX + 1];
+static pthread_once_t linear_once = PTHREAD_ONCE_INIT;
+
+static double srgb_decode(double v)
+{
+	return v <= 0.04045 ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4);
+}
+
+static void linear_init(void)
+{
+	uint32_t i, j;
+	double mid;
+
+	for (i=0; i<256; i++) {
+		to_linear[i] = srgb_decode(i / 255.0) * LINEAR_MAX + 0.5;
+		alpha_to16[i] = (i * LINEAR_MAX + 127) / 255;
+	}
+
+	/* linear values below the one halfway between sRGB i and i + 1 round
+	 * down to i */
+	j = 0;
+	for (i=0; i<255; i++) {
+		mid = srgb_decode((i + 0.5) / 255) * LINEAR_MAX;
+		for (; j<=LINEAR_MAX && j<mid; j++) {
+			to_srgb[j] = i;
+		}
+	}
+	for (; j<=LINEAR_MAX; j++) {
+		to_srgb[j] = 255;
+	}
+}
+
+/**
+ * Index of the alpha component, or -1 if there is none. Alpha is already
+ * linear and is only brought to the range of linear light samples.
+ */
+static int alpha_cmp(uint8_t cmp, int filler)
+{
+	if (cmp == 2) {
+		return 1;
+	}
+	return cmp == 4 && !filler ? 3 : -1;
+}
+
+static void row_to_linear(uint8_t *in, int16_t *out, size_t len,
+	uint8_t cmp, int filler)
+{
+	size_t i;
+	int a;
+
+	for (i=0; i<len; i++) {
+		out[i] = to_linear[in[i]];
+	}
+	a = alpha_cmp(cmp, filler);
+	if (a >= 0) {
+		for (i=a; i<len; i+=cmp) {
+			out[i] = alpha_to16[in[i]];
+		}
+	}
+}
+
+static void row_to_srgb(int16_t *in, uint8_t *out, size_t len, uint8_t cmp,
+	int filler)
+{
+	size_t i;
+	uint32_t x;
+	int a;
+
+	/* filters that ring leave negative samples next to bright edges */
+	for (i=0; i<len; i++) {
+		out[i] = to_srgb[in[i] < 0 ? 0 : in[i]];
+	}
+	/* x / LINEAR_MAX as (x + (x >> 15) + 1) >> 15, which is exact for
+	 * these x and doesn't leave a division in -Os builds */
+	a = alpha_cmp(cmp, filler);
+	if (a >= 0) {
+		for (i=a; i<len; i+=cmp) {
+			x = (in[i] < 0 ? 0 : in[i]) * 255 + LINEAR_MAX / 2;
+			out[i] = (x + (x >> 15) + 1) >> 15;
+		}
+	}
+}
+
+/**
+ * Redo the 16-bit coefficients of ct for int16_t samples, which take a
+ * smaller shift than 8-bit ones.
+ *
+ * Biased samples only scale right when each row of weights adds up to exactly
+ * one, but rounding every weight on its own leaves a row up to taps / 2 units
+ * off, which shifts large reductions by tens of LSB. So the running sum of the
+ * row is rounded instead, and each weight is the step between two of those.
+ */
+static void coeff_tbl_wide(struct coeff_tbl *ct)
+{
+	uint32_t i, k;
+	int64_t total, rounded, prev, step;
+	fix1_30 *c;
+	int16_t *c16;
+	uint8_t drop;
+
+	ct->shift16 = coeffs_to16(ct->coeffs, ct->coeffs16,
+		(size_t)ct->period * ct->taps, SHIFT16_WIDE);
+	drop = 30 - ct->shift16;
+
+	for (i=0; i<ct->period; i++) {
+		c = ct->coeffs + (size_t)i * ct->taps;
+		c16 = ct->coeffs16 + (size_t)i * ct->taps;
+		total = prev = 0;
+		for (k=0; k<ct->taps; k++) {
+			total += c[k];
+			rounded = (total + ((int64_t)1 << (drop - 1))) >> drop;
+			step = rounded - prev;
+			c16[k] = step > INT16_MAX ? INT16_MAX : step;
+			prev += c16[k];
+		}
+	}
+}
+
+/* 16-bit images */
+
+/**
+ * Move unsigned 16-bit samples to int16_t by subtracting BIAS16, or back. The
+ * weights of a filter add up to one, so scaling biased samples gives the
+ * biased result.
+ */
+static void row_bias16(uint16_t *row, size_t len)
+{
+	size_t i;
+	uint64_t x;
+
+	/* four samples at a time, as -Os doesn't vectorize */
+	for (i=0; i+4<=len; i+=4) {
+		memcpy(&x, row + i, 8);
+		x ^= BIAS16 * 0x0001000100010001ULL;
+		memcpy(row + i, &x, 8);
+	}
+	for (; i<len; i++) {
+		row[i] ^= BIAS16;
+	}
+}
+
+/* premultiplied alpha */
+
+/**
+ * 255 / a in 16.16 fixed point, built once by unpremul_init().
+ */
+static uint32_t unpremul_tbl[256];
+static pthread_once_t unpremul_once = PTHREAD_ONCE_INIT;
+
+static void unpremul_init(void)
+{
+	uint32_t a;
+
+	for (a=1; a<256; a++) {
+		unpremul_tbl[a] = ((255 << 16) + a / 2) / a;
+	}
+}
+
+void premultiply_row(uint8_t *row, uint32_t width, uint8_t cmp)
+{
+	size_t i, len;
+	uint32_t a, t;
+	uint8_t j;
+
+	/* round(c * a / 255) as (t + (t >> 8)) >> 8 with t = c * a + 128, which
+	 * is exact for 8-bit c and a */
+	len = (size_t)width * cmp;
+	for (i=simd_premultiply(row, len, cmp); i<len; i+=cmp) {
+		a = row[i + cmp - 1];
+		if (a == 255) {
+			continue;
+		}
+		for (j=0; j<cmp-1; j++) {
+			t = row[i + j] * a + 128;
+			row[i + j] = (t + (t >> 8)) >> 8;
+		}
+	}
+}
+
+void unpremultiply_row(uint8_t *row, uint32_t width, uint8_t cmp)
+{
+	size_t i, len;
+	uint32_t r, c;
+	uint8_t j;
+
+	/* skip the opaque start of the row, usually all of it */
+	len = (size_t)width * cmp;
+	for (i=0; i<len && row[i + cmp - 1] == 255; i+=cmp);
+	if (i == len) {
+		return;
+	}
+
+	pthread_once(&unpremul_once, unpremul_init);
+	i += simd_unpremultiply(row + i, len - i, cmp, unpremul_tbl);
+	for (; i<len; i+=cmp) {
+		if (row[i + cmp - 1] == 255) {
+			continue;
+		}
+		r = unpremul_tbl[row[i + cmp - 1]];
+		for (j=0; j<cmp-1; j++) {
+			c = (row[i + j] * r + (1 << 15)) >> 16;
+			row[i + j] = c > 255 ? 255 : c;
+		}
+	}
+}
+
+/**
+ * premultiply_row() and unpremultiply_row() for 16-bit samples that range from
+ * 0 to (1 << bits) - 1: linear light samples with 15 bits, or the samples of
+ * 16-bit images. With that many alpha values a table of reciprocals would not
+ * stay in cache, so unpremultiplying divides.
+ */
+static void premultiply16(uint16_t *row, size_t len, uint8_t cmp, int bits)
+{
+	size_t i;
+	uint32_t a, x, max;
+	uint8_t j;
+
+	/* x / max as (x + (x >> bits) + 1) >> bits, exact for the x of any c and
+	 * a up to max */
+	max = (1U << bits) - 1;
+	for (i=0; i<len; i+=cmp) {
+		a = row[i + cmp - 1];
+		if (a == max) {
+			continue;
+		}
+		for (j=0; j<cmp-1; j++) {
+			x = row[i + j] * a + max / 2;
+			row[i + j] = (x + (x >> bits) + 1) >> bits;
+		}
+	}
+}
+
+static void unpremultiply16(uint16_t *row, size_t len, uint8_t cmp, int bits)
+{
+	size_t i;
+	uint32_t a, c, max;
+	uint8_t j;
+
+	max = (1U << bits) - 1;
+	for (i=0; i<len; i+=cmp) {
+		a = row[i + cmp - 1];
+		if (a == max) {
+			continue;
+		}
+		for (j=0; j<cmp-1; j++) {
+			c = a ? (row[i + j] * max + a / 2) / a : 0;
+			row[i + j] = c > max ? max : c;
+		}
+	}
+}
+
+/* imgscale_ctx */
+
+int yscale_first(uint32_t in_width, uint32_t in_height, uint32_t out_width,
+	uint32_t out_height, int filter)
+{
+	double tx, ty, x_first, y_first;
+
+	tx = calc_taps(in_width, out_width, filter);
+	ty = calc_taps(in_height, out_height, filter);
+	x_first = (double)in_height * out_width * tx * XSCALE_COST +
+		(double)out_height * out_width * ty;
+	y_first = (double)out_height * in_width * ty +
+		(double)out_height * out_width * tx * XSCALE_COST;
+	if (x_first != y_first) {
+		return y_first < x_first;
+	}
+	return in_width < out_width;
+}
+
+void imgscale_ctx_init(struct imgscale_ctx *ctx)
+{
+	memset(ctx, 0, sizeof(struct imgscale_ctx));
+}
+
+int imgscale_ctx_reset(struct imgscale_ctx *ctx, uint32_t in_width,
+	uint32_t in_height, uint32_t out_width, uint32_t out_height, int filter,
+	uint8_t cmp, int filler, int flags)
+{
+	size_t xs_len, ys_len, br_len, row_len, out16_len, out_len, sl_len, len;
+	uint32_t fx, fy;
+	uint8_t bps;
+	int wide;
+
+	if (!in_width || !in_height || !out_width || !out_height ||
+		!filter_name(filter) || !cmp) {
+		return -1; // bad input parameter
+	}
+
+	/* 16-bit and linear light scanlines hold 16-bit samples */
+	ctx->depth16 = flags & IMGSCALE_16BIT ? 1 : 0;
+	ctx->linear = !ctx->depth16 && (flags & IMGSCALE_LINEAR) ? 1 : 0;
+	wide = ctx->depth16 || ctx->linear;
+	bps = wide ? 2 : 1;
+	if (ctx->linear) {
+		pthread_once(&linear_once, linear_init);
+	}
+
+	fx = fy = 1;
+	if ((flags & IMGSCALE_FAST) && !wide) {
+		fx = box_factor(in_width, out_width);
+		fy = box_factor(in_height, out_height);
+	}
+
+	/* the yscaler buffers input scanlines if it goes first */
+	ctx->y_first = yscale_first(in_width / fx, in_height / fy, out_width,
+		out_height, filter);
+	out_len = (size_t)out_width * cmp;
+	sl_len = (ctx->y_first ? (size_t)(in_width / fx) * cmp : out_len) * bps;
+	br_len = 0;
+	if (fx > 1 || fy > 1) {
+		br_len = arena_align(box_size(in_width, cmp));
+	}
+	row_len = out16_len = 0;
+	if (ctx->linear) {
+		row_len = arena_align((size_t)in_width * cmp);
+		out16_len = arena_align(out_len * 2);
+	}
+	xs_len = arena_align(xscaler_size(in_width / fx, out_width, filter,
+		cmp * bps));
+	ys_len = arena_align(yscaler_size(in_height / fy, out_height, filter,
+		sl_len));
+	len = xs_len + ys_len + br_len + row_len + out16_len +
+		out_len * (ctx->depth16 ? 2 : 1);
+
+	/* only grow the arena, so a run of similar images allocates once */
+	if (len > ctx->arena_len) {
+		free(ctx->arena);
+		ctx->arena = malloc(len);
+		if (!ctx->arena) {
+			ctx->arena_len = 0;
+			return -2; // unable to allocate the arena
+		}
+		ctx->arena_len = len;
+	}
+
+	/* a wide xscaler is sized with the bytes per pixel as cmp, which
+	 * makes its padded scanline hold 16-bit samples */
+	xscaler_init_buf(&ctx->xs, in_width / fx, out_width, filter, cmp * bps,
+		filler, ctx->arena);
+	ctx->xs.cmp = cmp;
+	ctx->xs.wide = wide;
+	ctx->xs.pool = ctx->pool;
+	yscaler_init_buf(&ctx->ys, in_height / fy, out_height, filter, sl_len,
+		ctx->arena + xs_len);
+	ctx->ys.wide = wide;
+	if (wide) {
+		coeff_tbl_wide(&ctx->xs.ct);
+		coeff_tbl_wide(&ctx->ys.ct);
+	}
+	ctx->box.row = NULL;
+	if (br_len) {
+		box_init_buf(&ctx->box, in_width, in_height, fx, fy, cmp,
+			ctx->arena + xs_len + ys_len);
+	}
+	ctx->row = NULL;
+	ctx->out16 = NULL;
+	if (ctx->linear) {
+		ctx->row = ctx->arena + xs_len + ys_len + br_len;
+		ctx->out16 = (int16_t *)(ctx->row + row_len);
+	}
+	ctx->outbuf = ctx->arena + xs_len + ys_len + br_len + row_len +
+		out16_len;
+	ctx->premul = (flags & IMGSCALE_PREMULTIPLY) &&
+		alpha_cmp(cmp, filler) >= 0;
+	ctx->slot = NULL;
+	return 0;
+}
+
+uint8_t *imgscale_ctx_next(struct imgscale_ctx *ctx)
+{
+	if (!ctx->slot) {
+		ctx->slot = yscaler_next(&ctx->ys);
+		if (!ctx->slot) {
+			return NULL;
+		}
+	}
+	if (ctx->box.row) {
+		return ctx->box.row;
+	}
+	if (ctx->linear) {
+		return ctx->row;
+	}
+	return ctx->y_first ? ctx->slot : xscaler_psl_pos0(&ctx->xs);
+}
+
+void imgscale_ctx_push(struct imgscale_ctx *ctx)
+{
+	uint8_t *row;
+	size_t len;
+
+	row = ctx->y_first ? ctx->slot : xscaler_psl_pos0(&ctx->xs);
+	len = (size_t)ctx->xs.width_in * ctx->xs.cmp;
+	if (ctx->premul && !ctx->linear && !ctx->depth16) {
+		/* premultiply before averaging in the box prefilter */
+		if (ctx->box.row) {
+			premultiply_row(ctx->box.row, ctx->box.in_width,
+				ctx->xs.cmp);
+		} else {
+			premultiply_row(row, ctx->xs.width_in, ctx->xs.cmp);
+		}
+	}
+	if (ctx->box.row && !box_add(&ctx->box, row)) {
+		return;
+	}
+	if (ctx->linear) {
+		row_to_linear(ctx->row, (int16_t *)row, len, ctx->xs.cmp,
+			ctx->xs.filler);
+		if (ctx->premul) {
+			premultiply16((uint16_t *)row, len, ctx->xs.cmp, 15);
+		}
+	} else if (ctx->depth16) {
+		if (ctx->premul) {
+			premultiply16((uint16_t *)row, len, ctx->xs.cmp, 16);
+		}
+		row_bias16((uint16_t *)row, len);
+	}
+	if (!ctx->y_first) {
+		xscaler_scale(&ctx->xs, ctx->slot);
+	}
+	ctx->slot = NULL;
+}
+
+void imgscale_ctx_scale(struct imgscale_ctx *ctx, uint32_t pos)
+{
+	uint8_t *out;
+	size_t i, len;
+
+	out = ctx->linear ? (uint8_t *)ctx->out16 : ctx->outbuf;
+	if (!ctx->y_first) {
+		yscaler_scale(&ctx->ys, out, pos, ctx->xs.cmp, ctx->xs.filler);
+	} else {
+		yscaler_scale(&ctx->ys, xscaler_psl_pos0(&ctx->xs), pos,
+			ctx->xs.cmp, ctx->xs.filler);
+		xscaler_scale(&ctx->xs, out);
+	}
+	len = (size_t)ctx->xs.width_out * ctx->xs.cmp;
+	if (ctx->linear) {
+		if (ctx->premul) {
+			for (i=0; i<len; i++) {
+				ctx->out16[i] = ctx->out16[i] < 0 ? 0 :
+					ctx->out16[i];
+			}
+			unpremultiply16((uint16_t *)ctx->out16, len,
+				ctx->xs.cmp, 15);
+		}
+		row_to_srgb(ctx->out16, ctx->outbuf, len, ctx->xs.cmp,
+			ctx->xs.filler);
+	} else if (ctx->depth16) {
+		row_bias16((uint16_t *)ctx->outbuf, len);
+		if (ctx->premul) {
+			unpremultiply16((uint16_t *)ctx->outbuf, len,
+				ctx->xs.cmp, 16);
+		}
+	} else if (ctx->premul) {
+		unpremultiply_row(ctx->outbuf, ctx->xs.width_out, ctx->xs.cmp);
+	}
+}
+
+void imgscale_ctx_free(struct imgscale_ctx *ctx)
+{
+	free(ctx->arena);
+	imgscale_ctx_init(ctx);
+}
+
 /* Utility helpers */
 void fix_ratio(uint32_t src_width, uint32_t src_height, uint32_t *out_width,
 	uint32_t *out_height)
@@ -613,18 +2038,46 @@ void fix_ratio(uint32_t src_width, uint32_t src_height, uint32_t *out_width,
 	}
 }
 
-int cubic_scale_denom(uint32_t src_dim, uint32_t out_dim)
+void cover_crop(uint32_t src_width, uint32_t src_height, uint32_t out_width,
+	uint32_t out_height, uint32_t *x, uint32_t *y, uint32_t *width,
+	uint32_t *height)
 {
-	uint32_t scale_factor;
+	uint64_t len;
+
+	*x = 0;
+	*y = 0;
+	*width = src_width;
+	*height = src_height;
 
-	scale_factor = src_dim / out_dim;
-	if (scale_factor >= 8 * 4) {
-		return 8;
-	} else if (scale_factor >= 4 * 4) {
-		return 4;
-	} else if (scale_factor >= 2 * 4) {
-		return 2;
+	if (!out_width || !out_height) {
+		return;
+	}
+
+	if ((uint64_t)src_width * out_height > (uint64_t)src_height * out_width) {
+		len = ((uint64_t)src_height * out_width * 2 + out_height) /
+			((uint64_t)out_height * 2);
+		*width = len ? len : 1;
+		*x = (src_width - *width) / 2;
 	} else {
-		return 1;
+		len = ((uint64_t)src_width * out_height * 2 + out_width) /
+			((uint64_t)out_width * 2);
+		*height = len ? len : 1;
+		*y = (src_height - *height) / 2;
+	}
+}
+
+int cubic_scale_num(uint32_t src_width, uint32_t src_height,
+	uint32_t out_width, uint32_t out_height)
+{
+	uint32_t num;
+
+	for (num=1; num<8; num++) {
+		if ((uint64_t)src_width * num >=
+			(uint64_t)out_width * DCT_MIN_RATIO * 8 &&
+			(uint64_t)src_height * num >=
+			(uint64_t)out_height * DCT_MIN_RATIO * 8) {
+			break;
+		}
 	}
+	return num;
 }
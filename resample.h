@@ -24,6 +24,32 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <pthread.h>
+
+/**
+ * Resampling filters. Catmull-Rom is the default, the others trade sharpness
+ * against ringing and speed.
+ */
+enum imgscale_filter {
+	FILTER_CATROM, // Catmull-Rom cubic, 4 taps
+	FILTER_MITCHELL, // Mitchell-Netravali cubic, softer with less ringing
+	FILTER_LANCZOS2, // 2-lobe Lanczos, 4 taps
+	FILTER_LANCZOS3, // 3-lobe Lanczos, 6 taps, the sharpest
+	FILTER_BILINEAR, // 2 taps, for cheap previews
+	FILTER_BOX, // nearest neighbour when enlarging, block average when reducing
+	FILTERS
+};
+
+/**
+ * Name of a filter as accepted by filter_by_name(), or NULL if filter is not
+ * an enum imgscale_filter.
+ */
+const char *filter_name(int filter);
+
+/**
+ * Look up a filter by name. Returns -1 if there is no such filter.
+ */
+int filter_by_name(const char *name);
 
 /**
  * Calculate the required length for a padded scanline and get the offset at
@@ -35,15 +61,15 @@
  *   returned
  *
  * Example use:
- *   len = padded_sl_len_ofset(in_width, out_width, cmp, &offset);
+ *   len = padded_sl_len_ofset(in_width, out_width, filter, cmp, &offset);
  *   buf = malloc(len);
  *   psl_pos0 = buf + offset;
  *   // populate with in_width samples starting at psl_pos0
  *   padded_sl_extend_edges(buf, in_width, offset, cmp);
- *   xscale_padded(psl_pos0, in_width, outbuf, out_width, cmp, 0);
+ *   xscale_padded(psl_pos0, in_width, outbuf, out_width, filter, cmp, 0);
  *   ...
  */
-size_t padded_sl_len_offset(uint32_t in_width, uint32_t out_width,
+size_t padded_sl_len_offset(uint32_t in_width, uint32_t out_width, int filter,
 	uint8_t cmp, size_t *offset);
 
 /**
@@ -69,10 +95,76 @@ void padded_sl_extend_edges(uint8_t *buf, uint32_t width, size_t pad_len,
 	uint8_t cmp);
 
 /**
- * Scale padded scanline in to scanline out.
+ * Precalculated coefficients for scaling along one dimension.
+ *
+ * The mapping from output to input positions repeats every
+ * dim_out / gcd(dim_in, dim_out) output positions, so only one period of
+ * coefficients and source offsets is stored.
+ */
+struct coeff_tbl {
+	uint32_t dim_in; // input dimension in samples
+	uint32_t dim_out; // output dimension in samples
+	uint32_t taps; // coefficients per output position, up to calc_taps()
+	uint32_t period; // output positions before the coefficients repeat
+	uint32_t in_step; // input positions covered by one period
+	int32_t *coeffs; // period * taps fix1_30 coefficients
+	int32_t *offsets; // input position of the first tap, for each period pos
+	int16_t *coeffs16; // coeffs with shift16 fractional bits, for SIMD kernels
+	uint8_t shift16;
+	void *mem; // allocation owned by the table, NULL if the caller owns it
+};
+
+/**
+ * Number of bytes needed to hold the coefficient table for scaling dim_in
+ * samples to dim_out.
+ */
+size_t coeff_tbl_size(uint32_t dim_in, uint32_t dim_out, int filter);
+
+/**
+ * Calculate the coefficient table for scaling dim_in samples to dim_out with
+ * filter. Taps at either end that are zero for every output position are left
+ * out, so a table can have fewer taps than calc_taps(), down to a single one.
+ *
+ * returns 0 on success, -1 on a bad input parameter or -2 if unable to perform
+ * an allocation.
+ */
+int coeff_tbl_init(struct coeff_tbl *ct, uint32_t dim_in, uint32_t dim_out,
+	int filter);
+
+/**
+ * Calculate the coefficient table in caller supplied memory of at least
+ * coeff_tbl_size() bytes. coeff_tbl_free() won't free it.
+ *
+ * returns 0 on success or -1 on a bad input parameter.
+ */
+int coeff_tbl_init_buf(struct coeff_tbl *ct, uint32_t dim_in,
+	uint32_t dim_out, int filter, void *buf);
+
+/**
+ * Free the coefficients held by a coeff_tbl struct.
+ */
+void coeff_tbl_free(struct coeff_tbl *ct);
+
+/**
+ * Look up the coefficients for output position pos. The index of the
+ * coefficients within one period is stored in idx, so they start at
+ * coeffs + idx * taps. The input position of the first tap is returned.
+ */
+int32_t coeff_tbl_pos(struct coeff_tbl *ct, uint32_t pos, uint32_t *idx);
+
+/**
+ * Scale padded scanline in to scanline out. This calculates a coefficient table
+ * on every call, use xscale_tbl() or an xscaler when scaling many scanlines.
  */
 int xscale_padded(uint8_t *in, uint32_t in_width, uint8_t *out,
-	uint32_t out_width, uint8_t cmp, int filler);
+	uint32_t out_width, int filter, uint8_t cmp, int filler);
+
+/**
+ * Scale padded scanline in to scanline out using a precalculated coefficient
+ * table. Performs no allocations.
+ */
+void xscale_tbl(uint8_t *in, uint8_t *out, struct coeff_tbl *ct, uint8_t cmp,
+	int filler);
 
 /**
  * Indicate how many taps will be required to scale an image. The number of taps
@@ -81,7 +173,7 @@ int xscale_padded(uint8_t *in, uint32_t in_width, uint8_t *out,
  * When dim_in is very large and dim_out is very small, this can exceed the max
  * size of uint32_t, so returns a uint64_t.
  */
-uint64_t calc_taps(uint32_t dim_in, uint32_t dim_out);
+uint64_t calc_taps(uint32_t dim_in, uint32_t dim_out, int filter);
 
 /**
  * Given input & output dimensions and an output position, return the
@@ -94,7 +186,7 @@ int32_t split_map(uint32_t dim_in, uint32_t dim_out, uint32_t pos, float *rest);
  * the height of the image.
  *
  * The strip_height parameter indicates how many scanlines we are passing in. It
- * must be a multiple of 4.
+ * must be an even number.
  *
  * The in parameter points to an array of scanlines, each len bytes. There must
  * be at least strip_height scanlines in the array.
@@ -107,7 +199,47 @@ int32_t split_map(uint32_t dim_in, uint32_t dim_out, uint32_t pos, float *rest);
  * source image.
  */
 int strip_scale(uint8_t **in, uint32_t strip_height, size_t len, uint8_t *out,
-	float ty, uint8_t cmp, int filler);
+	float ty, int filter, uint8_t cmp, int filler);
+
+/**
+ * Threads that x-scale one scanline together, for images too wide for a single
+ * core to keep up with.
+ *
+ * The output columns are split into ranges of whole coefficient periods, or
+ * into parts of a period when it spans most of the scanline, so each range
+ * reads its own window of the padded scanline with a view of the same table.
+ * The thread calling xscaler_scale() claims ranges along with the workers and
+ * returns once they are all done, so scanlines still stream one at a time.
+ * Scanlines with too little work for the threads to pay off are scaled by the
+ * caller alone.
+ */
+struct xscale_pool {
+	pthread_t *tids;
+	unsigned workers; // threads besides the caller
+	pthread_mutex_t lock;
+	pthread_cond_t work; // ranges to claim, or quit
+	pthread_cond_t done; // the last range of the scanline finished
+	struct xscaler *xs; // scaler of the current scanline
+	uint8_t *out;
+	uint32_t range_len; // output columns per range
+	uint32_t period_ranges; // ranges per coefficient period, 0 if whole ones
+	uint32_t ranges; // ranges in the current scanline
+	uint32_t next; // next range to be claimed
+	uint32_t finished; // ranges scaled
+	int quit;
+};
+
+/**
+ * Start a pool that x-scales with threads threads, including the caller.
+ *
+ * returns 0 on success, otherwise a negative integer:
+ *
+ * -1 - bad input parameter
+ * -2 - unable to perform an allocation
+ * -3 - unable to start a thread
+ */
+int xscale_pool_init(struct xscale_pool *pool, unsigned threads);
+void xscale_pool_free(struct xscale_pool *pool);
 
 /**
  * Struct to hold state for x-scaling.
@@ -119,10 +251,27 @@ struct xscaler {
 	uint32_t width_out;
 	uint8_t cmp;
 	int filler;
+	int wide; // 16-bit samples, set up by imgscale_ctx_reset() only
+	struct coeff_tbl ct; // horizontal coefficients
+	struct xscale_pool *pool; // NULL, or threads for wide scanlines
+	void *mem; // allocation owned by the scaler, NULL if the caller owns it
 };
 
+/**
+ * Number of bytes needed by xscaler_init_buf().
+ */
+size_t xscaler_size(uint32_t width_in, uint32_t width_out, int filter,
+	uint8_t cmp);
+
 int xscaler_init(struct xscaler *xs, uint32_t width_in, uint32_t width_out,
-	uint8_t cmp, int filler);
+	int filter, uint8_t cmp, int filler);
+
+/**
+ * Initialize an xscaler in caller supplied memory of at least xscaler_size()
+ * bytes. xscaler_free() won't free it.
+ */
+int xscaler_init_buf(struct xscaler *xs, uint32_t width_in,
+	uint32_t width_out, int filter, uint8_t cmp, int filler, void *buf);
 void xscaler_free(struct xscaler *xs);
 uint8_t *xscaler_psl_pos0(struct xscaler *xs);
 void xscaler_scale(struct xscaler *xs, uint8_t *out_buf);
@@ -145,6 +294,18 @@ struct sl_rbuf {
  */
 int sl_rbuf_init(struct sl_rbuf *rb, uint32_t height, size_t sl_len);
 
+/**
+ * Number of bytes needed by sl_rbuf_init_buf().
+ */
+size_t sl_rbuf_size(uint32_t height, size_t sl_len);
+
+/**
+ * Initialize a sl_rbuf struct in caller supplied memory of at least
+ * sl_rbuf_size() bytes. Don't call sl_rbuf_free() on it.
+ */
+void sl_rbuf_init_buf(struct sl_rbuf *rb, uint32_t height, size_t sl_len,
+	void *buf);
+
 /**
  * Free a sl_rbuf struct, including the ring buffer.
  */
@@ -169,15 +330,31 @@ struct yscaler {
 	uint32_t in_height; // input image height.
 	uint32_t out_height; // output image height.
 	uint32_t target; // where the ring buffer should be on next scaling.
-	float ty; // sub-pixel offset for next scaling.
+	struct coeff_tbl ct; // vertical coefficients.
+	uint32_t idx; // coefficient table index for next scaling.
+	int wide; // 16-bit samples, set up by imgscale_ctx_reset() only.
+	void *mem; // allocation owned by the scaler, NULL if the caller owns it.
 };
 
+/**
+ * Number of bytes needed by yscaler_init_buf().
+ */
+size_t yscaler_size(uint32_t in_height, uint32_t out_height, int filter,
+	size_t scanline_len);
+
 /**
  * Initialize a yscaler struct. Calculates how large the scanline ring buffer
  * will need to be and allocates it.
  */
 int yscaler_init(struct yscaler *ys, uint32_t in_height, uint32_t out_height,
-	size_t scanline_len);
+	int filter, size_t scanline_len);
+
+/**
+ * Initialize a yscaler in caller supplied memory of at least yscaler_size()
+ * bytes. yscaler_free() won't free it.
+ */
+int yscaler_init_buf(struct yscaler *ys, uint32_t in_height,
+	uint32_t out_height, int filter, size_t scanline_len, void *buf);
 
 /**
  * Free a yscaler struct, including the ring buffer.
@@ -206,14 +383,222 @@ int yscaler_scale(struct yscaler *ys, uint8_t *out, uint32_t pos, uint8_t cmp,
  * Helper for scaling an image that sits fully in memory.
  */
 int yscaler_prealloc_scale(uint32_t in_height, uint32_t out_height,
-	uint8_t **in, uint8_t *out, uint32_t pos, uint32_t width, uint8_t cmp,
-	int filler);
+	int filter, uint8_t **in, uint8_t *out, uint32_t pos, uint32_t width,
+	uint8_t cmp, int filler);
+
+/**
+ * Scale output scanline pos of an image that sits fully in memory, using the
+ * coefficients of an initialized yscaler. Its ring buffer is not used, so it
+ * can be initialized with a scanline_len of 0. Performs no allocations.
+ *
+ * The width parameter is the number of samples in each input scanline.
+ */
+int yscaler_prealloc_row(struct yscaler *ys, uint8_t **in, uint8_t *out,
+	uint32_t pos, uint32_t width, uint8_t cmp, int filler);
+
+/**
+ * Box prefilter for large reductions.
+ *
+ * Averages blocks of fx by fy samples into a smaller image using running sums,
+ * so the cubic filter that follows needs far fewer taps and a far shorter ring
+ * buffer. The last column and row of blocks also take in the remainder of the
+ * input.
+ */
+struct box_reducer {
+	uint32_t in_width;
+	uint32_t in_height;
+	uint32_t out_width; // in_width / fx
+	uint32_t out_height; // in_height / fy
+	uint32_t fx;
+	uint32_t fy;
+	uint8_t cmp;
+	uint32_t rows; // input scanlines summed into the current output scanline
+	uint32_t done; // output scanlines produced
+	uint8_t *row; // in_width * cmp bytes to put the next input scanline in
+	uint16_t *sums; // column sums of the scanlines added so far
+};
+
+/**
+ * Pick a box prefilter factor that brings dim_in within 2-4x of dim_out.
+ * Returns 1 when the reduction is small enough for the cubic filter alone.
+ */
+uint32_t box_factor(uint32_t dim_in, uint32_t dim_out);
+
+/**
+ * Number of bytes needed by box_init_buf().
+ */
+size_t box_size(uint32_t in_width, uint8_t cmp);
+
+/**
+ * Initialize a box_reducer in caller supplied memory of at least box_size()
+ * bytes.
+ */
+void box_init_buf(struct box_reducer *br, uint32_t in_width,
+	uint32_t in_height, uint32_t fx, uint32_t fy, uint8_t cmp, void *buf);
+
+/**
+ * Add the scanline in br->row to the running sums. Once the last scanline of a
+ * block row is added, the averaged out_width samples are written to out and 1
+ * is returned. Otherwise returns 0.
+ */
+int box_add(struct box_reducer *br, uint8_t *out);
+
+/**
+ * imgscale_ctx_reset() flag to box-reduce large reductions before the cubic
+ * filter. Much faster for thumbnails of big images at a small cost in
+ * quality.
+ */
+#define IMGSCALE_FAST 1
+
+/**
+ * imgscale_ctx_reset() flag to scale in linear light. Input samples are taken
+ * from sRGB to 16-bit linear light through a lookup table, scaled as 16-bit
+ * samples and taken back to sRGB at the end. Without it samples are filtered
+ * as they are, which darkens fine high-contrast detail when reducing.
+ *
+ * Alpha is scaled as it is. IMGSCALE_FAST is ignored in linear light.
+ */
+#define IMGSCALE_LINEAR 2
+
+/**
+ * imgscale_ctx_reset() flag to filter images with alpha premultiplied. Input
+ * scanlines hold straight alpha and are premultiplied as they are pushed, so
+ * transparent pixels don't bleed their color into their neighbours. Output
+ * scanlines are unpremultiplied again. It has no effect on images without
+ * alpha: cmp 1 and 3, or cmp 4 with filler set.
+ */
+#define IMGSCALE_PREMULTIPLY 4
+
+/**
+ * imgscale_ctx_reset() flag for images with 16-bit samples. Input and output
+ * scanlines hold in_width and out_width * cmp native endian uint16_t samples,
+ * and outbuf takes twice as many bytes. The samples are scaled as int16_t with
+ * a bias of 32768, which costs the last bit or two of precision.
+ *
+ * IMGSCALE_FAST and IMGSCALE_LINEAR are ignored with it.
+ */
+#define IMGSCALE_16BIT 8
+
+/**
+ * Premultiply the width pixels of row by their alpha, in place. cmp is 2 or 4,
+ * with alpha as the last component.
+ */
+void premultiply_row(uint8_t *row, uint32_t width, uint8_t cmp);
+
+/**
+ * Undo premultiply_row() with a table of reciprocals of alpha. Colors filtered
+ * above their alpha are clamped, and fully opaque rows are only scanned.
+ */
+void unpremultiply_row(uint8_t *row, uint32_t width, uint8_t cmp);
+
+/**
+ * Return 1 if scaling in_width x in_height to out_width x out_height with
+ * filter takes less work y-scaling first, 0 if x-scaling first does.
+ *
+ * Work is counted in multiply-adds, with the x-scaling ones weighted as the
+ * slower ones. X-first x-scales all in_height input scanlines and y-scales
+ * out_height scanlines of out_width samples, y-first y-scales out_height
+ * scanlines of in_width samples and x-scales those. On a tie the order whose
+ * yscaler buffers the narrower scanlines wins.
+ *
+ * In practice reductions go y-first and enlargements x-first.
+ */
+int yscale_first(uint32_t in_width, uint32_t in_height, uint32_t out_width,
+	uint32_t out_height, int filter);
+
+/**
+ * Reusable scaling state for an image. The xscaler, the yscaler, the box
+ * prefilter and a buffer for one output scanline all live in a single arena.
+ *
+ * After imgscale_ctx_reset() the image is scaled with the streaming interface
+ * below. With flags of 0 the scalers can also be used directly, just like
+ * ones set up with xscaler_init() and yscaler_init().
+ * Scaling never allocates. The arena is kept across resets and only
+ * reallocated when the next image needs more room, so a long running process
+ * scaling similar images stops allocating once it has warmed up.
+ *
+ * imgscale_ctx_reset() picks the pass order with yscale_first(). Y-first, the
+ * yscaler buffers input scanlines and y-scales them into the xscaler's padded
+ * scanline, which is then x-scaled into outbuf.
+ */
+struct imgscale_ctx {
+	uint8_t *arena;
+	size_t arena_len;
+	struct xscaler xs;
+	struct yscaler ys;
+	struct box_reducer box; // prefilter, only used if box.row is set
+	uint8_t *slot; // yscaler scanline waiting for input
+	uint8_t *outbuf; // out_width * cmp samples
+	int y_first; // y-scale before x-scaling, see yscale_first()
+	int linear; // IMGSCALE_LINEAR, the scalers hold 16-bit samples
+	uint8_t *row; // linear light input scanline, before conversion
+	int16_t *out16; // linear light output scanline, before conversion
+	int premul; // IMGSCALE_PREMULTIPLY on an image with alpha
+	int depth16; // IMGSCALE_16BIT, the scalers hold 16-bit samples
+	struct xscale_pool *pool; // set after imgscale_ctx_init(), or NULL
+};
+
+void imgscale_ctx_init(struct imgscale_ctx *ctx);
+
+/**
+ * Set up ctx to scale an in_width x in_height image to out_width x out_height
+ * with filter. flags is 0 or a combination of IMGSCALE_FAST, IMGSCALE_LINEAR,
+ * IMGSCALE_PREMULTIPLY and IMGSCALE_16BIT.
+ *
+ * returns 0 on success, otherwise a negative integer:
+ *
+ * -1 - bad input parameter
+ * -2 - unable to perform an allocation
+ */
+int imgscale_ctx_reset(struct imgscale_ctx *ctx, uint32_t in_width,
+	uint32_t in_height, uint32_t out_width, uint32_t out_height, int filter,
+	uint8_t cmp, int filler, int flags);
+
+/**
+ * Streaming interface. Scale an image one scanline at a time:
+ *
+ *   for (i=0; i<out_height; i++) {
+ *     while ((row = imgscale_ctx_next(ctx))) {
+ *       // fill row with the next in_width input samples
+ *       imgscale_ctx_push(ctx);
+ *     }
+ *     imgscale_ctx_scale(ctx, i);
+ *     // output scanline i is in ctx->outbuf
+ *   }
+ *
+ * imgscale_ctx_next() returns the buffer for the next input scanline, or NULL
+ * once enough input has been pushed to produce the next output scanline.
+ */
+uint8_t *imgscale_ctx_next(struct imgscale_ctx *ctx);
+void imgscale_ctx_push(struct imgscale_ctx *ctx);
+void imgscale_ctx_scale(struct imgscale_ctx *ctx, uint32_t pos);
+
+/**
+ * Free the arena. The ctx can be reset again afterwards.
+ */
+void imgscale_ctx_free(struct imgscale_ctx *ctx);
 
 /**
  * Utility helpers.
  */
 void fix_ratio(uint32_t src_width, uint32_t src_height, uint32_t *out_width,
 	uint32_t *out_height);
-int cubic_scale_denom(uint32_t src_dim, uint32_t out_dim);
+
+/**
+ * Find the centered window of the source image that has the aspect ratio of
+ * the output size. Scaling just that window fills the output, cropping off
+ * whatever overflows.
+ */
+void cover_crop(uint32_t src_width, uint32_t src_height, uint32_t out_width,
+	uint32_t out_height, uint32_t *x, uint32_t *y, uint32_t *width,
+	uint32_t *height);
+
+/**
+ * Pick the scaling for a JPEG decoder: the smallest scale_num over a
+ * scale_denom of 8 that leaves the cubic filter some reduction to do in both
+ * dimensions. Returns 8 if the image should be decoded at full size.
+ */
+int cubic_scale_num(uint32_t src_width, uint32_t src_height,
+	uint32_t out_width, uint32_t out_height);
 
 #endif
@@ -0,0 +1,1411 @@
+/**
+ * Copyright (c) 2014-2016 Timothy Elliott
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "resample_simd.h"
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+
+#if RESAMPLE_SIMD > SIMD_NONE && defined(__GNUC__) && \
+	(defined(__x86_64__) || defined(__i386__))
+#define HAVE_X86_SIMD
+#include <immintrin.h>
+#endif
+
+static pthread_once_t level_once = PTHREAD_ONCE_INIT;
+static int level;
+
+static void level_init(void)
+{
+	level = SIMD_NONE;
+#ifdef HAVE_X86_SIMD
+	__builtin_cpu_init();
+	if (RESAMPLE_SIMD >= SIMD_AVX2 && __builtin_cpu_supports("avx2")) {
+		level = SIMD_AVX2;
+	} else if (__builtin_cpu_supports("sse4.1")) {
+		level = SIMD_SSE41;
+	}
+#endif
+}
+
+int simd_level(void)
+{
+	pthread_once(&level_once, level_init);
+	return level;
+}
+
+#ifdef HAVE_X86_SIMD
+
+/**
+ * Rounding added to a sum with shift fractional bits before truncating. This
+ * matches the 0.5 + TOPOFF used by the scalar kernels.
+ */
+static int32_t simd_round(uint8_t shift)
+{
+	return (1 << (shift - 1)) + (8192 >> (30 - shift));
+}
+
+/**
+ * Get the coefficients and the input position of the first tap for output
+ * sample i + j * period, then advance i and j to the next output sample. It
+ * runs for every output sample, so it is inlined into the kernels.
+ */
+static KERNEL_INLINE int16_t *tbl_next(struct coeff_tbl *ct, uint8_t *in,
+	uint8_t cmp, uint32_t *i, uint32_t *j, uint8_t **src)
+{
+	int16_t *c;
+
+	c = ct->coeffs16 + (size_t)*i * ct->taps;
+	*src = in + (ct->offsets[*i] + (int64_t)*j * ct->in_step) * cmp;
+	if (++*i == ct->period) {
+		*i = 0;
+		++*j;
+	}
+	return c;
+}
+
+/**
+ * tbl_next() for 16-bit samples.
+ */
+static KERNEL_INLINE int16_t *tbl_next16(struct coeff_tbl *ct, int16_t *in,
+	uint8_t cmp, uint32_t *i, uint32_t *j, int16_t **src)
+{
+	int16_t *c;
+
+	c = ct->coeffs16 + (size_t)*i * ct->taps;
+	*src = in + (ct->offsets[*i] + (int64_t)*j * ct->in_step) * cmp;
+	if (++*i == ct->period) {
+		*i = 0;
+		++*j;
+	}
+	return c;
+}
+
+/* Horizontal kernels for 4 component samples.
+ *
+ * Two neighbouring taps are interleaved as 16-bit values [r0 r1 g0 g1 b0 b1 a0
+ * a1] so that pmaddwd against [c0 c1 c0 c1 ...] leaves the four 32-bit
+ * component sums of both taps.
+ */
+
+__attribute__((target("sse4.1")))
+static KERNEL_INLINE void xscale_32_sse41_taps(uint8_t *in, uint8_t *out,
+	struct coeff_tbl *ct, int filler, uint32_t taps)
+{
+	uint32_t x, i, j, k, val, mask;
+	int16_t *c;
+	uint8_t *p;
+	__m128i sh01, sh23, round, shift, acc, px, cv;
+
+	sh01 = _mm_setr_epi8(0, -1, 4, -1, 1, -1, 5, -1,
+		2, -1, 6, -1, 3, -1, 7, -1);
+	sh23 = _mm_setr_epi8(8, -1, 12, -1, 9, -1, 13, -1,
+		10, -1, 14, -1, 11, -1, 15, -1);
+	round = _mm_set1_epi32(simd_round(ct->shift16));
+	shift = _mm_cvtsi32_si128(ct->shift16);
+	mask = filler ? 0x00FFFFFF : 0xFFFFFFFF;
+
+	i = j = 0;
+	for (x=0; x<ct->dim_out; x++) {
+		c = tbl_next(ct, in, 4, &i, &j, &p);
+
+		acc = round;
+		UNROLL_TAPS
+		for (k=0; k+4<=taps; k+=4) {
+			px = _mm_loadu_si128((__m128i *)(p + k * 4));
+			cv = _mm_loadl_epi64((__m128i *)(c + k));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(
+				_mm_shuffle_epi8(px, sh01),
+				_mm_shuffle_epi32(cv, 0x00)));
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(
+				_mm_shuffle_epi8(px, sh23),
+				_mm_shuffle_epi32(cv, 0x55)));
+		}
+		if (k < taps) {
+			px = _mm_loadl_epi64((__m128i *)(p + k * 4));
+			memcpy(&val, c + k, 4);
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(
+				_mm_shuffle_epi8(px, sh01), _mm_set1_epi32(val)));
+		}
+
+		acc = _mm_sra_epi32(acc, shift);
+		acc = _mm_packs_epi32(acc, acc);
+		acc = _mm_packus_epi16(acc, acc);
+		val = _mm_cvtsi128_si32(acc) & mask;
+		memcpy(out + x * 4, &val, 4);
+	}
+}
+
+__attribute__((target("sse4.1")))
+static void xscale_32_sse41(uint8_t *in, uint8_t *out, struct coeff_tbl *ct,
+	int filler)
+{
+#define XSCALE(n, arg) xscale_32_sse41_taps(in, out, ct, filler, n)
+	TAPS_DISPATCH(ct->taps, XSCALE, 0);
+#undef XSCALE
+}
+
+/**
+ * The AVX2 kernel computes two output samples at a time, one in each 128-bit
+ * lane.
+ */
+__attribute__((target("avx2")))
+static KERNEL_INLINE void xscale_32_avx2_taps(uint8_t *in, uint8_t *out,
+	struct coeff_tbl *ct, int filler, uint32_t taps)
+{
+	uint32_t x, i, j, k, val, mask;
+	int16_t *ca, *cb;
+	uint8_t *pa, *pb;
+	__m256i sh01, sh23, round, acc, px, cv;
+	__m128i shift, res;
+
+	sh01 = _mm256_broadcastsi128_si256(_mm_setr_epi8(0, -1, 4, -1, 1, -1,
+		5, -1, 2, -1, 6, -1, 3, -1, 7, -1));
+	sh23 = _mm256_broadcastsi128_si256(_mm_setr_epi8(8, -1, 12, -1, 9, -1,
+		13, -1, 10, -1, 14, -1, 11, -1, 15, -1));
+	round = _mm256_set1_epi32(simd_round(ct->shift16));
+	shift = _mm_cvtsi32_si128(ct->shift16);
+	mask = filler ? 0x00FFFFFF : 0xFFFFFFFF;
+
+	i = j = 0;
+	for (x=0; x+1<ct->dim_out; x+=2) {
+		ca = tbl_next(ct, in, 4, &i, &j, &pa);
+		cb = tbl_next(ct, in, 4, &i, &j, &pb);
+
+		acc = round;
+		UNROLL_TAPS
+		for (k=0; k+4<=taps; k+=4) {
+			px = _mm256_inserti128_si256(_mm256_castsi128_si256(
+				_mm_loadu_si128((__m128i *)(pa + k * 4))),
+				_mm_loadu_si128((__m128i *)(pb + k * 4)), 1);
+			cv = _mm256_inserti128_si256(_mm256_castsi128_si256(
+				_mm_loadl_epi64((__m128i *)(ca + k))),
+				_mm_loadl_epi64((__m128i *)(cb + k)), 1);
+			acc = _mm256_add_epi32(acc, _mm256_madd_epi16(
+				_mm256_shuffle_epi8(px, sh01),
+				_mm256_shuffle_epi32(cv, 0x00)));
+			acc = _mm256_add_epi32(acc, _mm256_madd_epi16(
+				_mm256_shuffle_epi8(px, sh23),
+				_mm256_shuffle_epi32(cv, 0x55)));
+		}
+		if (k < taps) {
+			px = _mm256_inserti128_si256(_mm256_castsi128_si256(
+				_mm_loadl_epi64((__m128i *)(pa + k * 4))),
+				_mm_loadl_epi64((__m128i *)(pb + k * 4)), 1);
+			memcpy(&val, ca + k, 4);
+			cv = _mm256_castsi128_si256(_mm_set1_epi32(val));
+			memcpy(&val, cb + k, 4);
+			cv = _mm256_inserti128_si256(cv, _mm_set1_epi32(val), 1);
+			acc = _mm256_add_epi32(acc, _mm256_madd_epi16(
+				_mm256_shuffle_epi8(px, sh01), cv));
+		}
+
+		acc = _mm256_sra_epi32(acc, shift);
+		acc = _mm256_packs_epi32(acc, acc);
+		acc = _mm256_packus_epi16(acc, acc);
+		res = _mm256_castsi256_si128(acc);
+		val = _mm_cvtsi128_si32(res) & mask;
+		memcpy(out + x * 4, &val, 4);
+		res = _mm256_extracti128_si256(acc, 1);
+		val = _mm_cvtsi128_si32(res) & mask;
+		memcpy(out + x * 4 + 4, &val, 4);
+	}
+
+	if (x < ct->dim_out) {
+		/* odd output width, finish the last sample one at a time */
+		acc = round;
+		ca = tbl_next(ct, in, 4, &i, &j, &pa);
+		for (k=0; k+2<=taps; k+=2) {
+			px = _mm256_castsi128_si256(
+				_mm_loadl_epi64((__m128i *)(pa + k * 4)));
+			memcpy(&val, ca + k, 4);
+			acc = _mm256_add_epi32(acc, _mm256_madd_epi16(
+				_mm256_shuffle_epi8(px, sh01),
+				_mm256_set1_epi32(val)));
+		}
+		acc = _mm256_sra_epi32(acc, shift);
+		acc = _mm256_packs_epi32(acc, acc);
+		acc = _mm256_packus_epi16(acc, acc);
+		val = _mm_cvtsi128_si32(_mm256_castsi256_si128(acc)) & mask;
+		memcpy(out + x * 4, &val, 4);
+	}
+}
+
+__attribute__((target("avx2")))
+static void xscale_32_avx2(uint8_t *in, uint8_t *out, struct coeff_tbl *ct,
+	int filler)
+{
+#define XSCALE(n, arg) xscale_32_avx2_taps(in, out, ct, filler, n)
+	TAPS_DISPATCH(ct->taps, XSCALE, 0);
+#undef XSCALE
+}
+
+/* Horizontal kernels for 1, 2 and 3 component samples.
+ *
+ * The taps of an output sample are widened to 16-bit values and multiplied
+ * with pmaddwd in runs of up to 8, 4 and 2 taps, so no load reaches past the
+ * last tap. Each *_sum() helper leaves partial sums in 32-bit lanes that the
+ * kernel then adds up across lanes. These run for SSE4.1 and AVX2 alike.
+ */
+
+/**
+ * Partial sums of a single component sample: the four lanes add up to the
+ * output value.
+ */
+__attribute__((target("sse4.1")))
+static KERNEL_INLINE __m128i xscale_8_sum(uint8_t *p, int16_t *c,
+	uint32_t taps)
+{
+	uint32_t k, val;
+	uint16_t val16;
+	__m128i acc, px, cv;
+
+	acc = _mm_setzero_si128();
+	UNROLL_TAPS
+	for (k=0; k+8<=taps; k+=8) {
+		px = _mm_cvtepu8_epi16(_mm_loadl_epi64((__m128i *)(p + k)));
+		cv = _mm_loadu_si128((__m128i *)(c + k));
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(px, cv));
+	}
+	if (k + 4 <= taps) {
+		memcpy(&val, p + k, 4);
+		px = _mm_cvtepu8_epi16(_mm_cvtsi32_si128(val));
+		cv = _mm_loadl_epi64((__m128i *)(c + k));
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(px, cv));
+		k += 4;
+	}
+	if (k < taps) {
+		memcpy(&val16, p + k, 2);
+		px = _mm_cvtepu8_epi16(_mm_cvtsi32_si128(val16));
+		memcpy(&val, c + k, 4);
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(px,
+			_mm_cvtsi32_si128(val)));
+	}
+	return acc;
+}
+
+/**
+ * Four single component output samples at a time. The horizontal adds fold
+ * the partial sums of the four samples into one lane each.
+ */
+__attribute__((target("sse4.1")))
+static KERNEL_INLINE void xscale_8_sse41_taps(uint8_t *in, uint8_t *out,
+	struct coeff_tbl *ct, uint32_t taps)
+{
+	uint32_t x, i, j, val;
+	int16_t *c;
+	uint8_t *p;
+	__m128i round, shift, s0, s1, s2, s3, acc;
+
+	round = _mm_set1_epi32(simd_round(ct->shift16));
+	shift = _mm_cvtsi32_si128(ct->shift16);
+
+	i = j = 0;
+	for (x=0; x+4<=ct->dim_out; x+=4) {
+		c = tbl_next(ct, in, 1, &i, &j, &p);
+		s0 = xscale_8_sum(p, c, taps);
+		c = tbl_next(ct, in, 1, &i, &j, &p);
+		s1 = xscale_8_sum(p, c, taps);
+		c = tbl_next(ct, in, 1, &i, &j, &p);
+		s2 = xscale_8_sum(p, c, taps);
+		c = tbl_next(ct, in, 1, &i, &j, &p);
+		s3 = xscale_8_sum(p, c, taps);
+
+		acc = _mm_hadd_epi32(_mm_hadd_epi32(s0, s1),
+			_mm_hadd_epi32(s2, s3));
+		acc = _mm_sra_epi32(_mm_add_epi32(acc, round), shift);
+		acc = _mm_packs_epi32(acc, acc);
+		acc = _mm_packus_epi16(acc, acc);
+		val = _mm_cvtsi128_si32(acc);
+		memcpy(out + x, &val, 4);
+	}
+
+	for (; x<ct->dim_out; x++) {
+		c = tbl_next(ct, in, 1, &i, &j, &p);
+		acc = xscale_8_sum(p, c, taps);
+		acc = _mm_hadd_epi32(acc, acc);
+		acc = _mm_hadd_epi32(acc, acc);
+		acc = _mm_sra_epi32(_mm_add_epi32(acc, round), shift);
+		acc = _mm_packus_epi16(_mm_packs_epi32(acc, acc), acc);
+		out[x] = _mm_cvtsi128_si32(acc);
+	}
+}
+
+__attribute__((target("sse4.1")))
+static void xscale_8_sse41(uint8_t *in, uint8_t *out, struct coeff_tbl *ct)
+{
+#define XSCALE(n, arg) xscale_8_sse41_taps(in, out, ct, n)
+	TAPS_DISPATCH(ct->taps, XSCALE, 0);
+#undef XSCALE
+}
+
+/**
+ * Partial sums of a 2 component sample. Two neighbouring taps are interleaved
+ * as [c0 c0' c1 c1'] like in the 4 component kernels, which leaves the sums
+ * of both components in lanes [0 1] and [2 3].
+ */
+__attribute__((target("sse4.1")))
+static KERNEL_INLINE __m128i xscale_16_sum(uint8_t *p, int16_t *c,
+	uint32_t taps)
+{
+	uint32_t k, val;
+	__m128i sh, acc, px, cv;
+
+	sh = _mm_setr_epi8(0, -1, 2, -1, 1, -1, 3, -1,
+		4, -1, 6, -1, 5, -1, 7, -1);
+	acc = _mm_setzero_si128();
+	UNROLL_TAPS
+	for (k=0; k+4<=taps; k+=4) {
+		px = _mm_loadl_epi64((__m128i *)(p + k * 2));
+		cv = _mm_loadl_epi64((__m128i *)(c + k));
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(
+			_mm_shuffle_epi8(px, sh), _mm_shuffle_epi32(cv, 0x50)));
+	}
+	if (k < taps) {
+		memcpy(&val, p + k * 2, 4);
+		px = _mm_cvtsi32_si128(val);
+		memcpy(&val, c + k, 4);
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(
+			_mm_shuffle_epi8(px, sh), _mm_set1_epi32(val)));
+	}
+	return acc;
+}
+
+/**
+ * Two 2 component output samples at a time.
+ */
+__attribute__((target("sse4.1")))
+static KERNEL_INLINE void xscale_16_sse41_taps(uint8_t *in, uint8_t *out,
+	struct coeff_tbl *ct, uint32_t taps)
+{
+	uint32_t x, i, j, val;
+	int16_t *c;
+	uint8_t *p;
+	__m128i round, shift, s0, s1, acc;
+
+	round = _mm_set1_epi32(simd_round(ct->shift16));
+	shift = _mm_cvtsi32_si128(ct->shift16);
+
+	i = j = 0;
+	for (x=0; x+2<=ct->dim_out; x+=2) {
+		c = tbl_next(ct, in, 2, &i, &j, &p);
+		s0 = xscale_16_sum(p, c, taps);
+		c = tbl_next(ct, in, 2, &i, &j, &p);
+		s1 = xscale_16_sum(p, c, taps);
+
+		acc = _mm_add_epi32(_mm_unpacklo_epi64(s0, s1),
+			_mm_unpackhi_epi64(s0, s1));
+		acc = _mm_sra_epi32(_mm_add_epi32(acc, round), shift);
+		acc = _mm_packs_epi32(acc, acc);
+		acc = _mm_packus_epi16(acc, acc);
+		val = _mm_cvtsi128_si32(acc);
+		memcpy(out + x * 2, &val, 4);
+	}
+
+	if (x < ct->dim_out) {
+		c = tbl_next(ct, in, 2, &i, &j, &p);
+		s0 = xscale_16_sum(p, c, taps);
+		acc = _mm_add_epi32(s0, _mm_unpackhi_epi64(s0, s0));
+		acc = _mm_sra_epi32(_mm_add_epi32(acc, round), shift);
+		acc = _mm_packus_epi16(_mm_packs_epi32(acc, acc), acc);
+		val = _mm_cvtsi128_si32(acc);
+		memcpy(out + x * 2, &val, 2);
+	}
+}
+
+__attribute__((target("sse4.1")))
+static void xscale_16_sse41(uint8_t *in, uint8_t *out, struct coeff_tbl *ct)
+{
+#define XSCALE(n, arg) xscale_16_sse41_taps(in, out, ct, n)
+	TAPS_DISPATCH(ct->taps, XSCALE, 0);
+#undef XSCALE
+}
+
+/**
+ * Sums of a 3 component sample in lanes [r g b 0]. Taps come in runs of 4,
+ * loaded as 8 + 4 bytes, and a last run of 2, loaded as 4 + 2 bytes.
+ */
+__attribute__((target("sse4.1")))
+static KERNEL_INLINE __m128i xscale_24_sum(uint8_t *p, int16_t *c,
+	uint32_t taps)
+{
+	uint32_t k, val;
+	uint16_t val16;
+	__m128i sh01, sh23, acc, px, cv;
+
+	sh01 = _mm_setr_epi8(0, -1, 3, -1, 1, -1, 4, -1,
+		2, -1, 5, -1, -1, -1, -1, -1);
+	sh23 = _mm_setr_epi8(6, -1, 9, -1, 7, -1, 10, -1,
+		8, -1, 11, -1, -1, -1, -1, -1);
+	acc = _mm_setzero_si128();
+	UNROLL_TAPS
+	for (k=0; k+4<=taps; k+=4) {
+		memcpy(&val, p + k * 3 + 8, 4);
+		px = _mm_insert_epi32(_mm_loadl_epi64((__m128i *)(p + k * 3)),
+			val, 2);
+		cv = _mm_loadl_epi64((__m128i *)(c + k));
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(
+			_mm_shuffle_epi8(px, sh01), _mm_shuffle_epi32(cv, 0x00)));
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(
+			_mm_shuffle_epi8(px, sh23), _mm_shuffle_epi32(cv, 0x55)));
+	}
+	if (k < taps) {
+		memcpy(&val, p + k * 3, 4);
+		memcpy(&val16, p + k * 3 + 4, 2);
+		px = _mm_insert_epi16(_mm_cvtsi32_si128(val), val16, 2);
+		memcpy(&val, c + k, 4);
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(
+			_mm_shuffle_epi8(px, sh01), _mm_set1_epi32(val)));
+	}
+	return acc;
+}
+
+__attribute__((target("sse4.1")))
+static KERNEL_INLINE void xscale_24_sse41_taps(uint8_t *in, uint8_t *out,
+	struct coeff_tbl *ct, uint32_t taps)
+{
+	uint32_t x, i, j, val;
+	int16_t *c;
+	uint8_t *p;
+	__m128i round, shift, acc;
+
+	round = _mm_set1_epi32(simd_round(ct->shift16));
+	shift = _mm_cvtsi32_si128(ct->shift16);
+
+	i = j = 0;
+	for (x=0; x<ct->dim_out; x++) {
+		c = tbl_next(ct, in, 3, &i, &j, &p);
+		acc = xscale_24_sum(p, c, taps);
+		acc = _mm_sra_epi32(_mm_add_epi32(acc, round), shift);
+		acc = _mm_packs_epi32(acc, acc);
+		acc = _mm_packus_epi16(acc, acc);
+		val = _mm_cvtsi128_si32(acc);
+		memcpy(out + x * 3, &val, 3);
+	}
+}
+
+__attribute__((target("sse4.1")))
+static void xscale_24_sse41(uint8_t *in, uint8_t *out, struct coeff_tbl *ct)
+{
+#define XSCALE(n, arg) xscale_24_sse41_taps(in, out, ct, n)
+	TAPS_DISPATCH(ct->taps, XSCALE, 0);
+#undef XSCALE
+}
+
+/* Horizontal kernels for int16_t samples.
+ *
+ * Samples are 16-bit already, so they go into pmaddwd without widening. The
+ * same interleaving of neighbouring taps as above leaves 32-bit sums, which are
+ * saturated back to 16-bit.
+ */
+
+/**
+ * Store the four 16-bit samples of the low 64 bits of acc, rounded and
+ * shifted.
+ */
+__attribute__((target("sse4.1")))
+static KERNEL_INLINE __m128i xscale16_pack(__m128i acc, __m128i round,
+	__m128i shift)
+{
+	acc = _mm_sra_epi32(_mm_add_epi32(acc, round), shift);
+	return _mm_packs_epi32(acc, acc);
+}
+
+/**
+ * Partial sums of a single component sample in four lanes.
+ */
+__attribute__((target("sse4.1")))
+static KERNEL_INLINE __m128i xscale16_1_sum(int16_t *p, int16_t *c,
+	uint32_t taps)
+{
+	uint32_t k, val;
+	__m128i acc, px;
+
+	acc = _mm_setzero_si128();
+	UNROLL_TAPS
+	for (k=0; k+8<=taps; k+=8) {
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(
+			_mm_loadu_si128((__m128i *)(p + k)),
+			_mm_loadu_si128((__m128i *)(c + k))));
+	}
+	if (k + 4 <= taps) {
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(
+			_mm_loadl_epi64((__m128i *)(p + k)),
+			_mm_loadl_epi64((__m128i *)(c + k))));
+		k += 4;
+	}
+	if (k < taps) {
+		memcpy(&val, p + k, 4);
+		px = _mm_cvtsi32_si128(val);
+		memcpy(&val, c + k, 4);
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(px,
+			_mm_cvtsi32_si128(val)));
+	}
+	return acc;
+}
+
+__attribute__((target("sse4.1")))
+static KERNEL_INLINE void xscale16_1_sse41_taps(int16_t *in, int16_t *out,
+	struct coeff_tbl *ct, uint32_t taps)
+{
+	uint32_t x, i, j;
+	int16_t *c;
+	int16_t *p;
+	__m128i round, shift, s0, s1, s2, s3, acc;
+
+	round = _mm_set1_epi32(1 << (ct->shift16 - 1));
+	shift = _mm_cvtsi32_si128(ct->shift16);
+
+	i = j = 0;
+	for (x=0; x+4<=ct->dim_out; x+=4) {
+		c = tbl_next16(ct, in, 1, &i, &j, &p);
+		s0 = xscale16_1_sum(p, c, taps);
+		c = tbl_next16(ct, in, 1, &i, &j, &p);
+		s1 = xscale16_1_sum(p, c, taps);
+		c = tbl_next16(ct, in, 1, &i, &j, &p);
+		s2 = xscale16_1_sum(p, c, taps);
+		c = tbl_next16(ct, in, 1, &i, &j, &p);
+		s3 = xscale16_1_sum(p, c, taps);
+
+		acc = _mm_hadd_epi32(_mm_hadd_epi32(s0, s1),
+			_mm_hadd_epi32(s2, s3));
+		_mm_storel_epi64((__m128i *)(out + x),
+			xscale16_pack(acc, round, shift));
+	}
+
+	for (; x<ct->dim_out; x++) {
+		c = tbl_next16(ct, in, 1, &i, &j, &p);
+		acc = xscale16_1_sum(p, c, taps);
+		acc = _mm_hadd_epi32(acc, acc);
+		acc = _mm_hadd_epi32(acc, acc);
+		out[x] = _mm_extract_epi16(xscale16_pack(acc, round, shift), 0);
+	}
+}
+
+/**
+ * Sums of a 2 component sample in lanes [0 1] and [2 3], from taps
+ * interleaved as [g0 g1 a0 a1].
+ */
+__attribute__((target("sse4.1")))
+static KERNEL_INLINE __m128i xscale16_2_sum(int16_t *p, int16_t *c,
+	uint32_t taps)
+{
+	uint32_t k, val;
+	__m128i sh, acc, cv;
+
+	sh = _mm_setr_epi8(0, 1, 4, 5, 2, 3, 6, 7,
+		8, 9, 12, 13, 10, 11, 14, 15);
+	acc = _mm_setzero_si128();
+	UNROLL_TAPS
+	for (k=0; k+4<=taps; k+=4) {
+		cv = _mm_loadl_epi64((__m128i *)(c + k));
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_shuffle_epi8(
+			_mm_loadu_si128((__m128i *)(p + k * 2)), sh),
+			_mm_shuffle_epi32(cv, 0x50)));
+	}
+	if (k < taps) {
+		memcpy(&val, c + k, 4);
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_shuffle_epi8(
+			_mm_loadl_epi64((__m128i *)(p + k * 2)), sh),
+			_mm_set1_epi32(val)));
+	}
+	return acc;
+}
+
+__attribute__((target("sse4.1")))
+static KERNEL_INLINE void xscale16_2_sse41_taps(int16_t *in, int16_t *out,
+	struct coeff_tbl *ct, uint32_t taps)
+{
+	uint32_t x, i, j, val;
+	int16_t *c;
+	int16_t *p;
+	__m128i round, shift, s0, s1, acc;
+
+	round = _mm_set1_epi32(1 << (ct->shift16 - 1));
+	shift = _mm_cvtsi32_si128(ct->shift16);
+
+	i = j = 0;
+	for (x=0; x+2<=ct->dim_out; x+=2) {
+		c = tbl_next16(ct, in, 2, &i, &j, &p);
+		s0 = xscale16_2_sum(p, c, taps);
+		c = tbl_next16(ct, in, 2, &i, &j, &p);
+		s1 = xscale16_2_sum(p, c, taps);
+
+		acc = _mm_add_epi32(_mm_unpacklo_epi64(s0, s1),
+			_mm_unpackhi_epi64(s0, s1));
+		_mm_storel_epi64((__m128i *)(out + x * 2),
+			xscale16_pack(acc, round, shift));
+	}
+
+	if (x < ct->dim_out) {
+		c = tbl_next16(ct, in, 2, &i, &j, &p);
+		s0 = xscale16_2_sum(p, c, taps);
+		acc = _mm_add_epi32(s0, _mm_unpackhi_epi64(s0, s0));
+		val = _mm_cvtsi128_si32(xscale16_pack(acc, round, shift));
+		memcpy(out + x * 2, &val, 4);
+	}
+}
+
+/**
+ * Sums of a 3 component sample in lanes [r g b 0], two taps at a time loaded
+ * as 8 + 4 bytes.
+ */
+__attribute__((target("sse4.1")))
+static KERNEL_INLINE __m128i xscale16_3_sum(int16_t *p, int16_t *c,
+	uint32_t taps)
+{
+	uint32_t k, val;
+	__m128i sh, acc, px;
+
+	sh = _mm_setr_epi8(0, 1, 6, 7, 2, 3, 8, 9,
+		4, 5, 10, 11, -1, -1, -1, -1);
+	acc = _mm_setzero_si128();
+	UNROLL_TAPS
+	for (k=0; k<taps; k+=2) {
+		memcpy(&val, p + k * 3 + 4, 4);
+		px = _mm_insert_epi32(_mm_loadl_epi64((__m128i *)(p + k * 3)),
+			val, 2);
+		memcpy(&val, c + k, 4);
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(
+			_mm_shuffle_epi8(px, sh), _mm_set1_epi32(val)));
+	}
+	return acc;
+}
+
+__attribute__((target("sse4.1")))
+static KERNEL_INLINE void xscale16_3_sse41_taps(int16_t *in, int16_t *out,
+	struct coeff_tbl *ct, uint32_t taps)
+{
+	uint32_t x, i, j;
+	uint64_t val;
+	int16_t *c;
+	int16_t *p;
+	__m128i round, shift, acc;
+
+	round = _mm_set1_epi32(1 << (ct->shift16 - 1));
+	shift = _mm_cvtsi32_si128(ct->shift16);
+
+	i = j = 0;
+	for (x=0; x<ct->dim_out; x++) {
+		c = tbl_next16(ct, in, 3, &i, &j, &p);
+		acc = xscale16_3_sum(p, c, taps);
+		val = _mm_cvtsi128_si64(xscale16_pack(acc, round, shift));
+		memcpy(out + x * 3, &val, 6);
+	}
+}
+
+/**
+ * Sums of a 4 component sample, from taps interleaved as [r0 r1 g0 g1 b0 b1 a0
+ * a1].
+ */
+__attribute__((target("sse4.1")))
+static KERNEL_INLINE void xscale16_4_sse41_taps(int16_t *in, int16_t *out,
+	struct coeff_tbl *ct, int filler, uint32_t taps)
+{
+	uint32_t x, i, j, k, val;
+	int16_t *c;
+	int16_t *p;
+	__m128i sh, round, shift, mask, acc;
+
+	sh = _mm_setr_epi8(0, 1, 8, 9, 2, 3, 10, 11,
+		4, 5, 12, 13, 6, 7, 14, 15);
+	round = _mm_set1_epi32(1 << (ct->shift16 - 1));
+	shift = _mm_cvtsi32_si128(ct->shift16);
+	mask = _mm_set1_epi64x(filler ? 0x0000FFFFFFFFFFFFll : -1ll);
+
+	i = j = 0;
+	for (x=0; x<ct->dim_out; x++) {
+		c = tbl_next16(ct, in, 4, &i, &j, &p);
+		acc = _mm_setzero_si128();
+		UNROLL_TAPS
+		for (k=0; k<taps; k+=2) {
+			memcpy(&val, c + k, 4);
+			acc = _mm_add_epi32(acc, _mm_madd_epi16(_mm_shuffle_epi8(
+				_mm_loadu_si128((__m128i *)(p + k * 4)), sh),
+				_mm_set1_epi32(val)));
+		}
+		_mm_storel_epi64((__m128i *)(out + x * 4), _mm_and_si128(
+			xscale16_pack(acc, round, shift), mask));
+	}
+}
+
+__attribute__((target("sse4.1")))
+static void xscale16_sse41(int16_t *in, int16_t *out, struct coeff_tbl *ct,
+	uint8_t cmp, int filler)
+{
+	switch (cmp) {
+#define XSCALE16(n, arg) xscale16_##arg##_sse41_taps(in, out, ct, n)
+	case 1:
+		TAPS_DISPATCH(ct->taps, XSCALE16, 1);
+		break;
+	case 2:
+		TAPS_DISPATCH(ct->taps, XSCALE16, 2);
+		break;
+	case 3:
+		TAPS_DISPATCH(ct->taps, XSCALE16, 3);
+		break;
+#undef XSCALE16
+#define XSCALE16(n, arg) xscale16_4_sse41_taps(in, out, ct, filler, n)
+	case 4:
+		TAPS_DISPATCH(ct->taps, XSCALE16, 0);
+		break;
+#undef XSCALE16
+	}
+}
+
+/* Vertical kernels.
+ *
+ * Every byte in the strip uses the same coefficients, so rows are processed in
+ * pairs: the bytes of rows j and j + 1 are widened and interleaved as 16-bit
+ * values [a0 b0 a1 b1 ...] and pmaddwd against [cj cj+1 ...] leaves 32-bit
+ * sums of both rows.
+ */
+
+/**
+ * Get the coefficients for rows j and j + 1 packed for pmaddwd. The second
+ * coefficient is zero past the end of an odd strip.
+ */
+static int32_t coeff_pair(int16_t *coeffs, uint32_t strip_height, uint32_t j)
+{
+	uint16_t c0, c1;
+	c0 = coeffs[j];
+	c1 = j + 1 < strip_height ? coeffs[j + 1] : 0;
+	return (int32_t)((uint32_t)c1 << 16 | c0);
+}
+
+/**
+ * Scalar version of the vector kernels for the bytes left over at the end of
+ * a scanline, so that they are rounded the same way.
+ */
+static void strip_scale_tail(uint8_t **in, uint32_t strip_height, size_t start,
+	size_t len, uint8_t *out, int16_t *coeffs, uint8_t shift)
+{
+	size_t i;
+	uint32_t j;
+	int32_t sum;
+
+	for (i=start; i<len; i++) {
+		sum = simd_round(shift);
+		for (j=0; j<strip_height; j++) {
+			sum += coeffs[j] * in[j][i];
+		}
+		sum >>= shift;
+		out[i] = sum < 0 ? 0 : (sum > 255 ? 255 : sum);
+	}
+}
+
+__attribute__((target("sse4.1")))
+static KERNEL_INLINE size_t strip_scale_sse41_taps(uint8_t **in,
+	uint32_t strip_height, size_t len, uint8_t *out, int16_t *coeffs,
+	uint8_t shift, uint32_t mask)
+{
+	size_t i;
+	uint32_t j;
+	__m128i zero, round, sh, cv, a, b, lo, hi, acc0, acc1, acc2, acc3, m;
+
+	zero = _mm_setzero_si128();
+	round = _mm_set1_epi32(simd_round(shift));
+	sh = _mm_cvtsi32_si128(shift);
+	m = _mm_set1_epi32(mask);
+
+	for (i=0; i+16<=len; i+=16) {
+		acc0 = acc1 = acc2 = acc3 = round;
+		UNROLL_TAPS
+		for (j=0; j<strip_height; j+=2) {
+			cv = _mm_set1_epi32(coeff_pair(coeffs, strip_height, j));
+			a = _mm_loadu_si128((__m128i *)(in[j] + i));
+			b = j + 1 < strip_height ?
+				_mm_loadu_si128((__m128i *)(in[j + 1] + i)) : zero;
+
+			lo = _mm_unpacklo_epi8(a, zero);
+			hi = _mm_unpacklo_epi8(b, zero);
+			acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(
+				_mm_unpacklo_epi16(lo, hi), cv));
+			acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(
+				_mm_unpackhi_epi16(lo, hi), cv));
+
+			lo = _mm_unpackhi_epi8(a, zero);
+			hi = _mm_unpackhi_epi8(b, zero);
+			acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(
+				_mm_unpacklo_epi16(lo, hi), cv));
+			acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(
+				_mm_unpackhi_epi16(lo, hi), cv));
+		}
+		acc0 = _mm_packs_epi32(_mm_sra_epi32(acc0, sh),
+			_mm_sra_epi32(acc1, sh));
+		acc2 = _mm_packs_epi32(_mm_sra_epi32(acc2, sh),
+			_mm_sra_epi32(acc3, sh));
+		acc0 = _mm_and_si128(_mm_packus_epi16(acc0, acc2), m);
+		_mm_storeu_si128((__m128i *)(out + i), acc0);
+	}
+	return i;
+}
+
+__attribute__((target("sse4.1")))
+static size_t strip_scale_sse41(uint8_t **in, uint32_t strip_height,
+	size_t len, uint8_t *out, int16_t *coeffs, uint8_t shift, uint32_t mask)
+{
+	size_t done;
+#define STRIP_SCALE(n, arg) \
+	done = strip_scale_sse41_taps(in, n, len, out, coeffs, shift, mask)
+	TAPS_DISPATCH(strip_height, STRIP_SCALE, 0);
+#undef STRIP_SCALE
+	return done;
+}
+
+__attribute__((target("avx2")))
+static KERNEL_INLINE size_t strip_scale_avx2_taps(uint8_t **in,
+	uint32_t strip_height, size_t len, uint8_t *out, int16_t *coeffs,
+	uint8_t shift, uint32_t mask)
+{
+	size_t i;
+	uint32_t j;
+	__m256i zero, round, cv, a, b, lo, hi, acc0, acc1, acc2, acc3, m;
+	__m128i sh;
+
+	zero = _mm256_setzero_si256();
+	round = _mm256_set1_epi32(simd_round(shift));
+	sh = _mm_cvtsi32_si128(shift);
+	m = _mm256_set1_epi32(mask);
+
+	/* The unpack and pack instructions work within 128-bit lanes, so the
+	 * output bytes end up back in order. */
+	for (i=0; i+32<=len; i+=32) {
+		acc0 = acc1 = acc2 = acc3 = round;
+		UNROLL_TAPS
+		for (j=0; j<strip_height; j+=2) {
+			cv = _mm256_set1_epi32(coeff_pair(coeffs, strip_height, j));
+			a = _mm256_loadu_si256((__m256i *)(in[j] + i));
+			b = j + 1 < strip_height ?
+				_mm256_loadu_si256((__m256i *)(in[j + 1] + i)) : zero;
+
+			lo = _mm256_unpacklo_epi8(a, zero);
+			hi = _mm256_unpacklo_epi8(b, zero);
+			acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(
+				_mm256_unpacklo_epi16(lo, hi), cv));
+			acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(
+				_mm256_unpackhi_epi16(lo, hi), cv));
+
+			lo = _mm256_unpackhi_epi8(a, zero);
+			hi = _mm256_unpackhi_epi8(b, zero);
+			acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(
+				_mm256_unpacklo_epi16(lo, hi), cv));
+			acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(
+				_mm256_unpackhi_epi16(lo, hi), cv));
+		}
+		acc0 = _mm256_packs_epi32(_mm256_sra_epi32(acc0, sh),
+			_mm256_sra_epi32(acc1, sh));
+		acc2 = _mm256_packs_epi32(_mm256_sra_epi32(acc2, sh),
+			_mm256_sra_epi32(acc3, sh));
+		acc0 = _mm256_and_si256(_mm256_packus_epi16(acc0, acc2), m);
+		_mm256_storeu_si256((__m256i *)(out + i), acc0);
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t strip_scale_avx2(uint8_t **in, uint32_t strip_height,
+	size_t len, uint8_t *out, int16_t *coeffs, uint8_t shift, uint32_t mask)
+{
+	size_t done;
+#define STRIP_SCALE(n, arg) \
+	done = strip_scale_avx2_taps(in, n, len, out, coeffs, shift, mask)
+	TAPS_DISPATCH(strip_height, STRIP_SCALE, 0);
+#undef STRIP_SCALE
+	return done;
+}
+
+/**
+ * Vertical kernels for int16_t samples. Rows j and j + 1 are interleaved
+ * as 16-bit values straight away.
+ */
+static void strip_scale16_tail(int16_t **in, uint32_t strip_height,
+	size_t start, size_t len, int16_t *out, int16_t *coeffs, uint8_t shift)
+{
+	size_t i;
+	uint32_t j;
+	int32_t sum;
+
+	for (i=start; i<len; i++) {
+		sum = 1 << (shift - 1);
+		for (j=0; j<strip_height; j++) {
+			sum += coeffs[j] * in[j][i];
+		}
+		sum >>= shift;
+		out[i] = sum < INT16_MIN ? INT16_MIN :
+			(sum > INT16_MAX ? INT16_MAX : sum);
+	}
+}
+
+__attribute__((target("sse4.1")))
+static KERNEL_INLINE size_t strip_scale16_sse41_taps(int16_t **in,
+	uint32_t strip_height, size_t len, int16_t *out, int16_t *coeffs,
+	uint8_t shift, uint64_t mask)
+{
+	size_t i;
+	uint32_t j;
+	__m128i zero, round, sh, cv, a, b, acc0, acc1, acc2, acc3, m;
+
+	zero = _mm_setzero_si128();
+	round = _mm_set1_epi32(1 << (shift - 1));
+	sh = _mm_cvtsi32_si128(shift);
+	m = _mm_set1_epi64x(mask);
+
+	for (i=0; i+16<=len; i+=16) {
+		acc0 = acc1 = acc2 = acc3 = round;
+		UNROLL_TAPS
+		for (j=0; j<strip_height; j+=2) {
+			cv = _mm_set1_epi32(coeff_pair(coeffs, strip_height, j));
+			a = _mm_loadu_si128((__m128i *)(in[j] + i));
+			b = j + 1 < strip_height ?
+				_mm_loadu_si128((__m128i *)(in[j + 1] + i)) : zero;
+			acc0 = _mm_add_epi32(acc0, _mm_madd_epi16(
+				_mm_unpacklo_epi16(a, b), cv));
+			acc1 = _mm_add_epi32(acc1, _mm_madd_epi16(
+				_mm_unpackhi_epi16(a, b), cv));
+
+			a = _mm_loadu_si128((__m128i *)(in[j] + i + 8));
+			b = j + 1 < strip_height ?
+				_mm_loadu_si128((__m128i *)(in[j + 1] + i + 8)) :
+				zero;
+			acc2 = _mm_add_epi32(acc2, _mm_madd_epi16(
+				_mm_unpacklo_epi16(a, b), cv));
+			acc3 = _mm_add_epi32(acc3, _mm_madd_epi16(
+				_mm_unpackhi_epi16(a, b), cv));
+		}
+		acc0 = _mm_packs_epi32(_mm_sra_epi32(acc0, sh),
+			_mm_sra_epi32(acc1, sh));
+		acc2 = _mm_packs_epi32(_mm_sra_epi32(acc2, sh),
+			_mm_sra_epi32(acc3, sh));
+		acc0 = _mm_and_si128(acc0, m);
+		acc2 = _mm_and_si128(acc2, m);
+		_mm_storeu_si128((__m128i *)(out + i), acc0);
+		_mm_storeu_si128((__m128i *)(out + i + 8), acc2);
+	}
+	return i;
+}
+
+__attribute__((target("sse4.1")))
+static size_t strip_scale16_sse41(int16_t **in, uint32_t strip_height,
+	size_t len, int16_t *out, int16_t *coeffs, uint8_t shift, uint64_t mask)
+{
+	size_t done;
+#define STRIP_SCALE16(n, arg) \
+	done = strip_scale16_sse41_taps(in, n, len, out, coeffs, shift, mask)
+	TAPS_DISPATCH(strip_height, STRIP_SCALE16, 0);
+#undef STRIP_SCALE16
+	return done;
+}
+
+__attribute__((target("avx2")))
+static KERNEL_INLINE size_t strip_scale16_avx2_taps(int16_t **in,
+	uint32_t strip_height, size_t len, int16_t *out, int16_t *coeffs,
+	uint8_t shift, uint64_t mask)
+{
+	size_t i;
+	uint32_t j;
+	__m256i zero, round, cv, a, b, acc0, acc1, acc2, acc3, m;
+	__m128i sh;
+
+	zero = _mm256_setzero_si256();
+	round = _mm256_set1_epi32(1 << (shift - 1));
+	sh = _mm_cvtsi32_si128(shift);
+	m = _mm256_set1_epi64x(mask);
+
+	/* as with bytes, unpacking and packing within 128-bit lanes leaves the
+	 * samples in order */
+	for (i=0; i+32<=len; i+=32) {
+		acc0 = acc1 = acc2 = acc3 = round;
+		UNROLL_TAPS
+		for (j=0; j<strip_height; j+=2) {
+			cv = _mm256_set1_epi32(coeff_pair(coeffs, strip_height, j));
+			a = _mm256_loadu_si256((__m256i *)(in[j] + i));
+			b = j + 1 < strip_height ?
+				_mm256_loadu_si256((__m256i *)(in[j + 1] + i)) :
+				zero;
+			acc0 = _mm256_add_epi32(acc0, _mm256_madd_epi16(
+				_mm256_unpacklo_epi16(a, b), cv));
+			acc1 = _mm256_add_epi32(acc1, _mm256_madd_epi16(
+				_mm256_unpackhi_epi16(a, b), cv));
+
+			a = _mm256_loadu_si256((__m256i *)(in[j] + i + 16));
+			b = j + 1 < strip_height ? _mm256_loadu_si256(
+				(__m256i *)(in[j + 1] + i + 16)) : zero;
+			acc2 = _mm256_add_epi32(acc2, _mm256_madd_epi16(
+				_mm256_unpacklo_epi16(a, b), cv));
+			acc3 = _mm256_add_epi32(acc3, _mm256_madd_epi16(
+				_mm256_unpackhi_epi16(a, b), cv));
+		}
+		acc0 = _mm256_packs_epi32(_mm256_sra_epi32(acc0, sh),
+			_mm256_sra_epi32(acc1, sh));
+		acc2 = _mm256_packs_epi32(_mm256_sra_epi32(acc2, sh),
+			_mm256_sra_epi32(acc3, sh));
+		acc0 = _mm256_and_si256(acc0, m);
+		acc2 = _mm256_and_si256(acc2, m);
+		_mm256_storeu_si256((__m256i *)(out + i), acc0);
+		_mm256_storeu_si256((__m256i *)(out + i + 16), acc2);
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t strip_scale16_avx2(int16_t **in, uint32_t strip_height,
+	size_t len, int16_t *out, int16_t *coeffs, uint8_t shift, uint64_t mask)
+{
+	size_t done;
+#define STRIP_SCALE16(n, arg) \
+	done = strip_scale16_avx2_taps(in, n, len, out, coeffs, shift, mask)
+	TAPS_DISPATCH(strip_height, STRIP_SCALE16, 0);
+#undef STRIP_SCALE16
+	return done;
+}
+
+/* premultiplied alpha
+ *
+ * Each sample is multiplied by the alpha of its pixel, and alpha by 255, which
+ * leaves it as it is. Shuffling alpha over the color samples of the pixel
+ * gives the multipliers for a whole vector at once.
+ */
+
+/**
+ * Byte shuffle from 16 bytes of pixels to the alpha of each sample, with zero
+ * in place of alpha itself, and the 255 that goes there instead.
+ */
+__attribute__((target("sse4.1")))
+static KERNEL_INLINE void premul_masks(uint8_t cmp, __m128i *sh, __m128i *one)
+{
+	if (cmp == 2) {
+		*sh = _mm_setr_epi8(1, -1, 3, -1, 5, -1, 7, -1,
+			9, -1, 11, -1, 13, -1, 15, -1);
+		*one = _mm_set1_epi16((int16_t)0xFF00);
+	} else {
+		*sh = _mm_setr_epi8(3, 3, 3, -1, 7, 7, 7, -1,
+			11, 11, 11, -1, 15, 15, 15, -1);
+		*one = _mm_set1_epi32((int32_t)0xFF000000);
+	}
+}
+
+/**
+ * round(c * m / 255) of 16-bit lanes as (t + (t >> 8)) >> 8, t = c * m + 128.
+ */
+__attribute__((target("sse4.1")))
+static KERNEL_INLINE __m128i premul_div255(__m128i c, __m128i m)
+{
+	__m128i t;
+
+	t = _mm_add_epi16(_mm_mullo_epi16(c, m), _mm_set1_epi16(128));
+	return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+__attribute__((target("avx2")))
+static KERNEL_INLINE __m256i premul_div255_avx2(__m256i c, __m256i m)
+{
+	__m256i t;
+
+	t = _mm256_add_epi16(_mm256_mullo_epi16(c, m),
+		_mm256_set1_epi16(128));
+	return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)),
+		8);
+}
+
+__attribute__((target("sse4.1")))
+static size_t premultiply_sse41(uint8_t *row, size_t len, uint8_t cmp)
+{
+	size_t i;
+	__m128i sh, one, px, m, lo, hi;
+
+	premul_masks(cmp, &sh, &one);
+	for (i=0; i+16<=len; i+=16) {
+		px = _mm_loadu_si128((__m128i *)(row + i));
+		m = _mm_or_si128(_mm_shuffle_epi8(px, sh), one);
+		lo = premul_div255(_mm_cvtepu8_epi16(px), _mm_cvtepu8_epi16(m));
+		hi = premul_div255(_mm_unpackhi_epi8(px, _mm_setzero_si128()),
+			_mm_unpackhi_epi8(m, _mm_setzero_si128()));
+		_mm_storeu_si128((__m128i *)(row + i), _mm_packus_epi16(lo, hi));
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t premultiply_avx2(uint8_t *row, size_t len, uint8_t cmp)
+{
+	size_t i;
+	__m128i sh, one, px, m;
+	__m256i r;
+
+	premul_masks(cmp, &sh, &one);
+	for (i=0; i+16<=len; i+=16) {
+		px = _mm_loadu_si128((__m128i *)(row + i));
+		m = _mm_or_si128(_mm_shuffle_epi8(px, sh), one);
+		r = premul_div255_avx2(_mm256_cvtepu8_epi16(px),
+			_mm256_cvtepu8_epi16(m));
+		_mm_storeu_si128((__m128i *)(row + i), _mm_packus_epi16(
+			_mm256_castsi256_si128(r),
+			_mm256_extracti128_si256(r, 1)));
+	}
+	return i;
+}
+
+/**
+ * Unpremultiply one 4 byte group: 1 RGBA pixel or 2 gray and alpha pixels.
+ * r holds the 16.16 reciprocal of each sample's alpha, and 1.0 for alpha.
+ * 255 * (255 << 16) still fits in 32 bits, and the packs clamp to 255.
+ */
+__attribute__((target("sse4.1")))
+static KERNEL_INLINE void unpremul_4(uint8_t *p, __m128i r)
+{
+	uint32_t v;
+	__m128i c;
+
+	memcpy(&v, p, 4);
+	c = _mm_mullo_epi32(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(v)), r);
+	c = _mm_srli_epi32(_mm_add_epi32(c, _mm_set1_epi32(1 << 15)), 16);
+	c = _mm_packus_epi32(c, c);
+	v = _mm_cvtsi128_si32(_mm_packus_epi16(c, c));
+	memcpy(p, &v, 4);
+}
+
+__attribute__((target("sse4.1")))
+static size_t unpremultiply_sse41(uint8_t *row, size_t len, uint8_t cmp,
+	const uint32_t *tbl)
+{
+	size_t i;
+
+	if (cmp == 4) {
+		for (i=0; i<len; i+=4) {
+			unpremul_4(row + i, _mm_setr_epi32(tbl[row[i + 3]],
+				tbl[row[i + 3]], tbl[row[i + 3]], 1 << 16));
+		}
+		return len;
+	}
+
+	for (i=0; i+4<=len; i+=4) {
+		unpremul_4(row + i, _mm_setr_epi32(tbl[row[i + 1]], 1 << 16,
+			tbl[row[i + 3]], 1 << 16));
+	}
+	return i;
+}
+
+/* box prefilter */
+
+__attribute__((target("sse4.1")))
+static size_t box_sum_sse41(uint16_t *sums, uint8_t *row, size_t len)
+{
+	size_t i;
+	__m128i a, b;
+
+	for (i=0; i+16<=len; i+=16) {
+		a = _mm_loadu_si128((__m128i *)(row + i));
+		b = _mm_loadu_si128((__m128i *)(sums + i));
+		b = _mm_add_epi16(b, _mm_cvtepu8_epi16(a));
+		_mm_storeu_si128((__m128i *)(sums + i), b);
+		b = _mm_loadu_si128((__m128i *)(sums + i + 8));
+		b = _mm_add_epi16(b, _mm_cvtepu8_epi16(_mm_srli_si128(a, 8)));
+		_mm_storeu_si128((__m128i *)(sums + i + 8), b);
+	}
+	return i;
+}
+
+__attribute__((target("avx2")))
+static size_t box_sum_avx2(uint16_t *sums, uint8_t *row, size_t len)
+{
+	size_t i;
+	__m256i b;
+
+	for (i=0; i+32<=len; i+=32) {
+		b = _mm256_loadu_si256((__m256i *)(sums + i));
+		b = _mm256_add_epi16(b, _mm256_cvtepu8_epi16(
+			_mm_loadu_si128((__m128i *)(row + i))));
+		_mm256_storeu_si256((__m256i *)(sums + i), b);
+		b = _mm256_loadu_si256((__m256i *)(sums + i + 16));
+		b = _mm256_add_epi16(b, _mm256_cvtepu8_epi16(
+			_mm_loadu_si128((__m128i *)(row + i + 16))));
+		_mm256_storeu_si256((__m256i *)(sums + i + 16), b);
+	}
+	return i;
+}
+
+#endif
+
+int simd_box_sum(uint16_t *sums, uint8_t *row, size_t len)
+{
+#ifdef HAVE_X86_SIMD
+	size_t i;
+
+	switch (simd_level()) {
+	case SIMD_AVX2:
+		i = box_sum_avx2(sums, row, len);
+		break;
+	case SIMD_SSE41:
+		i = box_sum_sse41(sums, row, len);
+		break;
+	default:
+		return 0;
+	}
+
+	for (; i<len; i++) {
+		sums[i] += row[i];
+	}
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+int simd_strip_scale(uint8_t **in, uint32_t strip_height, size_t len,
+	uint8_t *out, int16_t *coeffs, uint8_t shift, uint8_t cmp, int filler)
+{
+#ifdef HAVE_X86_SIMD
+	size_t done, i;
+	uint32_t mask;
+
+	/* with a filler byte, zero every 4th byte like strip_scale_rgbx() */
+	mask = cmp == 4 && filler ? 0x00FFFFFF : 0xFFFFFFFF;
+
+	switch (simd_level()) {
+	case SIMD_AVX2:
+		done = strip_scale_avx2(in, strip_height, len, out, coeffs,
+			shift, mask);
+		break;
+	case SIMD_SSE41:
+		done = strip_scale_sse41(in, strip_height, len, out, coeffs,
+			shift, mask);
+		break;
+	default:
+		return 0;
+	}
+
+	strip_scale_tail(in, strip_height, done, len, out, coeffs, shift);
+	if (mask != 0xFFFFFFFF) {
+		for (i=done+3; i<len; i+=4) {
+			out[i] = 0;
+		}
+	}
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+int simd_xscale(uint8_t *in, uint8_t *out, struct coeff_tbl *ct, uint8_t cmp,
+	int filler)
+{
+#ifdef HAVE_X86_SIMD
+	if (ct->taps % 2 || simd_level() < SIMD_SSE41) {
+		return 0;
+	}
+
+	switch (cmp) {
+	case 1:
+		xscale_8_sse41(in, out, ct);
+		return 1;
+	case 2:
+		xscale_16_sse41(in, out, ct);
+		return 1;
+	case 3:
+		xscale_24_sse41(in, out, ct);
+		return 1;
+	case 4:
+		if (simd_level() == SIMD_AVX2) {
+			xscale_32_avx2(in, out, ct, filler);
+		} else {
+			xscale_32_sse41(in, out, ct, filler);
+		}
+		return 1;
+	}
+#endif
+	return 0;
+}
+
+int simd_strip_scale16(int16_t **in, uint32_t strip_height, size_t len,
+	int16_t *out, int16_t *coeffs, uint8_t shift, uint8_t cmp, int filler)
+{
+#ifdef HAVE_X86_SIMD
+	size_t done, i;
+	uint64_t mask;
+
+	mask = cmp == 4 && filler ? 0x0000FFFFFFFFFFFFull : ~0ull;
+
+	switch (simd_level()) {
+	case SIMD_AVX2:
+		done = strip_scale16_avx2(in, strip_height, len, out, coeffs,
+			shift, mask);
+		break;
+	case SIMD_SSE41:
+		done = strip_scale16_sse41(in, strip_height, len, out, coeffs,
+			shift, mask);
+		break;
+	default:
+		return 0;
+	}
+
+	strip_scale16_tail(in, strip_height, done, len, out, coeffs, shift);
+	if (mask != ~0ull) {
+		for (i=done+3; i<len; i+=4) {
+			out[i] = 0;
+		}
+	}
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+int simd_xscale16(int16_t *in, int16_t *out, struct coeff_tbl *ct,
+	uint8_t cmp, int filler)
+{
+#ifdef HAVE_X86_SIMD
+	if (ct->taps % 2 || cmp > 4 || simd_level() < SIMD_SSE41) {
+		return 0;
+	}
+	xscale16_sse41(in, out, ct, cmp, filler);
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+size_t simd_premultiply(uint8_t *row, size_t len, uint8_t cmp)
+{
+#ifdef HAVE_X86_SIMD
+	if (cmp != 2 && cmp != 4) {
+		return 0;
+	}
+	switch (simd_level()) {
+	case SIMD_AVX2:
+		return premultiply_avx2(row, len, cmp);
+	case SIMD_SSE41:
+		return premultiply_sse41(row, len, cmp);
+	}
+#endif
+	return 0;
+}
+
+size_t simd_unpremultiply(uint8_t *row, size_t len, uint8_t cmp,
+	const uint32_t *tbl)
+{
+#ifdef HAVE_X86_SIMD
+	if ((cmp == 2 || cmp == 4) && simd_level() >= SIMD_SSE41) {
+		return unpremultiply_sse41(row, len, cmp, tbl);
+	}
+#endif
+	return 0;
+}
@@ -0,0 +1,134 @@
+/**
+ * Copyright (c) 2014-2016 Timothy Elliott
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef RESAMPLE_SIMD_H
+#define RESAMPLE_SIMD_H
+
+#include "resample.h"
+#include <stdint.h>
+
+/**
+ * SIMD levels, in increasing order of capability.
+ */
+#define SIMD_NONE 0
+#define SIMD_SSE41 1
+#define SIMD_AVX2 2
+
+/**
+ * The highest SIMD level that may be used. Set it at build time to force a
+ * lower level, e.g. -DRESAMPLE_SIMD=0 to run the scalar kernels only.
+ */
+#ifndef RESAMPLE_SIMD
+#define RESAMPLE_SIMD SIMD_AVX2
+#endif
+
+/**
+ * Put before a tap loop, so it gets unrolled even with -Os.
+ */
+#if defined(__GNUC__) && __GNUC__ >= 8 && !defined(__clang__)
+#define UNROLL_TAPS _Pragma("GCC unroll 16")
+#else
+#define UNROLL_TAPS
+#endif
+
+/**
+ * Kernels are written as inline functions that take the tap count as an
+ * argument, and are called through TAPS_DISPATCH() with a constant for the
+ * common tap counts: 2, 4 and 6 for enlarging with the different filters, 8,
+ * 12 and 16 for reducing by 2x and 4x. Each of those calls is compiled into its
+ * own copy of the kernel with the tap loop unrolled, and any other tap count
+ * runs the generic copy.
+ *
+ * call is a macro that takes the tap count and arg.
+ */
+#ifdef __GNUC__
+#define KERNEL_INLINE inline __attribute__((always_inline))
+#else
+#define KERNEL_INLINE inline
+#endif
+
+#define TAPS_DISPATCH(taps, call, arg) do { \
+	switch (taps) { \
+	case 2: call(2, arg); break; \
+	case 4: call(4, arg); break; \
+	case 6: call(6, arg); break; \
+	case 8: call(8, arg); break; \
+	case 12: call(12, arg); break; \
+	case 16: call(16, arg); break; \
+	default: call(taps, arg); break; \
+	} \
+} while (0)
+
+/**
+ * Return the SIMD level that will be used on this CPU, detected on first use
+ * and capped by RESAMPLE_SIMD.
+ */
+int simd_level(void);
+
+/**
+ * Scale padded scanline in to scanline out with the coefficient table ct using
+ * the best available SIMD kernel.
+ *
+ * Returns 1 if the scanline was scaled, or 0 if there is no SIMD kernel for
+ * this layout and the scalar kernel must be used instead.
+ */
+int simd_xscale(uint8_t *in, uint8_t *out, struct coeff_tbl *ct, uint8_t cmp,
+	int filler);
+
+/**
+ * Scale a strip of strip_height scanlines of len bytes each into out, using
+ * 16-bit coefficients with shift fractional bits. All samples use the same
+ * coefficients, so the kernels work across the whole scanline regardless of
+ * cmp.
+ *
+ * Returns 1 if the strip was scaled, or 0 if the scalar kernel must be used.
+ */
+int simd_strip_scale(uint8_t **in, uint32_t strip_height, size_t len,
+	uint8_t *out, int16_t *coeffs, uint8_t shift, uint8_t cmp, int filler);
+
+/**
+ * simd_xscale() and simd_strip_scale() for int16_t samples, which saturate.
+ * len is in samples, and the 16-bit coefficients have to leave room for the
+ * larger samples in the int32_t sums.
+ */
+int simd_xscale16(int16_t *in, int16_t *out, struct coeff_tbl *ct,
+	uint8_t cmp, int filler);
+int simd_strip_scale16(int16_t **in, uint32_t strip_height, size_t len,
+	int16_t *out, int16_t *coeffs, uint8_t shift, uint8_t cmp, int filler);
+
+/**
+ * Premultiply the len bytes of row, pixels of cmp 2 or 4 with alpha last, or
+ * undo it with tbl, the 16.16 reciprocals of alpha.
+ *
+ * Return how many bytes were done. The scalar loop finishes the rest.
+ */
+size_t simd_premultiply(uint8_t *row, size_t len, uint8_t cmp);
+size_t simd_unpremultiply(uint8_t *row, size_t len, uint8_t cmp,
+	const uint32_t *tbl);
+
+/**
+ * Add the len bytes of row to the 16-bit column sums of the box prefilter.
+ *
+ * Returns 1 if the row was added, or 0 if the scalar loop must be used.
+ */
+int simd_box_sum(uint16_t *sums, uint8_t *row, size_t len);
+
+#endif
@@ -0,0 +1,91 @@
+/**
+ * Copyright (c) 2014-2016 Timothy Elliott
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "stats.h"
+
+#ifdef IMGSCALE_STATS
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static const char *stage_names[STATS_STAGES] = {
+	"decode", "xscale", "yscale", "encode"
+};
+
+struct imgscale_stats *stats_begin(struct imgscale_stats *st)
+{
+	const char *env;
+
+	env = getenv("IMGSCALE_STATS");
+	if (!env || !*env || !strcmp(env, "0")) {
+		return NULL;
+	}
+
+	memset(st, 0, sizeof(struct imgscale_stats));
+	st->mode = "stream";
+	st->filter = "catrom";
+	st->scale_num = 1;
+	st->scale_denom = 1;
+	st->bytes_in = -1;
+	st->bytes_out = -1;
+	st->start = stats_now();
+	return st;
+}
+
+uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void stats_print(struct imgscale_stats *st, FILE *f, const char *tool)
+{
+	int i;
+
+	if (!st) {
+		return;
+	}
+
+	flockfile(f);
+	fprintf(f, "{\"tool\":\"%s\",\"mode\":\"%s\",\"filter\":\"%s\","
+		"\"order\":\"%s\",\"total_ns\":%" PRIu64, tool, st->mode,
+		st->filter, st->y_first ? "yx" : "xy",
+		stats_now() - st->start);
+	for (i=0; i<STATS_STAGES; i++) {
+		fprintf(f, ",\"%s_ns\":%" PRIu64 ",\"%s_rows\":%" PRIu64,
+			stage_names[i], st->ns[i], stage_names[i], st->rows[i]);
+	}
+	fprintf(f, ",\"in\":[%" PRIu32 ",%" PRIu32 "],\"out\":[%" PRIu32 ",%"
+		PRIu32 "],\"cmp\":%d,\"taps\":[%" PRIu32 ",%" PRIu32 "],"
+		"\"scale\":[%" PRIu32 ",%" PRIu32 "],\"bytes_in\":%ld,"
+		"\"bytes_out\":%ld,\"peak_mem\":%zu}\n", st->in_width, st->in_height,
+		st->out_width, st->out_height, st->cmp, st->taps_x, st->taps_y,
+		st->scale_num, st->scale_denom, st->bytes_in, st->bytes_out,
+		st->peak_mem);
+	fflush(f);
+	funlockfile(f);
+}
+
+#endif
@@ -0,0 +1,133 @@
+/**
+ * Copyright (c) 2014-2016 Timothy Elliott
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Per-image timings and counters, built in with -DIMGSCALE_STATS and turned on
+ * by setting IMGSCALE_STATS in the environment. Without -DIMGSCALE_STATS the
+ * STATS() macro drops every use, so they cost nothing.
+ *
+ * Code that records stats keeps a pointer that stats_begin() sets to NULL when
+ * they are turned off:
+ *
+ *     STATS(uint64_t t;)
+ *
+ *     STATS(st = stats_begin(&stats);)
+ *     STATS(t = stats_start(st);)
+ *     jpeg_read_scanlines(dinfo, &row, 1);
+ *     STATS(stats_add(st, STATS_DECODE, t, 1);)
+ *     ...
+ *     STATS(stats_print(st, stderr, "jpgscale");)
+ */
+#ifdef IMGSCALE_STATS
+#define STATS(x) x
+#else
+#define STATS(x)
+#endif
+
+/**
+ * Stages that get timed.
+ */
+enum stats_stage {
+	STATS_DECODE,
+	STATS_XSCALE,
+	STATS_YSCALE,
+	STATS_ENCODE,
+	STATS_STAGES
+};
+
+struct imgscale_stats {
+	uint64_t start; // stats_begin() time in ns
+	uint64_t ns[STATS_STAGES]; // time spent in each stage
+	uint64_t rows[STATS_STAGES]; // scanlines through each stage
+	const char *mode; // which scaling path was taken
+	const char *filter; // filter_name() of the resampling filter
+	int y_first; // y-scaled before x-scaling, see yscale_first()
+	uint32_t in_width; // decoded size
+	uint32_t in_height;
+	uint32_t out_width;
+	uint32_t out_height;
+	uint8_t cmp;
+	uint32_t taps_x; // filter taps, 0 if unknown
+	uint32_t taps_y;
+	uint32_t scale_num; // scaling done by the decoder
+	uint32_t scale_denom;
+	long bytes_in; // compressed sizes, -1 if unknown
+	long bytes_out;
+	size_t peak_mem; // buffers held at once while scaling the image
+};
+
+#ifdef IMGSCALE_STATS
+
+/**
+ * Reset st and start the clock. Returns st, or NULL if stats are turned off.
+ */
+struct imgscale_stats *stats_begin(struct imgscale_stats *st);
+
+/**
+ * Monotonic time in ns.
+ */
+uint64_t stats_now(void);
+
+/**
+ * Start timing a stage. Returns 0 without reading the clock if st is NULL.
+ */
+static inline uint64_t stats_start(struct imgscale_stats *st)
+{
+	return st ? stats_now() : 0;
+}
+
+/**
+ * Add the time since start and rows scanlines to a stage.
+ */
+static inline void stats_add(struct imgscale_stats *st,
+	enum stats_stage stage, uint64_t start, uint32_t rows)
+{
+	if (st) {
+		st->ns[stage] += stats_now() - start;
+		st->rows[stage] += rows;
+	}
+}
+
+/**
+ * Count a buffer of len bytes that is held until the image is done.
+ */
+static inline void stats_alloc(struct imgscale_stats *st, size_t len)
+{
+	if (st) {
+		st->peak_mem += len;
+	}
+}
+
+/**
+ * Write the stats as a single line of JSON.
+ */
+void stats_print(struct imgscale_stats *st, FILE *f, const char *tool);
+
+#endif
+
+#endif